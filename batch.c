@@ -0,0 +1,224 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <sexp.h>
+
+#include "qvm.h"
+#include "batch.h"
+#include "frame.h"
+#include "truncation.h"
+#include "wires.h"
+
+typedef struct record {
+  char* file;
+  pid_t pid;
+  FILE* output;   // what the child printed
+  bool done;
+  bool ok;
+  double cpu;
+} record_t;
+
+typedef struct file_list {
+  char** files;
+  size_t size;
+  size_t capacity;
+} file_list_t;
+
+static void add_file( file_list_t* list, const char* file ) {
+  if( list->size == list->capacity ) {
+    list->capacity = list->capacity ? 2 * list->capacity : 64;
+    list->files = realloc( list->files, list->capacity * sizeof(char*) );
+  }
+  list->files[list->size] = strdup( file );
+  if( list->files == NULL || list->files[list->size] == NULL ) {
+    printf("ERROR: out of memory listing the batch\n");
+    exit(EXIT_FAILURE);
+  }
+  ++list->size;
+}
+
+static int compare_files( const void* a, const void* b ) {
+  return strcmp( *(char* const*)a, *(char* const*)b );
+}
+
+/* the *.mc files of a directory in name order */
+static void add_directory( file_list_t* list, const char* path ) {
+  DIR* dir = opendir( path );
+  const size_t first = list->size;
+  char file[4096];
+
+  if( dir == NULL ) {
+    printf("ERROR: cannot read directory %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  for( struct dirent* entry = readdir( dir ); entry; entry = readdir( dir ) ) {
+    const size_t length = strlen( entry->d_name );
+    if( length > 3 && strcmp( entry->d_name + length - 3, ".mc" ) == 0 &&
+	snprintf( file, sizeof(file), "%s/%s", path, entry->d_name ) <
+	(int)sizeof(file) )
+      add_file( list, file );
+  }
+  closedir( dir );
+  qsort( list->files + first, list->size - first, sizeof(char*),
+	 compare_files );
+}
+
+static sexp_t* read_program( const char* file ) {
+  const int fd = open( file, O_RDONLY );
+  if( fd < 0 )
+    return NULL;
+  sexp_iowrap_t* input_port = init_iowrap( fd );
+  sexp_t* program = read_one_sexp( input_port );
+  destroy_iowrap( input_port );
+  close( fd );
+  return program;
+}
+
+/* the child, with stdout on its record */
+static void run_file( sexp_t* program, qmem_t* restrict qmem, bool shorten ) {
+  if( shorten )
+    shorten_wires( program, qmem, true );
+  eval( program->list, qmem );
+  frame_flush( qmem );
+  normalize_qmem( qmem );
+  if( fetch_first_tangle( qmem ) )
+    write_output_state( stdout, qmem );
+  else
+    printf("()\n");  // every qubit was measured
+  truncation_print();
+  fflush( stdout );
+  _exit(EXIT_SUCCESS);
+}
+
+static void print_record( record_t* restrict record ) {
+  char buffer[4096];
+  size_t bytes;
+
+  printf(";; %s %s %.6f\n", record->file, record->ok ? "ok" : "failed",
+	 record->cpu);
+  rewind( record->output );
+  while( (bytes = fread( buffer, 1, sizeof(buffer), record->output )) > 0 )
+    fwrite( buffer, 1, bytes, stdout );
+  fclose( record->output );
+  record->output = NULL;
+}
+
+size_t batch_run( char* const* paths,
+		  int count,
+		  qmem_t* restrict qmem,
+		  size_t jobs,
+		  bool shorten,
+		  bool seeded,
+		  unsigned long long seed ) {
+  file_list_t list = { NULL, 0, 0 };
+  struct stat st;
+  struct rusage usage;
+  int status;
+
+  assert( qmem );
+  if( jobs == 0 ) {
+    const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    jobs = cpus > 0 ? cpus : 1;
+  }
+  for( int i=0; i<count; ++i )
+    if( stat( paths[i], &st ) == 0 && S_ISDIR(st.st_mode) )
+      add_directory( &list, paths[i] );
+    else
+      add_file( &list, paths[i] );
+  if( list.size == 0 ) {
+    printf("ERROR: no pattern files for --batch\n");
+    exit(EXIT_FAILURE);
+  }
+
+  record_t* records = calloc( list.size, sizeof(record_t) );
+  size_t launched = 0, finished = 0, printed = 0, active = 0, failed = 0;
+  double cpu = 0;
+  sexp_t* next = read_program( list.files[0] );
+
+  while( finished < list.size ) {
+    if( active < jobs && launched < list.size ) {
+      record_t* record = &records[launched];
+      record->file = list.files[launched];
+      record->output = tmpfile();
+      if( record->output == NULL ) {
+	perror("ERROR: creating batch record");
+	exit(EXIT_FAILURE);
+      }
+      const unsigned long long file_seed = seeded ? seed : qmem_rand( qmem );
+      if( next == NULL || next->ty != SEXP_LIST ) {
+	fprintf( record->output, "ERROR: cannot read a program from %s\n",
+		 record->file );
+	record->done = true;
+	++finished;
+      }
+      else {
+	fflush( stdout );
+	record->pid = fork();
+	if( record->pid < 0 ) {
+	  perror("ERROR: forking batch job");
+	  exit(EXIT_FAILURE);
+	}
+	if( record->pid == 0 ) {
+	  dup2( fileno( record->output ), STDOUT_FILENO );
+	  // unknown angle constants must not wait for the terminal
+	  if( freopen( "/dev/null", "r", stdin ) == NULL )
+	    _exit(EXIT_FAILURE);
+	  qmem->rng = file_seed;
+	  run_file( next, qmem, shorten );
+	}
+	++active;
+      }
+      destroy_sexp( next );
+      // parsed while the children evaluate
+      ++launched;
+      next = launched < list.size ? read_program( list.files[launched] ) :
+	NULL;
+    }
+    else {
+      const pid_t pid = wait4( -1, &status, 0, &usage );
+      if( pid < 0 ) {
+	perror("ERROR: waiting for batch job");
+	exit(EXIT_FAILURE);
+      }
+      for( size_t r=printed; r<launched; ++r ) {
+	if( records[r].done || records[r].pid != pid )
+	  continue;
+	records[r].done = true;
+	records[r].ok = WIFEXITED(status) &&
+	  WEXITSTATUS(status) == EXIT_SUCCESS;
+	records[r].cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+	  1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+	cpu += records[r].cpu;
+	++finished;
+	--active;
+	break;
+      }
+    }
+    // records come out in the order of the files
+    while( printed < launched && records[printed].done ) {
+      failed += !records[printed].ok;
+      print_record( &records[printed] );
+      free( list.files[printed] );
+      ++printed;
+    }
+  }
+
+  printf(";; batch of %lu files: %lu ok, %lu failed, %.6f cpu seconds\n",
+	 (unsigned long)list.size, (unsigned long)(list.size - failed),
+	 (unsigned long)failed, cpu);
+  free( records );
+  free( list.files );
+  return failed;
+}
@@ -0,0 +1,26 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "qvm.h"
+
+/* Batch mode (--batch file|dir ...).
+   Runs many pattern files in one process.  Directories stand for the *.mc
+   files in them, in name order.  Every file is evaluated in a fork() of
+   the batch process, at most jobs at a time, while the parent reads and
+   parses the next file.  One record per file is printed, in the order of
+   the files:
+     ;; file ok|failed cpu seconds
+   followed by its output state in the format of -o, or by the ERROR that
+   stopped it.  Returns the number of failed files. */
+
+// jobs == 0 runs one file per online CPU at a time, a seed is used for
+// every file
+size_t batch_run( char* const* paths,
+		  int count,
+		  qmem_t* restrict qmem,
+		  size_t jobs,
+		  bool shorten,
+		  bool seeded,
+		  unsigned long long seed );
+
+#endif
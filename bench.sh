@@ -0,0 +1,188 @@
+#!/bin/bash
+#
+# Benchmark driver, replaces membench.sh.
+#
+# Runs the qft/, qft_new/ and small pattern corpora with fixed seeds,
+# REPEATS times each, using qvm --stats to collect wall/cpu time, peak RSS,
+# peak tangle width, commands/s and amplitude updates/s.  Writes
+#   bench_results/bench-<stamp>.csv   one row per benchmark (mean, stddev, min)
+#   bench_results/bench-<stamp>.json  the same, as a JSON array
+# and compares mean wall time against bench_results/baseline.csv.
+#
+#   ./bench.sh                 run and compare
+#   ./bench.sh --save-baseline run and store the result as the new baseline
+#   ./bench.sh --placement     run one large dense pattern under every --numa
+#                              policy and --huge-pages mode instead, into
+#                              bench_results/placement-<stamp>.csv
+#   ./bench.sh --check-mps     record the outcomes of every pattern with the
+#                              tangle evaluator, replay them with --mps and
+#                              compare the output files (scripts/cmpstate.py),
+#                              with a bond of MPS_BOND so nothing is truncated
+#
+# Environment: QVM (binary, ./qvm), REPEATS (5), SEED (1), QFT_MAX (14),
+#              BASELINE (bench_results/baseline.csv),
+#              PLACEMENT_PATTERN (random:22,4), MPS_BOND (1024)
+
+QVM=${QVM:-./qvm}
+REPEATS=${REPEATS:-5}
+SEED=${SEED:-1}
+QFT_MAX=${QFT_MAX:-14}
+OUT_DIR=bench_results
+BASELINE=${BASELINE:-$OUT_DIR/baseline.csv}
+FIELDS="wall_s cpu_s peak_rss_kb peak_tangle_width commands commands_per_s amplitude_updates_per_s"
+
+if [ ! -x "$QVM" ]; then
+    echo "ERROR: $QVM not found, run make first" >&2
+    exit 1
+fi
+
+stamp=`date +%Y%m%d-%H%M%S`
+csv=$OUT_DIR/bench-$stamp.csv
+json=$OUT_DIR/bench-$stamp.json
+stats=`mktemp /tmp/qvm-stats.XXXXXX`
+samples=`mktemp /tmp/qvm-samples.XXXXXX`
+trap "rm -f $stats $samples" EXIT
+mkdir -p $OUT_DIR
+
+if [ "$1" == "--placement" ]; then
+    pattern=${PLACEMENT_PATTERN:-random:22,4}
+    csv=$OUT_DIR/placement-$stamp.csv
+    echo "numa,huge_pages,repeats,wall_s_mean,wall_s_min,peak_rss_kb" > $csv
+    for numa in default interleave blocked local; do
+	for pages in off transparent explicit; do
+	    : > $samples
+	    for r in `seq 1 $REPEATS`; do
+		if ! $QVM -s --seed=$SEED --stats=$stats \
+		    --numa=$numa --huge-pages=$pages --generate=$pattern \
+		    > /dev/null 2>&1; then
+		    echo "WARNING: --numa=$numa --huge-pages=$pages failed" >&2
+		    continue 3
+		fi
+		line=""
+		for field in wall_s peak_rss_kb; do
+		    value=`sed -n "s/^ *\"$field\": \([0-9.e+-]*\).*/\1/p" $stats`
+		    line="$line ${value:-0}"
+		done
+		echo $line >> $samples
+	    done
+	    awk -v numa=$numa -v pages=$pages -v repeats=$REPEATS '
+		{ sum += $1; if( NR==1 || $1 < min ) min = $1;
+		  if( $2 > rss ) rss = $2 }
+		END { printf "%s,%s,%d,%g,%g,%d\n",
+			     numa, pages, repeats, sum/NR, min, rss }' \
+		$samples >> $csv
+	    echo "--numa=$numa --huge-pages=$pages done" >&2
+	done
+    done
+    cat $csv
+    echo "results in $csv"
+    exit 0
+fi
+
+programs=""
+for n in `seq 2 $QFT_MAX`; do
+    [ -f qft_new/qft$n.mc ] && programs="$programs qft_new/qft$n.mc"
+done
+programs="$programs cnot.mc ghz-3.mc ghz-7.mc identity.mc j.mc rot.mc w3.mc"
+
+if [ "$1" == "--check-mps" ]; then
+    trace=`mktemp /tmp/qvm-trace.XXXXXX`
+    tangles=`mktemp /tmp/qvm-tangles.XXXXXX`
+    chain=`mktemp /tmp/qvm-mps.XXXXXX`
+    trap "rm -f $stats $samples $trace $tangles $chain" EXIT
+    failed=0
+    for program in $programs; do
+	# j.mc asks for its angle on stdin
+	if ! echo 0.7 | ALPHA=0.7 $QVM -s --seed=$SEED --record=$trace \
+	    -o$tangles $program > /dev/null 2>&1 ||
+	    ! echo 0.7 | ALPHA=0.7 $QVM -s --mps=${MPS_BOND:-1024} --replay=$trace \
+	    -o$chain $program > /dev/null 2>&1; then
+	    echo "$program: FAILED to run" >&2
+	    failed=1
+	    continue
+	fi
+	if ! result=`python3 scripts/cmpstate.py $tangles $chain`; then
+	    failed=1
+	    result="$result  MISMATCH"
+	fi
+	echo "$program: $result"
+    done
+    exit $failed
+fi
+
+programs=""
+for n in `seq 2 $QFT_MAX`; do
+    [ -f qft/qft$n.mc ] && programs="$programs qft/qft$n.mc"
+done
+for n in `seq 2 $QFT_MAX`; do
+    [ -f qft_new/qft$n.mc ] && programs="$programs qft_new/qft$n.mc"
+done
+programs="$programs cnot.mc ghz-3.mc ghz-7.mc identity.mc j.mc rot.mc w3.mc"
+
+# header: benchmark,repeats,<field>_mean,<field>_stddev,<field>_min,...
+echo -n "benchmark,repeats" > $csv
+for field in $FIELDS; do
+    echo -n ",${field}_mean,${field}_stddev,${field}_min" >> $csv
+done
+echo >> $csv
+
+for program in $programs; do
+    : > $samples
+    for r in `seq 1 $REPEATS`; do
+	# j.mc asks for its angle on stdin
+	if ! echo 0.7 | ALPHA=0.7 $QVM -s --seed=$SEED --stats=$stats \
+	    $program > /dev/null 2>&1; then
+	    echo "WARNING: $program failed" >&2
+	    continue 2
+	fi
+	line=""
+	for field in $FIELDS; do
+	    value=`sed -n "s/^ *\"$field\": \([0-9.e+-]*\).*/\1/p" $stats`
+	    line="$line ${value:-0}"
+	done
+	echo $line >> $samples
+    done
+    awk -v name=$program -v repeats=$REPEATS '
+	{ for( i=1; i<=NF; ++i ) {
+	    sum[i] += $i; sq[i] += $i*$i;
+	    if( NR==1 || $i < min[i] ) min[i] = $i } }
+	END { printf "%s,%d", name, repeats;
+	      for( i=1; i<=NF; ++i ) {
+		mean = sum[i]/NR; var = sq[i]/NR - mean*mean;
+		printf ",%g,%g,%g", mean, (var > 0 ? sqrt(var) : 0), min[i] }
+	      printf "\n" }' $samples >> $csv
+    echo "$program done" >&2
+done
+
+# the same table as JSON, keyed by the CSV header
+awk -F, '
+    NR==1 { for( i=1; i<=NF; ++i ) key[i] = $i; n = NF; print "["; next }
+    { if( NR>2 ) print ",";
+      printf "  {\"%s\": \"%s\"", key[1], $1;
+      for( i=2; i<=n; ++i ) printf ", \"%s\": %s", key[i], $i;
+      printf "}" }
+    END { print "\n]" }' $csv > $json
+
+echo "results in $csv and $json"
+
+if [ "$1" == "--save-baseline" ]; then
+    cp $csv $BASELINE
+    echo "saved as baseline $BASELINE"
+elif [ -f $BASELINE ]; then
+    # wall_s_mean and wall_s_stddev are columns 3 and 4
+    echo "comparison against $BASELINE (mean wall time):"
+    awk -F, '
+	FNR==1 { next }
+	NR==FNR { base[$1] = $3; base_sd[$1] = $4; next }
+	($1 in base) && base[$1] > 0 {
+	    ratio = $3 / base[$1];
+	    noise = 2 * ($4 + base_sd[$1]);
+	    flag = "";
+	    if( $3 - base[$1] > noise ) flag = "  SLOWER";
+	    if( base[$1] - $3 > noise ) flag = "  faster";
+	    printf "  %-22s %10.6f s  vs %10.6f s  x%.3f%s\n",
+		   $1, $3, base[$1], ratio, flag }' $BASELINE $csv \
+	| tee $OUT_DIR/bench-$stamp.compare
+else
+    echo "no baseline at $BASELINE, store one with ./bench.sh --save-baseline"
+fi
@@ -0,0 +1,376 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sexp.h>
+#include <cstring.h>
+
+#include "qvm.h"
+#include "checkpoint.h"
+#include "dense.h"
+#include "outofcore.h"
+
+#define CHECKPOINT_MAGIC "QVMCKPT"
+#define CHECKPOINT_VERSION 3
+
+typedef struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_tangles;
+  uint64_t program_hash;
+  uint64_t pc;
+  uint64_t rng;
+} checkpoint_header_t;
+
+typedef struct checkpoint_tangle {
+  uint32_t slot;
+  int32_t size;   // number of qids
+  int32_t width;  // qureg
+  int32_t nodes;
+  int32_t hashw;
+  int32_t dense;  // 2^width amplitudes follow instead of nodes
+} checkpoint_tangle_t;
+
+static const char* _checkpoint_file_ = NULL;
+static size_t _checkpoint_every_ = 0;
+static unsigned long long _program_hash_ = 0;
+
+static volatile sig_atomic_t _checkpoint_requested_ = 0;
+
+// one-slot mailbox between the evaluator and the writer thread; only the
+// evaluator frees qmems, libquantum's memory counter is not thread safe
+static pthread_t _writer_;
+static bool _writer_running_ = false;
+static pthread_mutex_t _mailbox_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _mailbox_cond_ = PTHREAD_COND_INITIALIZER;
+static qmem_t* _pending_ = NULL;
+// written snapshots, the one taken and the one posted meanwhile at most
+static qmem_t* _written_[2] = { NULL, NULL };
+static int _write_error_ = 0;  // errno of the first failed write
+static bool _stopping_ = false;
+
+/* FNV-1a over the printed program, so whitespace and comments in the source
+   file do not matter */
+unsigned long long checkpoint_program_hash( const sexp_t* program ) {
+  CSTRING* str = NULL;
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  print_sexp_cstr( &str, program, (size_t)UCHAR_MAX );
+  for( const char* c = toCharPtr(str); c && *c; ++c ) {
+    hash ^= (unsigned char)*c;
+    hash *= 0x100000001b3ULL;
+  }
+  sdestroy( str );
+  return hash;
+}
+
+static bool write_block( const void* data, size_t size, FILE* file ) {
+  return size == 0 || fwrite( data, size, 1, file ) == 1;
+}
+
+static void read_or_die( void* data, size_t size, FILE* file ) {
+  if( size && fread( data, size, 1, file ) != 1 ) {
+    fprintf(stderr, "ERROR: checkpoint file is truncated\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* the amplitudes of a dense tangle block by block, so that out-of-core
+   ones never need to be in memory all at once */
+static bool write_dense( const tangle_t* restrict tangle, FILE* file ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const size_t bytes = (states - block > OOC_BLOCK ?
+			  OOC_BLOCK : states - block) * sizeof(COMPLEX_FLOAT);
+    if( !write_block( tangle->amplitudes + block, bytes, file ) )
+      return false;
+    ooc_release( tangle->amplitudes, block * sizeof(COMPLEX_FLOAT), bytes );
+  }
+  return true;
+}
+
+static void read_dense( tangle_t* restrict tangle, int width, FILE* file ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << width;
+  COMPLEX_FLOAT* amplitudes = ooc_alloc( states * sizeof(COMPLEX_FLOAT) );
+  if( amplitudes == NULL ) {
+    fprintf(stderr, "ERROR: out of memory for a dense tangle of width %d\n",
+	    width);
+    exit(EXIT_FAILURE);
+  }
+  size_t occupied = 0;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = states - block > OOC_BLOCK ?
+      block + OOC_BLOCK : states;
+    read_or_die( amplitudes + block, (end - block) * sizeof(COMPLEX_FLOAT),
+		 file );
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      occupied += quantum_prob_inline( amplitudes[i] ) > DENSE_EPSILON;
+    ooc_release( amplitudes, block * sizeof(COMPLEX_FLOAT),
+		 (end - block) * sizeof(COMPLEX_FLOAT) );
+  }
+  tangle->qureg.width = width;
+  tangle->qureg.size = tangle->qureg.hashw = 0;
+  tangle->qureg.node = NULL;
+  tangle->qureg.hash = NULL;
+  tangle->amplitudes = amplitudes;
+  tangle->occupied = occupied;
+}
+
+/* writes a canonical qmem, 0 or the errno of the failure; runs on the
+   writer thread, so it neither prints errors nor exits */
+static int write_checkpoint( const qmem_t* restrict qmem ) {
+  char tmp_file[FILENAME_MAX];
+  checkpoint_header_t header;
+  checkpoint_tangle_t entry;
+  const tangle_t* tangle;
+  bool ok;
+
+  // write next to the target and rename, a crash never leaves a torn file
+  snprintf( tmp_file, sizeof(tmp_file), "%s.tmp", _checkpoint_file_ );
+  FILE* file = fopen( tmp_file, "wb" );
+  if( !file )
+    return errno;
+
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) );
+  header.version = CHECKPOINT_VERSION;
+  header.num_tangles = qmem->size;
+  header.program_hash = _program_hash_;
+  header.pc = qmem->pc;
+  header.rng = qmem->rng;
+  ok = write_block( &header, sizeof(header), file ) &&
+    write_block( &qmem->signal_map, sizeof(signal_map_t), file ) &&
+    write_block( &qmem->frame, sizeof(pauli_frame_t), file );
+
+  for( int i=0, tally=0 ; ok && tally < qmem->size ; ++i ) {
+    assert( i<MAX_TANGLES );
+    tangle = qmem->tangles[i];
+    if( tangle == NULL )
+      continue;
+    entry = (checkpoint_tangle_t){ i,
+				   tangle->size,
+				   tangle->qureg.width,
+				   tangle->qureg.size,
+				   tangle->qureg.hashw,
+				   is_dense( tangle ) };
+    ok = write_block( &entry, sizeof(entry), file );
+    for( const qid_list_t* cons = tangle->qids; ok && cons; cons=cons->rest ) {
+      const int32_t qid = cons->qid;
+      ok = write_block( &qid, sizeof(qid), file );
+    }
+    if( ok && is_dense( tangle ) )
+      ok = write_dense( tangle, file );
+    else if( ok )
+      ok = write_block( tangle->qureg.node,
+			tangle->qureg.size * sizeof(quantum_reg_node),
+			file );
+    ++tally;
+  }
+
+  int error = ok ? 0 : errno ? errno : EIO;
+  if( fclose( file ) != 0 && !error )
+    error = errno;
+  if( !error && rename( tmp_file, _checkpoint_file_ ) != 0 )
+    error = errno;
+  if( error ) {
+    remove( tmp_file );
+    return error;
+  }
+  if( _verbose_ )
+    printf("checkpoint written to %s after %lu commands\n",
+	   _checkpoint_file_, (unsigned long)qmem->pc);
+  return 0;
+}
+
+static void report_error( int error ) {
+  printf("ERROR: writing checkpoint %s: %s\n", _checkpoint_file_,
+	 strerror( error ));
+}
+
+/* frees the snapshots the writer is done with and reports its errors,
+   on the evaluator thread; the caller holds the mailbox lock */
+static void collect_written() {
+  for( int i=0; i<2; ++i )
+    if( _written_[i] ) {
+      free_qmem( _written_[i] );
+      _written_[i] = NULL;
+    }
+  if( _write_error_ ) {
+    report_error( _write_error_ );
+    _write_error_ = 0;
+  }
+}
+
+static void* checkpoint_writer( void* unused ) {
+  qmem_t* snapshot;
+  pthread_mutex_lock( &_mailbox_lock_ );
+  for(;;) {
+    while( _pending_ == NULL && !_stopping_ )
+      pthread_cond_wait( &_mailbox_cond_, &_mailbox_lock_ );
+    if( _pending_ == NULL ) // stopping and nothing left to write
+      break;
+    snapshot = _pending_;
+    _pending_ = NULL;
+    pthread_mutex_unlock( &_mailbox_lock_ );
+
+    const int error = write_checkpoint( snapshot );
+
+    pthread_mutex_lock( &_mailbox_lock_ );
+    // back to the evaluator, which polls before it posts the next one
+    _written_[_written_[0] ? 1 : 0] = snapshot;
+    if( error && !_write_error_ )
+      _write_error_ = error;
+  }
+  pthread_mutex_unlock( &_mailbox_lock_ );
+  return NULL;
+}
+
+static void on_sigusr1( int signum ) {
+  _checkpoint_requested_ = 1;
+}
+
+void checkpoint_init( const char* file,
+		      size_t every,
+		      unsigned long long program_hash ) {
+  struct sigaction action;
+  assert( file );
+  _checkpoint_file_ = file;
+  _checkpoint_every_ = every;
+  _program_hash_ = program_hash;
+
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = on_sigusr1;
+  sigemptyset( &action.sa_mask );
+  action.sa_flags = SA_RESTART;
+  sigaction( SIGUSR1, &action, NULL );
+}
+
+void checkpoint_poll( const qmem_t* restrict qmem ) {
+  if( _checkpoint_file_ == NULL )
+    return;
+  if( !_checkpoint_requested_ &&
+      !(_checkpoint_every_ && qmem->pc % _checkpoint_every_ == 0) )
+    return;
+  _checkpoint_requested_ = 0;
+
+  // the copy is taken here and brought into the canonical bit layout of
+  // the file, the writer thread only writes it out
+  qmem_t* snapshot = clone_qmem( qmem );
+  canonicalize_qmem( snapshot );
+  pthread_mutex_lock( &_mailbox_lock_ );
+  collect_written();
+  if( !_writer_running_ ) {
+    if( pthread_create( &_writer_, NULL, checkpoint_writer, NULL ) != 0 ) {
+      pthread_mutex_unlock( &_mailbox_lock_ );
+      printf("WARNING: could not start checkpoint writer, "
+	     "writing synchronously\n");
+      const int error = write_checkpoint( snapshot );
+      if( error )
+	report_error( error );
+      free_qmem( snapshot );
+      return;
+    }
+    _writer_running_ = true;
+  }
+  // a snapshot the writer did not pick up yet is superseded by this one
+  if( _pending_ )
+    free_qmem( _pending_ );
+  _pending_ = snapshot;
+  pthread_cond_signal( &_mailbox_cond_ );
+  pthread_mutex_unlock( &_mailbox_lock_ );
+}
+
+void checkpoint_finish() {
+  if( !_writer_running_ )
+    return;
+  pthread_mutex_lock( &_mailbox_lock_ );
+  _stopping_ = true;
+  pthread_cond_signal( &_mailbox_cond_ );
+  pthread_mutex_unlock( &_mailbox_lock_ );
+  pthread_join( _writer_, NULL );
+  _writer_running_ = false;
+  _stopping_ = false;
+  pthread_mutex_lock( &_mailbox_lock_ );
+  collect_written();
+  pthread_mutex_unlock( &_mailbox_lock_ );
+}
+
+qmem_t* checkpoint_load( const char* file,
+			 unsigned long long program_hash ) {
+  checkpoint_header_t header;
+  checkpoint_tangle_t entry;
+  tangle_t* tangle;
+  int32_t qid;
+
+  FILE* input = fopen( file, "rb" );
+  if( !input ) {
+    perror("ERROR: opening checkpoint to resume from");
+    exit(EXIT_FAILURE);
+  }
+  read_or_die( &header, sizeof(header), input );
+  if( memcmp( header.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) ) != 0 ||
+      header.version != CHECKPOINT_VERSION ) {
+    fprintf(stderr, "ERROR: %s is not a qvm checkpoint (version %d)\n",
+	    file, CHECKPOINT_VERSION);
+    exit(EXIT_FAILURE);
+  }
+  if( header.program_hash != program_hash ) {
+    fprintf(stderr, "ERROR: checkpoint %s was taken from a different "
+	    "program\n", file);
+    exit(EXIT_FAILURE);
+  }
+
+  qmem_t* qmem = init_qmem();
+  qmem->pc = header.pc;
+  qmem->rng = header.rng;
+  read_or_die( &qmem->signal_map, sizeof(signal_map_t), input );
+  read_or_die( &qmem->frame, sizeof(pauli_frame_t), input );
+
+  for( uint32_t t=0; t<header.num_tangles; ++t ) {
+    read_or_die( &entry, sizeof(entry), input );
+    if( entry.slot >= MAX_TANGLES || qmem->tangles[entry.slot] ||
+	entry.size <= 0 || entry.nodes < 0 ||
+	(entry.dense && (entry.width < 1 || entry.width > DENSE_MAX_WIDTH)) ) {
+      fprintf(stderr, "ERROR: checkpoint %s is corrupt\n", file);
+      exit(EXIT_FAILURE);
+    }
+    tangle = init_tangle();
+    tangle->size = entry.size;
+    for( int i=0; i<entry.size; ++i ) {
+      read_or_die( &qid, sizeof(qid), input );
+      if( tangle->qids )
+	append_qids( add_qid(qid, NULL), tangle->qids );
+      else
+	tangle->qids = add_qid( qid, NULL );
+    }
+    set_canonical_bits( tangle );
+    if( entry.dense ) {
+      read_dense( tangle, entry.width, input );
+      qmem->tangles[entry.slot] = tangle;
+      qmem->size += 1;
+      continue;
+    }
+    tangle->qureg = quantum_new_qureg_size( entry.nodes, entry.width );
+    read_or_die( tangle->qureg.node,
+		 entry.nodes * sizeof(quantum_reg_node),
+		 input );
+    // the hash table is rebuilt by libquantum before it is used
+    tangle->qureg.hashw = entry.hashw;
+    if( entry.hashw ) {
+      tangle->qureg.hash = calloc( 1 << entry.hashw, sizeof(int) );
+      if( tangle->qureg.hash == NULL )
+	quantum_error(QUANTUM_ENOMEM);
+      quantum_memman( (1 << entry.hashw) * sizeof(int) );
+    }
+    qmem->tangles[entry.slot] = tangle;
+    qmem->size += 1;
+  }
+  fclose( input );
+  return qmem;
+}
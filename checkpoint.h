@@ -0,0 +1,31 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "qvm.h"
+
+/* Checkpointing of a running program.
+   A checkpoint is taken every N evaluated commands and whenever the process
+   receives SIGUSR1.  The evaluator hands a canonical deep copy of qmem to
+   a background writer thread, so a large state is serialized while
+   evaluation goes on; the writer hands it back to be freed and reports
+   write errors through the same mailbox, evaluation is not stopped by
+   them.  The file holds all tangles (in their qmem slots, dense ones as
+   their amplitude arrays), the signal map, the RNG state and the program
+   counter, and is tied to the program it was taken from by a hash of the
+   program text. */
+
+unsigned long long checkpoint_program_hash( const sexp_t* program );
+
+// every == 0 only checkpoints on SIGUSR1
+void checkpoint_init( const char* file, 
+		      size_t every, 
+		      unsigned long long program_hash );
+// called by the evaluator after each command
+void checkpoint_poll( const qmem_t* restrict qmem );
+// waits for a pending checkpoint to hit the disk
+void checkpoint_finish();
+
+qmem_t* checkpoint_load( const char* file, 
+			 unsigned long long program_hash );
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "qvm.h"
+#include "cold.h"
+#include "dense.h"
+#include "outofcore.h"
+
+bool _cold_enabled_ = false;
+size_t _cold_after_ = 64;
+double _cold_error_ = 0;
+
+// elements shuffled and deflated at a time
+#define COLD_CHUNK ((size_t)1 << 16)
+
+struct cold {
+  bool dense;
+  size_t count;     // amplitudes, or nodes when sparse
+  size_t occupied;  // of a dense tangle
+  int hashw;        // of a sparse one
+  size_t bytes;
+  unsigned char data[];
+};
+
+// mantissa bits kept when rounding, 23 keeps all
+static int _mantissa_ = 23;
+
+// enumerate compresses on several threads
+static pthread_mutex_t _cold_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long _frozen_ = 0;
+static unsigned long _thawed_ = 0;
+static unsigned long long _raw_bytes_ = 0;
+static unsigned long long _compressed_bytes_ = 0;
+
+void cold_configure( const char* spec ) {
+  long after = 64;
+  double error = 0;
+  char* end = NULL;
+  if( strcmp( spec, "off" ) == 0 ) {
+    _cold_enabled_ = false;
+    return;
+  }
+  if( *spec ) {
+    after = strtol( spec, &end, 10 );
+    if( end != spec && *end == ',' ) {
+      const char* rest = end + 1;
+      error = strtod( rest, &end );
+      if( end == rest )
+	after = 0;
+    }
+  }
+  if( (end && *end != '\0') || after < 1 || !(error >= 0 && error < 1) ) {
+    printf("ERROR: --compress expects off or after[,error] with after >= 1 "
+	   "and 0 <= error < 1, got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  _cold_enabled_ = true;
+  _cold_after_ = after;
+  _cold_error_ = error;
+  // rounding to k bits is off by at most 2^-(k+1)
+  _mantissa_ = error > 0 ? (int)ceil( -log2( error ) ) - 1 : 23;
+  if( _mantissa_ < 0 )
+    _mantissa_ = 0;
+  if( _mantissa_ > 23 )
+    _mantissa_ = 23;
+}
+
+static void round_floats( float* restrict x, size_t count, size_t stride ) {
+  const uint32_t half = (uint32_t)1 << (22 - _mantissa_);
+  const uint32_t keep = ~(((uint32_t)1 << (23 - _mantissa_)) - 1);
+  for( size_t i=0; i<count; ++i ) {
+    uint32_t bits;
+    memcpy( &bits, &x[i * stride], sizeof(bits) );
+    // a carry out of the mantissa correctly bumps the exponent
+    bits = (bits + half) & keep;
+    memcpy( &x[i * stride], &bits, sizeof(bits) );
+  }
+}
+
+// byte j of element i goes to j * count + i
+static void shuffle( const unsigned char* restrict src,
+		     unsigned char* restrict dst,
+		     size_t count, size_t element ) {
+  for( size_t i=0; i<count; ++i )
+    for( size_t j=0; j<element; ++j )
+      dst[j * count + i] = src[i * element + j];
+}
+
+static void unshuffle( const unsigned char* restrict src,
+		       unsigned char* restrict dst,
+		       size_t count, size_t element ) {
+  for( size_t j=0; j<element; ++j )
+    for( size_t i=0; i<count; ++i )
+      dst[i * element + j] = src[j * count + i];
+}
+
+static void* cold_alloc( size_t bytes ) {
+  void* p = malloc( bytes );
+  if( p == NULL ) {
+    printf("ERROR: out of memory compressing a tangle\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/* the deflated chunks of data, NULL if they do not come out smaller */
+static struct cold* deflate_array( const unsigned char* restrict data,
+				   size_t count, size_t element ) {
+  const size_t bytes = count * element;
+  z_stream z;
+  memset( &z, 0, sizeof(z) );
+  if( deflateInit( &z, Z_BEST_SPEED ) != Z_OK ) {
+    printf("ERROR: cannot initialize zlib\n");
+    exit(EXIT_FAILURE);
+  }
+  // as large as the raw data, giving up if it does not fit
+  struct cold* cold = cold_alloc( sizeof(struct cold) + bytes );
+  unsigned char* chunk = cold_alloc( COLD_CHUNK * element );
+  z.next_out = cold->data;
+  z.avail_out = bytes < UINT_MAX ? bytes : UINT_MAX;
+  int status = Z_OK;
+  for( size_t i=0; i<count && status == Z_OK; i+=COLD_CHUNK ) {
+    const size_t n = count - i < COLD_CHUNK ? count - i : COLD_CHUNK;
+    shuffle( data + i * element, chunk, n, element );
+    z.next_in = chunk;
+    z.avail_in = n * element;
+    const int flush = i + n == count ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      if( z.avail_out == 0 ) {
+	const size_t left = bytes - z.total_out;
+	z.avail_out = left < UINT_MAX ? left : UINT_MAX;
+	if( z.avail_out == 0 ) {
+	  status = Z_BUF_ERROR;
+	  break;
+	}
+      }
+      status = deflate( &z, flush );
+    } while( status == Z_OK && (z.avail_in > 0 || flush == Z_FINISH) );
+  }
+  const size_t out = z.total_out;
+  deflateEnd( &z );
+  free( chunk );
+  if( status != Z_STREAM_END ) {
+    free( cold );
+    return NULL;
+  }
+  struct cold* shrunk = realloc( cold, sizeof(struct cold) + out );
+  if( shrunk )
+    cold = shrunk;
+  cold->count = count;
+  cold->bytes = out;
+  return cold;
+}
+
+static void inflate_array( const struct cold* restrict cold,
+			   unsigned char* restrict data, size_t element ) {
+  z_stream z;
+  memset( &z, 0, sizeof(z) );
+  if( inflateInit( &z ) != Z_OK ) {
+    printf("ERROR: cannot initialize zlib\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned char* chunk = cold_alloc( COLD_CHUNK * element );
+  z.next_in = (unsigned char*)cold->data;
+  z.avail_in = cold->bytes;
+  int status = Z_OK;
+  for( size_t i=0; i<cold->count; i+=COLD_CHUNK ) {
+    const size_t n =
+      cold->count - i < COLD_CHUNK ? cold->count - i : COLD_CHUNK;
+    z.next_out = chunk;
+    z.avail_out = n * element;
+    while( z.avail_out > 0 && status == Z_OK ) {
+      if( z.avail_in == 0 )
+	z.avail_in = cold->bytes - z.total_in < UINT_MAX ?
+	  cold->bytes - z.total_in : UINT_MAX;
+      status = inflate( &z, Z_NO_FLUSH );
+    }
+    if( z.avail_out > 0 || (status != Z_OK && status != Z_STREAM_END) ) {
+      printf("ERROR: corrupt compressed tangle\n");
+      exit(EXIT_FAILURE);
+    }
+    unshuffle( chunk, data + i * element, n, element );
+  }
+  inflateEnd( &z );
+  free( chunk );
+}
+
+static bool freeze( tangle_t* restrict tangle ) {
+  const bool dense = is_dense( tangle );
+  quantum_reg* reg = &tangle->qureg;
+  const size_t count = dense ? (size_t)1 << reg->width : (size_t)reg->size;
+  const size_t element =
+    dense ? sizeof(COMPLEX_FLOAT) : sizeof(quantum_reg_node);
+  if( count * element < COLD_MIN_BYTES )
+    return false;
+  if( _mantissa_ < 23 ) {
+    if( dense )
+      round_floats( (float*)tangle->amplitudes, 2 * count, 1 );
+    else {
+      float* parts = (float*)((unsigned char*)reg->node +
+			      offsetof(quantum_reg_node, amplitude));
+      const size_t stride = sizeof(quantum_reg_node) / sizeof(float);
+      round_floats( parts, count, stride );
+      round_floats( parts + 1, count, stride );
+    }
+  }
+  const unsigned char* data = dense ? (unsigned char*)tangle->amplitudes :
+    (unsigned char*)reg->node;
+  struct cold* cold = deflate_array( data, count, element );
+  if( cold == NULL )
+    return false;
+
+  cold->dense = dense;
+  cold->occupied = tangle->occupied;
+  cold->hashw = reg->hashw;
+  if( dense ) {
+    ooc_free( tangle->amplitudes );
+    tangle->amplitudes = NULL;
+  }
+  else {
+    free( reg->node );
+    quantum_memman( -(long)(count * element) );
+    if( reg->hash ) {
+      free( reg->hash );
+      quantum_memman( -((long)1 << reg->hashw) * (long)sizeof(int) );
+    }
+  }
+  // what is left deletes as an empty register
+  reg->size = reg->hashw = 0;
+  reg->node = NULL;
+  reg->hash = NULL;
+  tangle->occupied = 0;
+  tangle->cold = cold;
+
+  pthread_mutex_lock( &_cold_lock_ );
+  ++_frozen_;
+  _raw_bytes_ += count * element;
+  _compressed_bytes_ += cold->bytes;
+  pthread_mutex_unlock( &_cold_lock_ );
+  return true;
+}
+
+void cold_sweep( qmem_t* restrict qmem ) {
+  // verbose prints the whole qmem after every command
+  if( !_cold_enabled_ || _verbose_ )
+    return;
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
+    tangle_t* tangle = qmem->tangles[i];
+    if( tangle == NULL )
+      continue;
+    if( !is_cold( tangle ) && qmem->pc - tangle->touched >= _cold_after_ &&
+	!freeze( tangle ) )
+      // not worth it, try again after as many commands
+      tangle->touched = qmem->pc;
+    ++tally;
+  }
+}
+
+void cold_thaw( tangle_t* restrict tangle ) {
+  struct cold* cold = tangle->cold;
+  if( cold == NULL )
+    return;
+  quantum_reg* reg = &tangle->qureg;
+  if( cold->dense ) {
+    tangle->amplitudes = ooc_alloc( cold->count * sizeof(COMPLEX_FLOAT) );
+    if( tangle->amplitudes == NULL ) {
+      printf("ERROR: out of memory for a dense tangle of width %d\n",
+	     reg->width);
+      exit(EXIT_FAILURE);
+    }
+    inflate_array( cold, (unsigned char*)tangle->amplitudes,
+		   sizeof(COMPLEX_FLOAT) );
+    tangle->occupied = cold->occupied;
+  }
+  else {
+    reg->node = cold_alloc( cold->count * sizeof(quantum_reg_node) );
+    quantum_memman( cold->count * sizeof(quantum_reg_node) );
+    inflate_array( cold, (unsigned char*)reg->node,
+		   sizeof(quantum_reg_node) );
+    reg->size = cold->count;
+    reg->hashw = cold->hashw;
+    if( reg->hashw ) {
+      reg->hash = calloc( (size_t)1 << reg->hashw, sizeof(int) );
+      if( reg->hash == NULL )
+	quantum_error(QUANTUM_ENOMEM);
+      quantum_memman( ((long)1 << reg->hashw) * sizeof(int) );
+    }
+  }
+  free( cold );
+  tangle->cold = NULL;
+
+  pthread_mutex_lock( &_cold_lock_ );
+  ++_thawed_;
+  pthread_mutex_unlock( &_cold_lock_ );
+}
+
+void cold_copy( const tangle_t* restrict src, tangle_t* restrict dst ) {
+  const size_t bytes = sizeof(struct cold) + src->cold->bytes;
+  dst->cold = cold_alloc( bytes );
+  memcpy( dst->cold, src->cold, bytes );
+  dst->qureg.width = src->qureg.width;
+  dst->qureg.size = dst->qureg.hashw = 0;
+  dst->qureg.node = NULL;
+  dst->qureg.hash = NULL;
+}
+
+void cold_free( tangle_t* restrict tangle ) {
+  free( tangle->cold );
+  tangle->cold = NULL;
+}
+
+size_t cold_amplitudes( const tangle_t* restrict tangle ) {
+  return tangle->cold->count;
+}
+
+size_t cold_bytes( const tangle_t* restrict tangle ) {
+  return tangle->cold->bytes;
+}
+
+void cold_print() {
+  if( _frozen_ == 0 )
+    return;
+  printf("compressed %lu cold tangles, %.1f MB into %.1f MB (%.2fx), "
+	 "%lu thawed", _frozen_, _raw_bytes_ / 1048576.0,
+	 _compressed_bytes_ / 1048576.0,
+	 (double)_raw_bytes_ / _compressed_bytes_, _thawed_);
+  if( _cold_error_ > 0 )
+    printf(", rounded to %d mantissa bits (relative error %g)",
+	   _mantissa_, _cold_error_);
+  printf("\n");
+}
@@ -0,0 +1,42 @@
+#ifndef COLD_H
+#define COLD_H
+
+#include "qvm.h"
+
+/* Compression of cold tangles (--compress[=after[,error]] or off).
+   A tangle no command has looked up for after commands (64 by default)
+   is compressed in memory: its amplitude array, or its nodes when it is
+   sparse, is byte shuffled, so that the sign and exponent bytes of all
+   amplitudes and the high bytes of all basis states come together, and
+   deflated at zlib's fastest level.  The hash table of a sparse tangle is
+   dropped, libquantum rebuilds it anyway.  find_qubit() and
+   canonicalize_tangle() decompress a cold tangle before anybody gets to
+   its amplitudes, clones of qmem keep it compressed.
+   With error > 0 the real and imaginary parts are rounded to the fewest
+   mantissa bits within that relative error first, which makes the low
+   mantissa bytes all zero.  Tangles below COLD_MIN_BYTES and those that
+   do not shrink stay as they are.  The totals are printed at the end. */
+
+#define COLD_MIN_BYTES 4096
+
+extern bool _cold_enabled_;
+extern size_t _cold_after_;    // commands without a lookup
+extern double _cold_error_;    // relative, 0 for lossless
+
+void cold_configure( const char* spec );
+
+static inline bool is_cold( const tangle_t* restrict tangle ) {
+  return tangle->cold != NULL;
+}
+
+// compresses the tangles of qmem that have gone cold, after every command
+void cold_sweep( qmem_t* restrict qmem );
+void cold_thaw( tangle_t* restrict tangle );
+void cold_copy( const tangle_t* restrict src, tangle_t* restrict dst );
+void cold_free( tangle_t* restrict tangle );
+// amplitudes or nodes of a cold tangle, and their compressed bytes
+size_t cold_amplitudes( const tangle_t* restrict tangle );
+size_t cold_bytes( const tangle_t* restrict tangle );
+void cold_print();
+
+#endif
@@ -0,0 +1,611 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "qvm.h"
+#include "dense.h"
+#include "stats.h"
+#include "outofcore.h"
+#include "cold.h"
+#include "truncation.h"
+
+bool _dense_enabled_ = true;
+double _dense_threshold_ = 0.125;
+double _sparse_threshold_ = 0.03125;
+size_t _dense_threads_ = 0;
+
+void dense_configure( const char* spec ) {
+  double to_dense, to_sparse;
+  if( strcmp( spec, "off" ) == 0 ) {
+    _dense_enabled_ = false;
+    return;
+  }
+  switch( sscanf( spec, "%lf,%lf", &to_dense, &to_sparse ) ) {
+  case 1:
+    to_sparse = to_dense / 4;
+    break;
+  case 2:
+    break;
+  default:
+    to_dense = -1;
+  }
+  if( !(to_dense > 0 && to_dense <= 1 && to_sparse >= 0 &&
+	to_sparse < to_dense) ) {
+    printf("ERROR: --dense expects off or to_dense[,to_sparse] with "
+	   "0 <= to_sparse < to_dense <= 1, got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  _dense_enabled_ = true;
+  _dense_threshold_ = to_dense;
+  _sparse_threshold_ = to_sparse;
+}
+
+void dense_configure_threads( const char* spec ) {
+  char* end;
+  const long threads = strtol( spec, &end, 10 );
+  if( *spec == '\0' || *end != '\0' || threads < 1 ) {
+    printf("ERROR: --threads expects a positive number, got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  _dense_threads_ = threads;
+}
+
+static COMPLEX_FLOAT* alloc_amplitudes( int width ) {
+  COMPLEX_FLOAT* amplitudes =
+    ooc_alloc( ((size_t)1 << width) * sizeof(COMPLEX_FLOAT) );
+  if( amplitudes == NULL ) {
+    printf("ERROR: out of memory for a dense tangle of width %d\n", width);
+    exit(EXIT_FAILURE);
+  }
+  return amplitudes;
+}
+
+// the nodes of reg as an array indexed by basis state
+static COMPLEX_FLOAT* scatter( const quantum_reg* restrict reg ) {
+  COMPLEX_FLOAT* amplitudes = alloc_amplitudes( reg->width );
+  for( int i=0; i<reg->size; ++i )
+    amplitudes[reg->node[i].state] += reg->node[i].amplitude;
+  return amplitudes;
+}
+
+/* The kernels sweep the amplitudes block by block and release every
+   block they are done with, see outofcore.h. */
+static inline MAX_UNSIGNED block_end( MAX_UNSIGNED block,
+				      MAX_UNSIGNED states ) {
+  return states - block > OOC_BLOCK ? block + OOC_BLOCK : states;
+}
+
+static inline void release( const COMPLEX_FLOAT* amplitudes,
+			    MAX_UNSIGNED from, MAX_UNSIGNED to ) {
+  ooc_release( amplitudes, from * sizeof(COMPLEX_FLOAT),
+	       (to - from) * sizeof(COMPLEX_FLOAT) );
+}
+
+// a block of the lower half and its partner in the upper half
+static inline void release_pair( const COMPLEX_FLOAT* amplitudes,
+				 MAX_UNSIGNED block, MAX_UNSIGNED end,
+				 MAX_UNSIGNED mask ) {
+  release( amplitudes, block, end );
+  if( mask >= OOC_BLOCK )
+    release( amplitudes, block | mask, (block | mask) + (end - block) );
+}
+
+// drops the nodes and the hash table, only the width is kept
+static void release_sparse( quantum_reg* restrict reg ) {
+  const int width = reg->width;
+  quantum_delete_qureg( reg );
+  reg->width = width;
+  reg->size = 0;
+  reg->hashw = 0;
+}
+
+size_t tangle_occupied( const tangle_t* restrict tangle ) {
+  return is_dense( tangle ) ? tangle->occupied : tangle->qureg.size;
+}
+
+double tangle_fill( const tangle_t* restrict tangle ) {
+  return tangle_occupied( tangle ) / ldexp( 1.0, tangle->qureg.width );
+}
+
+size_t tangle_amplitudes( const tangle_t* restrict tangle ) {
+  if( is_cold( tangle ) )
+    return cold_amplitudes( tangle );
+  return is_dense( tangle ) ?
+    (size_t)1 << tangle->qureg.width : tangle->qureg.size;
+}
+
+size_t tangle_amplitude_bytes( const tangle_t* restrict tangle ) {
+  if( is_cold( tangle ) )
+    return cold_bytes( tangle );
+  return is_dense( tangle ) ?
+    tangle_amplitudes( tangle ) * sizeof(COMPLEX_FLOAT) :
+    tangle->qureg.size * sizeof(quantum_reg_node);
+}
+
+size_t tangle_hash_bytes( const tangle_t* restrict tangle ) {
+  return tangle->qureg.hashw ?
+    ((size_t)1 << tangle->qureg.hashw) * sizeof(int) : 0;
+}
+
+bool dense_wanted( int width, double occupied ) {
+  return _dense_enabled_ &&
+    width >= DENSE_MIN_WIDTH && width <= DENSE_MAX_WIDTH &&
+    occupied >= _dense_threshold_ * ldexp( 1.0, width );
+}
+
+void tangle_to_dense( tangle_t* restrict tangle ) {
+  if( is_dense( tangle ) )
+    return;
+  tangle->amplitudes = scatter( &tangle->qureg );
+  tangle->occupied = tangle->qureg.size;
+  release_sparse( &tangle->qureg );
+  stats_conversion( true );
+}
+
+void tangle_to_sparse( tangle_t* restrict tangle ) {
+  if( !is_dense( tangle ) )
+    return;
+  const int width = tangle->qureg.width;
+  const size_t states = (size_t)1 << width;
+  const COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  size_t occupied = 0;
+  for( size_t i=0; i<states; ++i )
+    if( quantum_prob_inline( amplitudes[i] ) > DENSE_EPSILON )
+      ++occupied;
+
+  quantum_reg reg = quantum_new_qureg_size( occupied, width );
+  for( size_t i=0, n=0; i<states; ++i )
+    if( quantum_prob_inline( amplitudes[i] ) > DENSE_EPSILON ) {
+      reg.node[n].state = i;
+      reg.node[n].amplitude = amplitudes[i];
+      ++n;
+    }
+  // same hash table size as quantum_kronecker's
+  reg.hashw = width + 2;
+  reg.hash = calloc( (size_t)1 << reg.hashw, sizeof(int) );
+  if( reg.hash == NULL )
+    quantum_error(QUANTUM_ENOMEM);
+  quantum_memman( ((long)1 << reg.hashw) * sizeof(int) );
+
+  ooc_free( tangle->amplitudes );
+  tangle->amplitudes = NULL;
+  tangle->occupied = 0;
+  tangle->qureg = reg;
+  stats_conversion( false );
+}
+
+void tangle_update_representation( tangle_t* restrict tangle ) {
+  const int width = tangle->qureg.width;
+  if( is_dense( tangle ) ) {
+    if( width < DENSE_MIN_WIDTH ||
+	tangle_occupied( tangle ) < _sparse_threshold_ * ldexp( 1.0, width ) )
+      tangle_to_sparse( tangle );
+  }
+  else if( dense_wanted( width, tangle->qureg.size ) )
+    tangle_to_dense( tangle );
+}
+
+void dense_copy( const tangle_t* restrict src, tangle_t* restrict dst ) {
+  if( !is_dense( src ) )
+    return;
+  const size_t bytes = tangle_amplitude_bytes( src );
+  dst->amplitudes = ooc_alloc( bytes );
+  if( dst->amplitudes == NULL ) {
+    printf("ERROR: out of memory copying a dense tangle\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy( dst->amplitudes, src->amplitudes, bytes );
+  dst->occupied = src->occupied;
+}
+
+/** kernels **/
+
+void dense_cz( int target_1, int target_2, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED bitmask =
+    ((MAX_UNSIGNED) 1 << target_1) | ((MAX_UNSIGNED) 1 << target_2);
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    // visit only the states with both bits set
+    for( MAX_UNSIGNED i=block | bitmask; i<end; i=(i + 1) | bitmask )
+      amplitudes[i] = -amplitudes[i];
+    release( amplitudes, block, end );
+  }
+}
+
+void dense_sigma_x( int target, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    // a block with the bit set went with its partner
+    if( block & mask )
+      continue;
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      if( !(i & mask) ) {
+	const COMPLEX_FLOAT swap = amplitudes[i];
+	amplitudes[i] = amplitudes[i | mask];
+	amplitudes[i | mask] = swap;
+      }
+    release_pair( amplitudes, block, end, mask );
+  }
+}
+
+void dense_sigma_z( int target, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block | mask; i<end; i=(i + 1) | mask )
+      amplitudes[i] = -amplitudes[i];
+    release( amplitudes, block, end );
+  }
+}
+
+void dense_phase_kick( int target, double gamma, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  const COMPLEX_FLOAT z = quantum_cexp( gamma );
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block | mask; i<end; i=(i + 1) | mask )
+      amplitudes[i] *= z;
+    release( amplitudes, block, end );
+  }
+}
+
+void dense_hadamard( int target, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  const float s = 1 / sqrtf(2);
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    if( block & mask )
+      continue;
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      if( !(i & mask) ) {
+	const COMPLEX_FLOAT a0 = amplitudes[i];
+	const COMPLEX_FLOAT a1 = amplitudes[i | mask];
+	amplitudes[i] = s * (a0 + a1);
+	amplitudes[i | mask] = s * (a0 - a1);
+      }
+    release_pair( amplitudes, block, end, mask );
+  }
+}
+
+double dense_prob_zero( int target, const tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  const COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  double zero = 0, one = 0;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i ) {
+      if( i & mask )
+	one += quantum_prob_inline( amplitudes[i] );
+      else
+	zero += quantum_prob_inline( amplitudes[i] );
+    }
+    release( amplitudes, block, end );
+  }
+  return zero + one > 0 ? zero / (zero + one) : 1.0;
+}
+
+static inline MAX_UNSIGNED collapsed_state( MAX_UNSIGNED i,
+					    MAX_UNSIGNED mask,
+					    MAX_UNSIGNED top,
+					    MAX_UNSIGNED wanted ) {
+  if( top == mask )
+    return i | wanted;
+  return (i & ~mask) | (i & mask ? top : 0) | wanted;
+}
+
+/* Same bit movement as quantum_collapse(): the top bit of the old state
+   lands in the target bit of the new one.  Counts the occupied states on
+   the way. */
+void dense_collapse( int target, int value, double prob,
+		     tangle_t* restrict tangle ) {
+  const int width = tangle->qureg.width;
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED top = (MAX_UNSIGNED) 1 << (width - 1);
+  const MAX_UNSIGNED wanted = value ? mask : 0;
+  const float norm = 1.0 / sqrt( prob );
+  const COMPLEX_FLOAT* restrict old = tangle->amplitudes;
+  COMPLEX_FLOAT* restrict amplitudes = alloc_amplitudes( width - 1 );
+  size_t occupied = 0;
+  double kept = 0;
+
+  for( MAX_UNSIGNED block=0; block<top; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, top );
+    for( MAX_UNSIGNED i=block; i<end; ++i ) {
+      const MAX_UNSIGNED state = collapsed_state( i, mask, top, wanted );
+      const double p = quantum_prob_inline( old[state] );
+      kept += p;
+      occupied += p > DENSE_EPSILON;
+      amplitudes[i] = old[state] * norm;
+    }
+    release( amplitudes, block, end );
+    /* the block read one block of old, or two if the target bit is in
+       the block, its states with the bit set coming from the top half */
+    const MAX_UNSIGNED size = end - block;
+    const MAX_UNSIGNED from = collapsed_state( block, mask, top, wanted );
+    release( old, from & ~(size - 1), (from & ~(size - 1)) + size );
+    if( mask < size && top != mask ) {
+      const MAX_UNSIGNED upper =
+	collapsed_state( block | mask, mask, top, wanted ) & ~(size - 1);
+      release( old, upper, upper + size );
+    }
+  }
+  if( kept == 0 ) {
+    printf("ERROR: collapsing onto an outcome with zero probability\n");
+    exit(EXIT_FAILURE);
+  }
+  ooc_free( tangle->amplitudes );
+  tangle->amplitudes = amplitudes;
+  tangle->occupied = occupied;
+  tangle->qureg.width = width - 1;
+}
+
+/* Same result as quantum_diag_measure(): a0 - a1 e^(-i angle) for every
+   pair of states differing in the target bit, unnormalized, the bits above
+   the target move down. */
+int dense_diag_measure( int target, double angle, tangle_t* restrict tangle ) {
+  const int width = tangle->qureg.width;
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << (width - 1);
+  const COMPLEX_FLOAT phase = quantum_cexp( -angle );
+  const double limit = truncation_limit( width );
+  const COMPLEX_FLOAT* restrict old = tangle->amplitudes;
+  COMPLEX_FLOAT* restrict amplitudes = alloc_amplitudes( width - 1 );
+  size_t occupied = 0;
+  double norm = 0, dropped = 0;
+
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i ) {
+      const MAX_UNSIGNED k = ((i & ~(mask - 1)) << 1) | (i & (mask - 1));
+      const COMPLEX_FLOAT amplitude = old[k] - old[k | mask] * phase;
+      const double p = quantum_prob_inline( amplitude );
+      if( p > limit ) {
+	norm += p;
+	occupied += p > DENSE_EPSILON;
+	amplitudes[i] = amplitude;
+      }
+      else
+	dropped += p;
+    }
+    release( amplitudes, block, end );
+    // the block read two blocks of old, or one holding both halves
+    const MAX_UNSIGNED size = end - block;
+    const MAX_UNSIGNED from = ((block & ~(mask - 1)) << 1) |
+      (block & (mask - 1));
+    release( old, from, from + (mask < size ? 2 * size : size) );
+    if( mask >= size )
+      release( old, from | mask, (from | mask) + size );
+  }
+  if( _truncation_enabled_ && dropped > 0 )
+    truncation_discarded( dropped / (norm + dropped) );
+  ooc_free( tangle->amplitudes );
+  tangle->amplitudes = amplitudes;
+  tangle->occupied = occupied;
+  tangle->qureg.width = width - 1;
+  return 1;
+}
+
+/* exchanges bit_1 and bit_2 of every basis state in place, the states with
+   bit_1 set and bit_2 clear trade places with their partners */
+void dense_swap_bits( int bit_1, int bit_2, tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED mask_1 = (MAX_UNSIGNED) 1 << bit_1;
+  const MAX_UNSIGNED mask_2 = (MAX_UNSIGNED) 1 << bit_2;
+  const MAX_UNSIGNED both = mask_1 | mask_2;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  // bits above a block are the same for all of it, as in its partner
+  const MAX_UNSIGNED high = both & ~(OOC_BLOCK - 1);
+
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    if( (mask_1 & high && !(block & mask_1)) ||
+	(mask_2 & high && block & mask_2) )
+      continue;
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      if( (i & both) == mask_1 ) {
+	const COMPLEX_FLOAT amplitude = amplitudes[i];
+	amplitudes[i] = amplitudes[i ^ both];
+	amplitudes[i ^ both] = amplitude;
+      }
+    release( amplitudes, block, end );
+    if( high )
+      release( amplitudes, block ^ high, (block ^ high) + (end - block) );
+  }
+}
+
+// same test and scaling as quantum_normalize() in qvm.c
+void dense_normalize( tangle_t* restrict tangle ) {
+  const double limit = 1.0e-8;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  COMPLEX_FLOAT norm = 0;
+
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      norm += quantum_prob_inline( amplitudes[i] );
+    release( amplitudes, block, end );
+  }
+  if( !(abs(1-norm) < limit) )
+    return;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, states );
+    for( MAX_UNSIGNED i=block; i<end; ++i )
+      amplitudes[i] /= norm;
+    release( amplitudes, block, end );
+  }
+}
+
+typedef struct product_part {
+  const COMPLEX_FLOAT* upper;
+  const COMPLEX_FLOAT* lower;
+  COMPLEX_FLOAT* amplitudes;
+  int lower_width;
+  MAX_UNSIGNED upper_mask, lower_mask;   // the CZ, 0 for none
+  MAX_UNSIGNED from, to;                 // blocks of OOC_BLOCK
+} product_part_t;
+
+// rows from..to of the product, lower tile by lower tile
+static void product_rows( const product_part_t* restrict part,
+			  MAX_UNSIGNED from, MAX_UNSIGNED to,
+			  MAX_UNSIGNED j_from, MAX_UNSIGNED j_to ) {
+  const COMPLEX_FLOAT* restrict lower = part->lower;
+  for( MAX_UNSIGNED tile=j_from; tile<j_to; tile+=PRODUCT_TILE ) {
+    const MAX_UNSIGNED tile_end =
+      j_to - tile > PRODUCT_TILE ? tile + PRODUCT_TILE : j_to;
+    for( MAX_UNSIGNED i=from; i<to; ++i ) {
+      const COMPLEX_FLOAT factor = part->upper[i];
+      if( factor == 0 )
+	continue;
+      const MAX_UNSIGNED mask = i & part->upper_mask ? part->lower_mask : 0;
+      COMPLEX_FLOAT* restrict row =
+	part->amplitudes + (i << part->lower_width);
+      for( MAX_UNSIGNED j=tile; j<tile_end; ++j )
+	row[j] = (j & mask ? -factor : factor) * lower[j];
+    }
+  }
+}
+
+static void* product_blocks( void* arg ) {
+  const product_part_t* restrict part = arg;
+  const int lower_width = part->lower_width;
+  const MAX_UNSIGNED lower_states = (MAX_UNSIGNED) 1 << lower_width;
+  for( MAX_UNSIGNED block=part->from; block<part->to; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = block_end( block, part->to );
+    // whole rows, or a part of one row
+    if( lower_states <= OOC_BLOCK )
+      product_rows( part, block >> lower_width, end >> lower_width,
+		    0, lower_states );
+    else
+      product_rows( part, block >> lower_width, (block >> lower_width) + 1,
+		    block & (lower_states - 1),
+		    (block & (lower_states - 1)) + (end - block) );
+    release( part->amplitudes, block, end );
+    if( lower_states >= OOC_BLOCK )
+      release( part->lower, block & (lower_states - 1),
+	       (block & (lower_states - 1)) + (end - block) );
+  }
+  return NULL;
+}
+
+static size_t product_threads( MAX_UNSIGNED states ) {
+  if( states < PRODUCT_PARALLEL_STATES || _ooc_dir_ != NULL )
+    return 1;
+  size_t threads = _dense_threads_;
+  if( threads == 0 ) {
+    const long online = sysconf( _SC_NPROCESSORS_ONLN );
+    threads = online > 1 ? online : 1;
+  }
+  // at least a block each
+  if( threads > states / OOC_BLOCK )
+    threads = states / OOC_BLOCK;
+  return threads > PRODUCT_MAX_THREADS ? PRODUCT_MAX_THREADS : threads;
+}
+
+/* upper (x) lower with a CZ between bit cz_upper of upper and bit cz_lower
+   of lower applied on the way, none if they are negative.  Every thread
+   writes one contiguous part of the result, the way --numa=blocked
+   places it. */
+static COMPLEX_FLOAT* product( const COMPLEX_FLOAT* restrict upper,
+			       int upper_width,
+			       const COMPLEX_FLOAT* restrict lower,
+			       int lower_width, int cz_upper, int cz_lower ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << (upper_width + lower_width);
+  COMPLEX_FLOAT* restrict amplitudes =
+    alloc_amplitudes( upper_width + lower_width );
+  const bool cz = cz_upper >= 0 && cz_lower >= 0;
+  const product_part_t whole = {
+    upper, lower, amplitudes, lower_width,
+    cz ? (MAX_UNSIGNED) 1 << cz_upper : 0,
+    cz ? (MAX_UNSIGNED) 1 << cz_lower : 0,
+    0, states
+  };
+  const size_t threads = product_threads( states );
+  if( threads <= 1 ) {
+    product_blocks( (void*)&whole );
+    return amplitudes;
+  }
+  product_part_t parts[PRODUCT_MAX_THREADS];
+  pthread_t workers[PRODUCT_MAX_THREADS];
+  const MAX_UNSIGNED blocks = (states + OOC_BLOCK - 1) / OOC_BLOCK;
+  size_t started = 1;
+  for( size_t t=0; t<threads; ++t ) {
+    parts[t] = whole;
+    parts[t].from = blocks * t / threads * OOC_BLOCK;
+    parts[t].to = blocks * (t + 1) / threads * OOC_BLOCK;
+    if( parts[t].to > states )
+      parts[t].to = states;
+  }
+  // the calling thread takes the first part, and any a worker can't
+  for( ; started<threads; ++started )
+    if( pthread_create( &workers[started], NULL, product_blocks,
+			&parts[started] ) != 0 )
+      break;
+  product_blocks( &parts[0] );
+  for( size_t t=started; t<threads; ++t )
+    product_blocks( &parts[t] );
+  for( size_t t=1; t<started; ++t )
+    pthread_join( workers[t], NULL );
+  return amplitudes;
+}
+
+// the amplitudes of tangle as an array, taking them over from a sparse one
+static COMPLEX_FLOAT* take_dense( tangle_t* restrict tangle ) {
+  if( !is_dense( tangle ) ) {
+    tangle->occupied = tangle->qureg.size;
+    tangle->amplitudes = scatter( &tangle->qureg );
+    release_sparse( &tangle->qureg );
+  }
+  COMPLEX_FLOAT* amplitudes = tangle->amplitudes;
+  tangle->amplitudes = NULL;
+  return amplitudes;
+}
+
+void dense_add_qubit( const quantum_reg* restrict proto,
+		      tangle_t* restrict tangle ) {
+  if( !is_dense( tangle ) )
+    stats_conversion( true );
+  const int width = tangle->qureg.width;
+  const size_t occupied = proto->size * tangle_occupied( tangle );
+  COMPLEX_FLOAT* upper = scatter( proto );
+  COMPLEX_FLOAT* lower = take_dense( tangle );
+  tangle->amplitudes = product( upper, proto->width, lower, width, -1, -1 );
+  tangle->occupied = occupied;
+  tangle->qureg.width = proto->width + width;
+  ooc_free( upper );
+  ooc_free( lower );
+}
+
+void dense_merge( tangle_t* restrict upper, tangle_t* restrict lower,
+		  int cz_upper, int cz_lower ) {
+  if( !is_dense( upper ) && !is_dense( lower ) )
+    stats_conversion( true );
+  const int upper_width = upper->qureg.width;
+  const int lower_width = lower->qureg.width;
+  const size_t occupied = tangle_occupied( upper ) * tangle_occupied( lower );
+  COMPLEX_FLOAT* upper_amplitudes = take_dense( upper );
+  COMPLEX_FLOAT* lower_amplitudes = take_dense( lower );
+  upper->amplitudes = product( upper_amplitudes, upper_width,
+			       lower_amplitudes, lower_width,
+			       cz_upper, cz_lower );
+  upper->occupied = occupied;
+  upper->qureg.width = upper_width + lower_width;
+  lower->qureg.width = 0;
+  ooc_free( upper_amplitudes );
+  ooc_free( lower_amplitudes );
+}
@@ -0,0 +1,79 @@
+#ifndef DENSE_H
+#define DENSE_H
+
+#include "qvm.h"
+
+/* Dense tangles (--dense=to_dense[,to_sparse] or --dense=off).
+   libquantum keeps a tangle as (basis state, amplitude) nodes plus a hash
+   table of 2^(width+2) ints, which only pays off while few of the 2^width
+   basis states are occupied.  Every tangle tracks its fill ratio, the
+   occupied fraction of its basis states, and is turned into a plain array
+   of 2^width amplitudes indexed by basis state once the fill ratio reaches
+   to_dense, and back into nodes when it drops below to_sparse.  Tangles
+   narrower than DENSE_MIN_WIDTH or wider than DENSE_MAX_WIDTH stay sparse.
+   The evaluator's kernels dispatch on the representation, and so do the
+   output, printing, normalization, checkpoints and enumeration, so a dense
+   tangle is never turned into nodes just to be looked at:
+   canonicalize_tangle() permutes its amplitudes in place.  Only libqvm's
+   qvm_state() hands out nodes.  Conversions are counted in --stats. */
+
+#define DENSE_MIN_WIDTH 6
+#define DENSE_MAX_WIDTH 30
+// amplitudes with a smaller probability count as unoccupied
+#define DENSE_EPSILON 1e-14
+/* products of at least PRODUCT_PARALLEL_STATES amplitudes are split over
+   _dense_threads_ threads (--threads=n, all CPUs by default, one with
+   --perfctr or --out-of-core), and swept in tiles of PRODUCT_TILE lower
+   amplitudes that stay in cache across the rows of a block */
+#define PRODUCT_PARALLEL_STATES ((MAX_UNSIGNED) 1 << 22)
+#define PRODUCT_MAX_THREADS 64
+#define PRODUCT_TILE ((MAX_UNSIGNED) 1 << 14)
+
+extern bool _dense_enabled_;
+extern double _dense_threshold_;   // fill ratio to switch to dense
+extern double _sparse_threshold_;  // fill ratio to switch back
+extern size_t _dense_threads_;     // 0 for all CPUs
+
+void dense_configure( const char* spec );
+void dense_configure_threads( const char* spec );
+
+static inline bool is_dense( const tangle_t* restrict tangle ) {
+  return tangle->amplitudes != NULL;
+}
+
+size_t tangle_occupied( const tangle_t* restrict tangle );
+double tangle_fill( const tangle_t* restrict tangle );
+size_t tangle_amplitudes( const tangle_t* restrict tangle );
+size_t tangle_amplitude_bytes( const tangle_t* restrict tangle );
+size_t tangle_hash_bytes( const tangle_t* restrict tangle );
+bool dense_wanted( int width, double occupied );
+
+void tangle_to_dense( tangle_t* restrict tangle );
+void tangle_to_sparse( tangle_t* restrict tangle );
+// switches the representation if the fill ratio crossed a threshold
+void tangle_update_representation( tangle_t* restrict tangle );
+void dense_copy( const tangle_t* restrict src, tangle_t* restrict dst );
+
+/* the kernels on dense tangles, same semantics as their sparse
+   counterparts in qvm.c and libquantum */
+void dense_cz( int target_1, int target_2, tangle_t* restrict tangle );
+void dense_sigma_x( int target, tangle_t* restrict tangle );
+void dense_sigma_z( int target, tangle_t* restrict tangle );
+void dense_phase_kick( int target, double gamma, tangle_t* restrict tangle );
+void dense_hadamard( int target, tangle_t* restrict tangle );
+double dense_prob_zero( int target, const tangle_t* restrict tangle );
+void dense_collapse( int target, int value, double prob,
+		     tangle_t* restrict tangle );
+// quantum_diag_measure() of qvm.c (-m), always 1
+int dense_diag_measure( int target, double angle, tangle_t* restrict tangle );
+void dense_swap_bits( int bit_1, int bit_2, tangle_t* restrict tangle );
+void dense_normalize( tangle_t* restrict tangle );
+// proto (x) tangle, the proto qubits get the upper bits
+void dense_add_qubit( const quantum_reg* restrict proto,
+		      tangle_t* restrict tangle );
+/* upper (x) lower into upper, lower is left without amplitudes, with a
+   CZ between bit cz_upper of upper and bit cz_lower of lower fused in */
+void dense_merge( tangle_t* restrict upper, tangle_t* restrict lower,
+		  int cz_upper, int cz_lower );
+
+#endif
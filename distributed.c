@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <mpi.h>
+#include <sexp.h>
+
+#include "qvm.h"
+#include "distributed.h"
+#include "dense.h"
+#include "outcomes.h"
+#include "outofcore.h"
+
+#ifdef QVM_MPI
+
+int _rank_ = 0;
+int _ranks_ = 1;
+
+static int _width_ = 0;
+static int _local_ = 0;
+static unsigned long _exchanges_ = 0;
+static unsigned long long _bytes_ = 0;
+
+typedef struct dist {
+  int width;               // bits of the register
+  int local;               // bits kept by every rank, the rest are global
+  tangle_t part;           // the amplitudes of this rank, for the kernels
+  COMPLEX_FLOAT* buffer;   // half of them, what an exchange sends
+  int* bit;                // bit of every qid, -1 if not alive
+  qid_t* qid;              // qid on every bit, -1 if free
+  unsigned flip;           // global bits flipped by X
+  const sexp_t* ahead;     // the command being run and those to come
+} dist_t;
+
+void distributed_init( int* argc, char*** argv ) {
+  MPI_Init( argc, argv );
+  MPI_Comm_rank( MPI_COMM_WORLD, &_rank_ );
+  MPI_Comm_size( MPI_COMM_WORLD, &_ranks_ );
+  if( _ranks_ & (_ranks_ - 1) ) {
+    if( _rank_ == 0 )
+      printf("ERROR: qvm-mpi needs a power of 2 ranks, not %d\n", _ranks_);
+    MPI_Finalize();
+    exit(EXIT_FAILURE);
+  }
+}
+
+void distributed_finish() {
+  MPI_Finalize();
+}
+
+void qvm_mpi_exit( int status ) {
+  int initialized, finalized;
+  MPI_Initialized( &initialized );
+  MPI_Finalized( &finalized );
+  // the other ranks may be waiting in a collective for this one
+  if( status != EXIT_SUCCESS && initialized && !finalized ) {
+    fflush( stdout );
+    MPI_Abort( MPI_COMM_WORLD, status );
+  }
+  (exit)( status );
+}
+
+static void* dist_alloc( size_t bytes ) {
+  void* p = calloc( 1, bytes ? bytes : 1 );
+  if( p == NULL ) {
+    printf("ERROR: out of memory on rank %d\n", _rank_);
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+// the value of a global bit on this rank, rank ^ flip is the logical rank
+static int global_value( const dist_t* d, int bit ) {
+  return ((_rank_ ^ d->flip) >> (bit - d->local)) & 1;
+}
+
+static void negate_all( dist_t* d ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << d->local;
+  COMPLEX_FLOAT* restrict amplitudes = d->part.amplitudes;
+  for( MAX_UNSIGNED i=0; i<states; ++i )
+    amplitudes[i] = -amplitudes[i];
+}
+
+// swaps buffer with the one of partner, in chunks MPI counts can hold
+static void exchange( void* buffer, size_t bytes, int partner ) {
+  char* p = buffer;
+  _bytes_ += bytes;
+  ++_exchanges_;
+  while( bytes ) {
+    const int chunk = bytes > (1u << 30) ? (1 << 30) : (int)bytes;
+    MPI_Sendrecv_replace( p, chunk, MPI_BYTE, partner, 0, partner, 0,
+			  MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    p += chunk;
+    bytes -= chunk;
+  }
+}
+
+/* swaps the global bit with the local one: the ranks exchange the half of
+   their amplitudes whose local bit differs from their global one */
+static void swap_bits( dist_t* d, int global, int local ) {
+  const int value = global_value( d, global );
+  const int partner = _rank_ ^ (1 << (global - d->local));
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << local;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << d->local;
+  COMPLEX_FLOAT* restrict amplitudes = d->part.amplitudes;
+  size_t n = 0;
+
+  for( MAX_UNSIGNED i=0; i<states; ++i )
+    if( ((i & mask) != 0) != value )
+      d->buffer[n++] = amplitudes[i];
+  exchange( d->buffer, n * sizeof(COMPLEX_FLOAT), partner );
+  n = 0;
+  for( MAX_UNSIGNED i=0; i<states; ++i )
+    if( ((i & mask) != 0) != value )
+      amplitudes[i] = d->buffer[n++];
+  // each rank kept its logical value of the global bit, flip stays
+
+  const qid_t qid = d->qid[global];
+  d->qid[global] = d->qid[local];
+  d->qid[local] = qid;
+  if( d->qid[global] >= 0 )
+    d->bit[d->qid[global]] = global;
+  if( d->qid[local] >= 0 )
+    d->bit[d->qid[local]] = local;
+}
+
+/* a free local bit, else the local bit of the qubit the pattern uses
+   furthest ahead */
+static int victim_bit( dist_t* d ) {
+  for( int b=0; b<d->local; ++b )
+    if( d->qid[b] < 0 )
+      return b;
+  char* seen = dist_alloc( d->local );
+  int unseen = d->local;
+  for( const sexp_t* exp = d->ahead; exp && unseen > 1; exp = exp->next ) {
+    if( exp->ty != SEXP_LIST || exp->list == NULL ||
+	exp->list->ty != SEXP_VALUE )
+      continue;
+    // targets only, signals never need a local bit
+    const int targets = get_opname( exp->list ) == 'E' ? 2 : 1;
+    const sexp_t* arg = exp->list->next;
+    for( int t=0; t<targets && arg && arg->ty == SEXP_VALUE && unseen > 1;
+	 ++t, arg = arg->next ) {
+      const qid_t qid = get_qid( (sexp_t*)arg );
+      if( qid < 0 || qid >= (int)MAX_QUBITS )
+	continue;
+      const int b = d->bit[qid];
+      if( b >= 0 && b < d->local && !seen[b] ) {
+	seen[b] = 1;
+	--unseen;
+      }
+    }
+  }
+  int victim = 0;
+  while( seen[victim] )
+    ++victim;
+  free( seen );
+  return victim;
+}
+
+// the local bit of qid, swapped in from a global one if need be
+static int localize( dist_t* d, qid_t qid ) {
+  const int b = d->bit[qid];
+  if( b < d->local )
+    return b;
+  const int local = victim_bit( d );
+  swap_bits( d, b, local );
+  return local;
+}
+
+// the bit of qid, a |+> on a free local bit for a new qubit
+static int bit_of( dist_t* d, qid_t qid ) {
+  if( qid < 0 || qid >= (int)MAX_QUBITS ) {
+    printf("ERROR: qid %d out of range\n", qid);
+    exit(EXIT_FAILURE);
+  }
+  if( d->bit[qid] >= 0 )
+    return d->bit[qid];
+  int b = 0;
+  while( b < d->width && d->qid[b] >= 0 )
+    ++b;
+  if( b == d->width ) {
+    printf("ERROR: more than %d qubits alive in the register\n", d->width);
+    exit(EXIT_FAILURE);
+  }
+  d->qid[b] = qid;
+  d->bit[qid] = b;
+  dense_hadamard( localize( d, qid ), &d->part );
+  return d->bit[qid];
+}
+
+static void dist_E( dist_t* d, qid_t qid1, qid_t qid2 ) {
+  bit_of( d, qid1 );
+  bit_of( d, qid2 );
+  // a new qid2 may have swapped qid1 out
+  const int b1 = d->bit[qid1], b2 = d->bit[qid2];
+  const bool global1 = b1 >= d->local, global2 = b2 >= d->local;
+
+  if( !global1 && !global2 )
+    dense_cz( b1, b2, &d->part );
+  else if( global1 && global2 ) {
+    if( global_value( d, b1 ) && global_value( d, b2 ) )
+      negate_all( d );
+  }
+  else if( global_value( d, global1 ? b1 : b2 ) )
+    dense_sigma_z( global1 ? b2 : b1, &d->part );
+}
+
+static void dist_pauli( dist_t* d, qid_t qid, char op ) {
+  const int b = bit_of( d, qid );
+  if( b < d->local ) {
+    if( op == 'X' )
+      dense_sigma_x( b, &d->part );
+    else
+      dense_sigma_z( b, &d->part );
+  }
+  else if( op == 'X' )
+    d->flip ^= 1u << (b - d->local);
+  else if( global_value( d, b ) )
+    negate_all( d );
+}
+
+/* rotates, measures and collapses qid back to |0>, as eval_M does */
+static void dist_M( dist_t* d, qid_t qid, double angle, qmem_t* qmem ) {
+  bit_of( d, qid );
+  const int b = localize( d, qid );
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << b;
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << d->local;
+  COMPLEX_FLOAT* restrict amplitudes = d->part.amplitudes;
+  double prob[2] = { 0, 0 };
+  int signal;
+
+  dense_phase_kick( b, -angle, &d->part );
+  dense_hadamard( b, &d->part );
+  for( MAX_UNSIGNED i=0; i<states; ++i )
+    prob[(i & mask) != 0] += quantum_prob_inline( amplitudes[i] );
+  MPI_Allreduce( MPI_IN_PLACE, prob, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD );
+  const double total = prob[0] + prob[1];
+  // rank 0 draws, records or replays the outcome
+  if( _rank_ == 0 )
+    signal = outcomes_next( qmem, qid, total > 0 ? prob[0] / total : 1.0 );
+  MPI_Bcast( &signal, 1, MPI_INT, 0, MPI_COMM_WORLD );
+  if( prob[signal] <= 0 ) {
+    printf("ERROR: collapsing onto an outcome with zero probability\n");
+    exit(EXIT_FAILURE);
+  }
+
+  const float norm = 1.0 / sqrt( prob[signal] );
+  for( MAX_UNSIGNED i=0; i<states; i=(i + 1 + mask) & ~mask ) {
+    amplitudes[i] = (signal ? amplitudes[i | mask] : amplitudes[i]) * norm;
+    amplitudes[i | mask] = 0;
+  }
+  d->qid[b] = -1;
+  d->bit[qid] = -1;
+  set_signal( qid, signal, &qmem->signal_map );
+  outcomes_log( signal );
+}
+
+// the most qubits alive at once
+static int peak_width( const sexp_t* program ) {
+  char* alive = dist_alloc( MAX_QUBITS );
+  int width = 0, peak = 0;
+
+  for( const sexp_t* exp = program; exp; exp = exp->next ) {
+    if( exp->ty != SEXP_LIST || exp->list == NULL ||
+	exp->list->ty != SEXP_VALUE )
+      continue;
+    const char op = get_opname( exp->list );
+    const int targets = op == 'E' ? 2 : 1;
+    const sexp_t* arg = exp->list->next;
+    for( int t=0; t<targets && arg && arg->ty == SEXP_VALUE;
+	 ++t, arg = arg->next ) {
+      const qid_t qid = get_qid( (sexp_t*)arg );
+      if( qid < 0 || qid >= (int)MAX_QUBITS || alive[qid] )
+	continue;
+      alive[qid] = 1;
+      if( ++width > peak )
+	peak = width;
+    }
+    if( op == 'M' && exp->list->next && exp->list->next->ty == SEXP_VALUE ) {
+      const qid_t qid = get_qid( exp->list->next );
+      if( qid >= 0 && qid < (int)MAX_QUBITS && alive[qid] ) {
+	alive[qid] = 0;
+	--width;
+      }
+    }
+  }
+  free( alive );
+  return peak;
+}
+
+// the p-th combination of the bits in mask
+static MAX_UNSIGNED deposit( MAX_UNSIGNED p, const int* bits, int n ) {
+  MAX_UNSIGNED i = 0;
+  for( int k=0; k<n; ++k )
+    i |= ((p >> k) & 1) << bits[k];
+  return i;
+}
+
+static int by_qid( const void* a, const void* b ) {
+  return *(const qid_t*)a - *(const qid_t*)b;
+}
+
+/* the live qubits as one tangle of qmem on rank 0, the first qid the most
+   significant bit */
+static void gather_output( dist_t* d, qmem_t* restrict qmem ) {
+  qid_t* qids = dist_alloc( d->width * sizeof(qid_t) );
+  int* local_bits = dist_alloc( d->width * sizeof(int) );
+  int live = 0, local_live = 0;
+  bool contributes = true;
+
+  for( int b=0; b<d->width; ++b )
+    if( d->qid[b] >= 0 ) {
+      qids[live++] = d->qid[b];
+      if( b < d->local )
+	local_bits[local_live++] = b;
+    }
+    // only ranks with every free global bit 0 hold amplitudes
+    else if( b >= d->local && global_value( d, b ) )
+      contributes = false;
+  if( live == 0 ) {
+    free( qids );
+    free( local_bits );
+    return;
+  }
+  if( live > DENSE_MAX_WIDTH ) {
+    if( _rank_ == 0 )
+      printf("ERROR: %d qubits alive at the end, more than the %d that can "
+	     "be gathered\n", live, DENSE_MAX_WIDTH);
+    exit(EXIT_FAILURE);
+  }
+  qsort( qids, live, sizeof(qid_t), by_qid );
+
+  MPI_Datatype amplitude;
+  MPI_Type_contiguous( sizeof(COMPLEX_FLOAT), MPI_BYTE, &amplitude );
+  MPI_Type_commit( &amplitude );
+  const int count = contributes ? 1 << local_live : 0;
+  COMPLEX_FLOAT* send = dist_alloc( (count ? count : 1) *
+				    sizeof(COMPLEX_FLOAT) );
+  for( int p=0; p<count; ++p )
+    send[p] = d->part.amplitudes[deposit( p, local_bits, local_live )];
+  int* counts = dist_alloc( _ranks_ * sizeof(int) );
+  int* displacements = dist_alloc( _ranks_ * sizeof(int) );
+  MPI_Gather( &count, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD );
+  COMPLEX_FLOAT* received = NULL;
+  if( _rank_ == 0 ) {
+    for( int r=1; r<_ranks_; ++r )
+      displacements[r] = displacements[r-1] + counts[r-1];
+    received = dist_alloc( ((size_t)1 << live) * sizeof(COMPLEX_FLOAT) );
+  }
+  MPI_Gatherv( send, count, amplitude, received, counts, displacements,
+	       amplitude, 0, MPI_COMM_WORLD );
+  MPI_Type_free( &amplitude );
+
+  if( _rank_ == 0 ) {
+    COMPLEX_FLOAT* amplitudes =
+      dist_alloc( ((size_t)1 << live) * sizeof(COMPLEX_FLOAT) );
+    for( int r=0; r<_ranks_; ++r )
+      for( int p=0; p<counts[r]; ++p ) {
+	const MAX_UNSIGNED index =
+	  ((MAX_UNSIGNED)(r ^ d->flip) << d->local) |
+	  deposit( p, local_bits, local_live );
+	MAX_UNSIGNED state = 0;
+	for( int k=0; k<live; ++k )
+	  state = (state << 1) | ((index >> d->bit[qids[k]]) & 1);
+	const COMPLEX_FLOAT a = received[displacements[r] + p];
+	amplitudes[state] = quantum_prob_inline( a ) > DENSE_EPSILON ? a : 0;
+      }
+    add_amplitudes_tangle( qids, live, amplitudes, qmem );
+    free( amplitudes );
+    free( received );
+  }
+  free( send );
+  free( counts );
+  free( displacements );
+  free( qids );
+  free( local_bits );
+}
+
+void distributed_run( sexp_t* program, qmem_t* restrict qmem ) {
+  dist_t d;
+  int global = 0;
+  qid_t qid, qid2;
+
+  while( (1 << global) < _ranks_ )
+    ++global;
+  d.width = peak_width( program );
+  if( d.width < global + 1 )
+    d.width = global + 1;
+  d.local = d.width - global;
+  if( d.local > DENSE_MAX_WIDTH ) {
+    if( _rank_ == 0 )
+      printf("ERROR: %d qubits alive need 2^%d amplitudes per rank, more "
+	     "than 2^%d; use more ranks\n", d.width, d.local, DENSE_MAX_WIDTH);
+    exit(EXIT_FAILURE);
+  }
+  _width_ = d.width;
+  _local_ = d.local;
+  memset( &d.part, 0, sizeof(d.part) );
+  d.part.qureg.width = d.local;
+  d.part.amplitudes =
+    ooc_alloc( ((size_t)1 << d.local) * sizeof(COMPLEX_FLOAT) );
+  if( d.part.amplitudes == NULL ) {
+    printf("ERROR: out of memory on rank %d\n", _rank_);
+    exit(EXIT_FAILURE);
+  }
+  d.buffer = dist_alloc( ((size_t)1 << (d.local - 1)) * sizeof(COMPLEX_FLOAT) );
+  d.bit = dist_alloc( MAX_QUBITS * sizeof(int) );
+  d.qid = dist_alloc( d.width * sizeof(qid_t) );
+  for( size_t q=0; q<MAX_QUBITS; ++q )
+    d.bit[q] = -1;
+  for( int b=0; b<d.width; ++b )
+    d.qid[b] = -1;
+  d.flip = 0;
+  // every bit free, |0...0> lives on rank 0
+  if( _rank_ == 0 )
+    d.part.amplitudes[0] = 1;
+  if( qmem->size ) {
+    if( _rank_ == 0 )
+      printf("ERROR: qvm-mpi starts from |+> qubits and can't take an "
+	     "input state\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for( sexp_t* exp = program; exp; exp = exp->next ) {
+    sexp_t* command = exp->ty == SEXP_LIST ? exp->list : exp;
+    d.ahead = exp;
+    switch( get_opname( command ) ) {
+    case 'E':
+      if( !command->next || !command->next->next ) {
+	printf("Entangle did not have two qubit arguments\n");
+	exit(EXIT_FAILURE);
+      }
+      qid = get_qid( command->next );
+      qid2 = get_qid( command->next->next );
+      dist_E( &d, qid, qid2 );
+      break;
+    case 'M': {
+      double angle;
+      qid = parse_measurement_angle( command, qmem, &angle );
+      dist_M( &d, qid, angle, qmem );
+      break;
+    }
+    case 'X':
+    case 'Z':
+      if( parse_correction( command, qmem, &qid ) )
+	dist_pauli( &d, qid, get_opname( command ) );
+      break;
+    default:
+      printf("unknown command: %c\n", get_opname( command ));
+      exp = NULL;
+      break;
+    }
+    if( exp == NULL || exp->ty != SEXP_LIST )
+      break;
+    qmem->pc += 1;
+  }
+
+  gather_output( &d, qmem );
+  ooc_free( d.part.amplitudes );
+  free( d.buffer );
+  free( d.bit );
+  free( d.qid );
+}
+
+void distributed_print() {
+  unsigned long long bytes = 0;
+
+  MPI_Reduce( &_bytes_, &bytes, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+	      MPI_COMM_WORLD );
+  // every rank takes part in every exchange
+  if( _rank_ == 0 && _width_ )
+    printf("mpi: %d ranks, %d qubit register (%d local bits), %lu exchanges, "
+	   "%.1f MB sent\n", _ranks_, _width_, _local_, _exchanges_,
+	   bytes / 1048576.0);
+}
+
+#endif
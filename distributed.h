@@ -0,0 +1,38 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "qvm.h"
+
+/* Distributed state vector (make mpi builds qvm-mpi, run it as
+   mpirun -np 2^k ./qvm-mpi pattern.mc).
+   All qubits of the pattern share one register of 2^width amplitudes,
+   width being the most qubits alive at once, split over the ranks by the
+   k highest bits: every rank keeps the 2^(width-k) amplitudes of its
+   global bits.  Free bits stay |0>, a new qubit takes one and becomes |+>,
+   a measurement collapses its bit back to |0>.
+   CZ, Z and the phase of a measurement only read the global bits, X on a
+   global bit just relabels the ranks, so they never communicate.  Only a
+   Hadamard, the one of a measurement or of a new qubit, needs its bit
+   local: a global one is swapped with a local bit first, exchanging half
+   of the amplitudes with the partner rank.  New qubits get local bits
+   while there are free ones, and the local qubit swapped out is the one
+   used furthest ahead in the pattern.
+   Rank 0 draws the outcomes, prints and writes the output; at the end it
+   gathers the live qubits into one tangle of qmem, at most
+   DENSE_MAX_WIDTH of them. */
+
+#ifdef QVM_MPI
+
+extern int _rank_;
+extern int _ranks_;
+
+// MPI_Init, checks that the number of ranks is a power of 2
+void distributed_init( int* argc, char*** argv );
+void distributed_finish();
+void distributed_run( sexp_t* program, qmem_t* restrict qmem );
+// exchanges and bytes sent by the last run, on rank 0
+void distributed_print();
+
+#endif
+
+#endif
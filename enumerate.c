@@ -0,0 +1,353 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sexp.h>
+#include <sexp_ops.h>
+
+#include "qvm.h"
+#include "enumerate.h"
+#include "frame.h"
+#include "dense.h"
+
+// amplitudes are single precision, compare states accordingly
+#define STATE_TOLERANCE 1e-4
+#define NEGLIGIBLE_PROB 1e-12
+
+typedef struct branch {
+  qmem_t* qmem;
+  sexp_t* exp;     // next command to evaluate
+  double weight;   // probability of reaching this branch
+} branch_t;
+
+typedef struct leaf {
+  char* outcome;
+  double weight;
+  size_t state;    // index into the distinct output states
+} leaf_t;
+
+typedef struct output_state {
+  qmem_t* qmem;
+  double weight;
+} output_state_t;
+
+typedef struct enumeration {
+  double threshold;
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  // LIFO of open branches, keeps the traversal (and memory) depth-first
+  branch_t* open;
+  size_t num_open, max_open;
+  size_t busy;     // threads evaluating a branch
+  // results
+  leaf_t* leaves;
+  size_t num_leaves, max_leaves;
+  output_state_t* states;
+  size_t num_states, max_states;
+  double pruned;
+  size_t num_pruned;
+} enumeration_t;
+
+static void push_branch( enumeration_t* e, branch_t branch ) {
+  pthread_mutex_lock( &e->lock );
+  if( e->num_open == e->max_open ) {
+    e->max_open = e->max_open ? 2 * e->max_open : 64;
+    e->open = realloc( e->open, e->max_open * sizeof(branch_t) );
+  }
+  e->open[e->num_open++] = branch;
+  pthread_cond_signal( &e->wakeup );
+  pthread_mutex_unlock( &e->lock );
+}
+
+static void prune( enumeration_t* e, double weight ) {
+  // a deterministic measurement drops nothing
+  if( weight <= 0 )
+    return;
+  pthread_mutex_lock( &e->lock );
+  e->pruned += weight;
+  e->num_pruned += 1;
+  pthread_mutex_unlock( &e->lock );
+}
+
+static int compare_nodes( const void* a, const void* b ) {
+  const MAX_UNSIGNED x = ((const quantum_reg_node*)a)->state;
+  const MAX_UNSIGNED y = ((const quantum_reg_node*)b)->state;
+  return x < y ? -1 : x > y;
+}
+
+/* non-negligible nodes of tangle, sorted by basis state */
+static quantum_reg_node* sorted_nodes( const tangle_t* tangle, int* size ) {
+  const quantum_reg* reg = &tangle->qureg;
+  *size = 0;
+  if( is_dense( tangle ) ) {
+    // already in increasing order
+    const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << reg->width;
+    size_t count = 0;
+    for( MAX_UNSIGNED i=0; i<states; ++i )
+      count += quantum_prob_inline( tangle->amplitudes[i] ) > NEGLIGIBLE_PROB;
+    quantum_reg_node* nodes = malloc( (count + 1) * sizeof(quantum_reg_node) );
+    for( MAX_UNSIGNED i=0; i<states; ++i )
+      if( quantum_prob_inline( tangle->amplitudes[i] ) > NEGLIGIBLE_PROB ) {
+	nodes[*size].state = i;
+	nodes[(*size)++].amplitude = tangle->amplitudes[i];
+      }
+    return nodes;
+  }
+  quantum_reg_node* nodes = malloc( (reg->size + 1) * sizeof(quantum_reg_node) );
+  for( int i=0; i<reg->size; ++i )
+    if( quantum_prob_inline( reg->node[i].amplitude ) > NEGLIGIBLE_PROB )
+      nodes[(*size)++] = reg->node[i];
+  qsort( nodes, *size, sizeof(quantum_reg_node), compare_nodes );
+  return nodes;
+}
+
+/* equal up to a global phase */
+static bool same_tangle_state( const tangle_t* a, const tangle_t* b ) {
+  const qid_list_t* qa = a->qids;
+  const qid_list_t* qb = b->qids;
+  for( ; qa && qb; qa=qa->rest, qb=qb->rest )
+    if( qa->qid != qb->qid )
+      return false;
+  if( qa || qb )
+    return false;
+
+  int size_a, size_b;
+  quantum_reg_node* na = sorted_nodes( a, &size_a );
+  quantum_reg_node* nb = sorted_nodes( b, &size_b );
+  bool same = size_a == size_b;
+  int largest = 0;
+  for( int i=0; same && i<size_a; ++i ) {
+    same = na[i].state == nb[i].state;
+    if( quantum_prob_inline(na[i].amplitude) >
+	quantum_prob_inline(na[largest].amplitude) )
+      largest = i;
+  }
+  if( same && size_a > 0 ) {
+    const COMPLEX_FLOAT phase = nb[largest].amplitude / na[largest].amplitude;
+    for( int i=0; same && i<size_a; ++i ) {
+      const COMPLEX_FLOAT diff = nb[i].amplitude - phase * na[i].amplitude;
+      same = quantum_prob_inline( diff ) < STATE_TOLERANCE * STATE_TOLERANCE;
+    }
+  }
+  free( na );
+  free( nb );
+  return same;
+}
+
+static const tangle_t* tangle_with_first_qid( const qmem_t* qmem, qid_t qid ) {
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i )
+    if( qmem->tangles[i] ) {
+      if( qmem->tangles[i]->qids->qid == qid )
+	return qmem->tangles[i];
+      ++tally;
+    }
+  return NULL;
+}
+
+static bool same_output_state( const qmem_t* a, const qmem_t* b ) {
+  if( a->size != b->size )
+    return false;
+  for( int i=0, tally=0 ; tally < a->size ; ++i ) {
+    const tangle_t* tangle = a->tangles[i];
+    if( tangle == NULL )
+      continue;
+    const tangle_t* other = tangle_with_first_qid( b, tangle->qids->qid );
+    if( other == NULL || !same_tangle_state( tangle, other ) )
+      return false;
+    ++tally;
+  }
+  return true;
+}
+
+/* takes ownership of qmem */
+static void record_leaf( enumeration_t* e, qmem_t* qmem, double weight ) {
+  leaf_t leaf = { signal_outcome_string( &qmem->signal_map ), weight, 0 };
+
+  // branches may have laid out their bits differently
+  frame_flush( qmem );
+  canonicalize_qmem( qmem );
+  pthread_mutex_lock( &e->lock );
+  for( leaf.state = 0; leaf.state < e->num_states; ++leaf.state )
+    if( same_output_state( e->states[leaf.state].qmem, qmem ) )
+      break;
+  if( leaf.state == e->num_states ) {
+    if( e->num_states == e->max_states ) {
+      e->max_states = e->max_states ? 2 * e->max_states : 16;
+      e->states = realloc( e->states, e->max_states * sizeof(output_state_t) );
+    }
+    e->states[e->num_states++] = (output_state_t){ qmem, 0.0 };
+    qmem = NULL;
+  }
+  e->states[leaf.state].weight += weight;
+  if( e->num_leaves == e->max_leaves ) {
+    e->max_leaves = e->max_leaves ? 2 * e->max_leaves : 64;
+    e->leaves = realloc( e->leaves, e->max_leaves * sizeof(leaf_t) );
+  }
+  e->leaves[e->num_leaves++] = leaf;
+  pthread_mutex_unlock( &e->lock );
+  if( qmem )
+    free_qmem( qmem );
+}
+
+/* evaluates one branch up to the end of the program, pushing the sibling
+   branch at every measurement where both outcomes are possible */
+static void run_branch( enumeration_t* e, branch_t branch ) {
+  qmem_t* qmem = branch.qmem;
+  sexp_t* exp = branch.exp;
+  double weight = branch.weight;
+  double prob_zero;
+
+  while( exp ) {
+    sexp_t* command = exp->ty == SEXP_LIST ? hd_sexp(exp) : exp;
+    sexp_t* rest = exp->ty == SEXP_LIST ? next_sexp(exp) : NULL;
+    if( get_opname( command ) != 'M' ) {
+      if( !eval_command( exp, qmem ) )
+	break;
+      exp = rest;
+      continue;
+    }
+
+    const qid_t qid = eval_M_rotate( command, qmem, &prob_zero );
+    const double weight_zero = weight * prob_zero;
+    const double weight_one = weight * (1.0 - prob_zero);
+    const bool zero = weight_zero > 0 && weight_zero >= e->threshold;
+    const bool one = weight_one > 0 && weight_one >= e->threshold;
+
+    if( !zero && !one ) {
+      prune( e, weight );
+      free_qmem( qmem );
+      return;
+    }
+    if( zero && one ) {
+      // clone only here, the rotated state is shared by both outcomes
+      qmem_t* sibling = clone_qmem( qmem );
+      eval_M_collapse( qid, 1, prob_zero, sibling );
+      sibling->pc += 1;
+      push_branch( e, (branch_t){ sibling, rest, weight_one } );
+    }
+    else
+      prune( e, zero ? weight_one : weight_zero );
+    eval_M_collapse( qid, zero ? 0 : 1, prob_zero, qmem );
+    qmem->pc += 1;
+    weight = zero ? weight_zero : weight_one;
+    exp = rest;
+  }
+  record_leaf( e, qmem, weight );
+}
+
+static void* enumeration_worker( void* argument ) {
+  enumeration_t* e = argument;
+  branch_t branch;
+
+  pthread_mutex_lock( &e->lock );
+  for(;;) {
+    while( e->num_open == 0 && e->busy > 0 )
+      pthread_cond_wait( &e->wakeup, &e->lock );
+    if( e->num_open == 0 ) // nothing open and nobody can open more
+      break;
+    branch = e->open[--e->num_open];
+    e->busy += 1;
+    pthread_mutex_unlock( &e->lock );
+
+    run_branch( e, branch );
+
+    pthread_mutex_lock( &e->lock );
+    e->busy -= 1;
+    if( e->busy == 0 && e->num_open == 0 )
+      pthread_cond_broadcast( &e->wakeup );
+  }
+  pthread_cond_broadcast( &e->wakeup );
+  pthread_mutex_unlock( &e->lock );
+  return NULL;
+}
+
+static int compare_leaves( const void* a, const void* b ) {
+  return strcmp( ((const leaf_t*)a)->outcome, ((const leaf_t*)b)->outcome );
+}
+
+static void print_enumeration( enumeration_t* e ) {
+  printf("enumerated %lu branches", (unsigned long)e->num_leaves);
+  if( e->num_pruned )
+    printf(", pruned %lu (probability %g)",
+	   (unsigned long)e->num_pruned, e->pruned);
+  printf("\n");
+  if( e->num_leaves == 0 )
+    return;
+
+  printf("outcomes over qids [");
+  const signal_map_t* signal_map = &e->states[0].qmem->signal_map;
+  for( int qid=0, tally=0 ; qid<MAX_QUBITS ; ++qid )
+    if( BITTEST(signal_map->entries, qid) )
+      printf( tally++ ? ", %d" : "%d", qid );
+  printf("]:\n  {\n");
+  qsort( e->leaves, e->num_leaves, sizeof(leaf_t), compare_leaves );
+  for( size_t i=0; i<e->num_leaves; ++i )
+    printf("   %s : %.12f -> state %lu\n", e->leaves[i].outcome,
+	   e->leaves[i].weight, (unsigned long)e->leaves[i].state);
+  printf("  }\n");
+
+  printf("%lu distinct output state%s (up to global phase):\n",
+	 (unsigned long)e->num_states, e->num_states == 1 ? "" : "s");
+  for( size_t s=0; s<e->num_states; ++s ) {
+    const qmem_t* qmem = e->states[s].qmem;
+    printf(" state %lu, probability %.12f:\n  {",
+	   (unsigned long)s, e->states[s].weight);
+    for( int i=0, tally=0 ; tally < qmem->size ; ++i )
+      if( qmem->tangles[i] ) {
+	if( tally>0 )
+	  printf(",\n   ");
+	print_tangle( qmem->tangles[i] );
+	++tally;
+      }
+    printf("}\n");
+  }
+}
+
+void enumerate_run( sexp_t* program,
+		    qmem_t* restrict qmem,
+		    double threshold,
+		    size_t threads ) {
+  enumeration_t e;
+
+  if( threads == 0 ) {
+    const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    threads = cpus > 0 ? cpus : 1;
+  }
+  memset( &e, 0, sizeof(e) );
+  e.threshold = threshold;
+  pthread_mutex_init( &e.lock, NULL );
+  pthread_cond_init( &e.wakeup, NULL );
+
+  // the workers must not prompt for angle constants at the same time
+  resolve_angle_constants( program );
+  // the root branch works on a copy, qmem itself is left untouched
+  push_branch( &e, (branch_t){ clone_qmem( qmem ), program, 1.0 } );
+  pthread_t* pool = malloc( threads * sizeof(pthread_t) );
+  size_t started = 0;
+  for( ; started<threads; ++started )
+    if( pthread_create( &pool[started], NULL, enumeration_worker, &e ) != 0 )
+      break;
+  if( started == 0 ) // no threads available, do it ourselves
+    enumeration_worker( &e );
+  for( size_t t=0; t<started; ++t )
+    pthread_join( pool[t], NULL );
+  free( pool );
+
+  print_enumeration( &e );
+
+  for( size_t i=0; i<e.num_leaves; ++i )
+    free( e.leaves[i].outcome );
+  for( size_t s=0; s<e.num_states; ++s )
+    free_qmem( e.states[s].qmem );
+  free( e.leaves );
+  free( e.states );
+  free( e.open );
+  pthread_mutex_destroy( &e.lock );
+  pthread_cond_destroy( &e.wakeup );
+}
@@ -0,0 +1,20 @@
+#ifndef ENUMERATE_H
+#define ENUMERATE_H
+
+#include "qvm.h"
+
+/* Exact outcome enumeration.
+   Instead of sampling, every measurement is followed into both of its
+   branches, each weighted by its probability.  qmem is only cloned at the
+   branch points; the subtrees are evaluated by a pool of threads.  Branches
+   whose probability drops below the threshold are pruned and their mass is
+   reported.  The result is the exact distribution over the signal map and
+   the distinct output states the branches end up in. */
+
+// threads == 0 uses one thread per online CPU
+void enumerate_run( sexp_t* program,
+		    qmem_t* restrict qmem,
+		    double threshold,
+		    size_t threads );
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "qvm.h"
+#include "frame.h"
+#include "dense.h"
+#include "cold.h"
+
+bool _pauli_frame_ = true;
+
+void frame_cz( const qid_t qid_1, const qid_t qid_2, qmem_t* restrict qmem ) {
+  const bool x_1 = BITTEST(qmem->frame.x, qid_1);
+  const bool x_2 = BITTEST(qmem->frame.x, qid_2);
+  // CZ X_a^x Z_a^z X_b^x' Z_b^z' CZ = X_a^x Z_a^(z+x') X_b^x' Z_b^(z'+x)
+  //  times (-1)^(x x') from moving Z_b past X_b
+  if( x_1 && x_2 )
+    qmem->frame.phase += M_PI;
+  if( x_1 )
+    BITFLIP(qmem->frame.z, qid_2);
+  if( x_2 )
+    BITFLIP(qmem->frame.z, qid_1);
+}
+
+/* <s_a| X^x Z^z = ((-1)^s e^-ia)^x <s_b|, b = (-1)^x a + z PI, where <s_a|
+   is the bra of outcome s at angle a */
+void frame_measure( const qid_t qid, double* angle, qmem_t* restrict qmem ) {
+  if( BITTEST(qmem->frame.x, qid) ) {
+    qmem->frame.phase -= *angle;
+    *angle = -*angle;
+  }
+  if( BITTEST(qmem->frame.z, qid) )
+    *angle += M_PI;
+}
+
+void frame_outcome( const qid_t qid, const int signal, qmem_t* restrict qmem ) {
+  if( signal && BITTEST(qmem->frame.x, qid) )
+    qmem->frame.phase += M_PI;
+  BITCLEAR(qmem->frame.x, qid);
+  BITCLEAR(qmem->frame.z, qid);
+}
+
+static void apply_phase( tangle_t* restrict tangle, double phase ) {
+  const COMPLEX_FLOAT z = quantum_cexp( phase );
+  cold_thaw( tangle );
+  if( is_dense( tangle ) )
+    for( size_t i=0; i<tangle_amplitudes( tangle ); ++i )
+      tangle->amplitudes[i] *= z;
+  else
+    for( int i=0; i<tangle->qureg.size; ++i )
+      tangle->qureg.node[i].amplitude *= z;
+}
+
+void frame_flush( qmem_t* restrict qmem ) {
+  const double phase = remainder( qmem->frame.phase, 2 * M_PI );
+  qmem->frame.phase = 0;
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
+    tangle_t* tangle = qmem->tangles[i];
+    if( tangle == NULL )
+      continue;
+    // a global phase, any one tangle can take it
+    if( tally == 0 && fabs( phase ) > 1e-12 )
+      apply_phase( tangle, phase );
+    for( const qid_list_t* cons = tangle->qids; cons; cons=cons->rest ) {
+      const qid_t qid = cons->qid;
+      if( !BITTEST(qmem->frame.x, qid) && !BITTEST(qmem->frame.z, qid) )
+	continue;
+      const qubit_t qubit = find_qubit( qid, qmem );
+      // X^x Z^z, the Z goes first
+      if( BITTEST(qmem->frame.z, qid) )
+	qop_z( qubit );
+      if( BITTEST(qmem->frame.x, qid) )
+	qop_x( qubit );
+      BITCLEAR(qmem->frame.x, qid);
+      BITCLEAR(qmem->frame.z, qid);
+    }
+    ++tally;
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "qvm.h"
+
+/* Pauli frame (on by default, --no-pauli-frame turns it off).
+   X and Z corrections are not applied to the tangle but recorded per qubit
+   in qmem->frame, the state being X^x Z^z times the stored one.  An E
+   moves an X on one qubit into a Z on the other (CZ X_a = X_a Z_b CZ), a
+   measurement folds the frame into its angle, X negating it and Z adding
+   PI, and only qubits that are never measured get their corrections
+   applied, by frame_flush() before the state is printed or written.
+   The global phase of the reorderings is kept as well, so the output is the
+   same as with the corrections applied in place. */
+
+extern bool _pauli_frame_;
+
+static inline void frame_x( const qid_t qid, qmem_t* restrict qmem ) {
+  BITFLIP(qmem->frame.x, qid);
+}
+
+// Z X^x Z^z = (-1)^x X^x Z^(z+1)
+static inline void frame_z( const qid_t qid, qmem_t* restrict qmem ) {
+  if( BITTEST(qmem->frame.x, qid) )
+    qmem->frame.phase += M_PI;
+  BITFLIP(qmem->frame.z, qid);
+}
+
+void frame_cz( const qid_t qid_1, const qid_t qid_2, qmem_t* restrict qmem );
+// folds the frame of the measured qubit into angle
+void frame_measure( const qid_t qid, double* angle, qmem_t* restrict qmem );
+// the phase that depends on the outcome, clears the frame of the qubit
+void frame_outcome( const qid_t qid, const int signal, qmem_t* restrict qmem );
+// applies the frame of the qubits in qmem to their tangles
+void frame_flush( qmem_t* restrict qmem );
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+#include "qvm.h"
+#include "generate.h"
+
+#define LINE_WIDTH 78
+
+typedef struct pattern {
+  char* text;
+  size_t length, capacity;
+  size_t column;
+  unsigned long long rng;
+  // J-decomposed circuits: the qid each wire currently lives on
+  qid_t* wires;
+  bool* pending_h;  // a hadamard not emitted yet, two of them cancel
+  int num_wires;
+  qid_t next_qid;
+} pattern_t;
+
+static void append( pattern_t* p, const char* fmt, ... ) {
+  va_list args;
+  va_start( args, fmt );
+  const int length = vsnprintf( NULL, 0, fmt, args );
+  va_end( args );
+  if( p->length + length + 3 > p->capacity ) {
+    p->capacity = 2 * (p->length + length + 3);
+    p->text = realloc( p->text, p->capacity );
+    if( p->text == NULL ) {
+      printf("ERROR: out of memory generating pattern\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  va_start( args, fmt );
+  vsnprintf( p->text + p->length, length + 1, fmt, args );
+  va_end( args );
+  p->length += length;
+}
+
+/* appends one command, wrapping lines like the checked-in patterns */
+static void command( pattern_t* p, const char* fmt, ... ) {
+  char buffer[256];
+  va_list args;
+  va_start( args, fmt );
+  const int length = vsnprintf( buffer, sizeof(buffer), fmt, args );
+  va_end( args );
+  if( p->column == 0 ) {
+    append( p, "(%s", buffer );
+    p->column = length + 1;
+  }
+  else if( p->column + length + 1 > LINE_WIDTH ) {
+    append( p, "\n %s", buffer );
+    p->column = length + 1;
+  }
+  else {
+    append( p, " %s", buffer );
+    p->column += length + 1;
+  }
+}
+
+static double random_angle( pattern_t* p ) {
+  // splitmix64, same generator as the measurements
+  unsigned long long z = (p->rng += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  z ^= z >> 31;
+  return (z >> 11) * (1.0 / 9007199254740992.0) * 2 * M_PI;
+}
+
+/** J-decomposed circuits **/
+
+static void init_wires( pattern_t* p, int num_wires ) {
+  p->num_wires = num_wires;
+  p->wires = malloc( num_wires * sizeof(qid_t) );
+  p->pending_h = calloc( num_wires, sizeof(bool) );
+  for( int w=0; w<num_wires; ++w )
+    p->wires[w] = w;
+  p->next_qid = num_wires;
+}
+
+// J(angle) = H P(angle), teleports the wire onto a fresh qubit
+static void emit_j( pattern_t* p, int w, double angle ) {
+  const qid_t from = p->wires[w];
+  const qid_t to = p->next_qid++;
+  command( p, "(E %d %d)", from, to );
+  command( p, "(M %d (- %.17g))", from, angle );
+  command( p, "(X %d (Q %d))", to, from );
+  p->wires[w] = to;
+}
+
+static void flush( pattern_t* p, int w ) {
+  if( p->pending_h[w] ) {
+    emit_j( p, w, 0 );
+    p->pending_h[w] = false;
+  }
+}
+
+static void gate_h( pattern_t* p, int w ) {
+  p->pending_h[w] = !p->pending_h[w];
+}
+
+// P(angle) = J(0) J(angle)
+static void gate_phase( pattern_t* p, int w, double angle ) {
+  flush( p, w );
+  emit_j( p, w, angle );
+  p->pending_h[w] = true;
+}
+
+static void gate_cz( pattern_t* p, int a, int b ) {
+  flush( p, a );
+  flush( p, b );
+  command( p, "(E %d %d)", p->wires[a], p->wires[b] );
+}
+
+static void gate_cnot( pattern_t* p, int control, int target ) {
+  gate_h( p, target );
+  gate_cz( p, control, target );
+  gate_h( p, target );
+}
+
+// diag(1,1,1,e^{i angle}) through a ZZ rotation
+static void gate_cphase( pattern_t* p, int a, int b, double angle ) {
+  gate_phase( p, a, angle / 2 );
+  gate_phase( p, b, angle / 2 );
+  gate_cnot( p, a, b );
+  gate_phase( p, b, -angle / 2 );
+  gate_cnot( p, a, b );
+}
+
+static void finish_wires( pattern_t* p ) {
+  for( int w=0; w<p->num_wires; ++w )
+    flush( p, w );
+}
+
+static void generate_qft( pattern_t* p, int n ) {
+  init_wires( p, n );
+  for( int i=0; i<n; ++i ) {
+    gate_h( p, i );
+    for( int j=i+1; j<n; ++j )
+      gate_cphase( p, j, i, M_PI / (1 << (j-i)) );
+  }
+  finish_wires( p );
+}
+
+static void generate_random( pattern_t* p, int n, int depth ) {
+  init_wires( p, n );
+  for( int layer=0; layer<depth; ++layer ) {
+    for( int w=0; w<n; ++w ) {
+      flush( p, w );
+      emit_j( p, w, random_angle( p ) );
+    }
+    // brickwork: even pairs on even layers, odd pairs on odd layers
+    for( int w=layer % 2; w+1<n; w+=2 )
+      gate_cz( p, w, w+1 );
+  }
+  finish_wires( p );
+}
+
+/** graph states **/
+
+static void generate_ghz( pattern_t* p, int n ) {
+  // a star graph with hadamards on the leaves
+  for( int k=1; k<n; ++k )
+    command( p, "(E 0 %d)", k );
+  init_wires( p, n );
+  for( int k=1; k<n; ++k )
+    emit_j( p, k, 0 );
+}
+
+/* appends the signal xor-ing the given qids */
+static void signal( char* buffer, size_t size, const qid_t* qids, int count ) {
+  if( count == 0 ) {
+    snprintf( buffer, size, "0" );
+    return;
+  }
+  if( count == 1 ) {
+    snprintf( buffer, size, "(q %d)", qids[0] );
+    return;
+  }
+  size_t used = snprintf( buffer, size, "(+" );
+  for( int i=0; i<count && used<size; ++i )
+    used += snprintf( buffer + used, size - used, " (q %d)", qids[i] );
+  if( used < size )
+    snprintf( buffer + used, size - used, ")" );
+}
+
+/* Measured column by column with the flow f(r,c) = (r,c+1): the X
+   correction of (r,c-1) becomes an s-signal, the Z corrections of
+   (r,c-2), (r-1,c-1) and (r+1,c-1) become t-signals. */
+static void generate_cluster( pattern_t* p, int width, int height ) {
+  char s_signal[128], t_signal[128];
+  qid_t s_domain[1], t_domain[3];
+#define QID(r,c) ((r) * width + (c))
+
+  for( int r=0; r<height; ++r )
+    for( int c=0; c<width; ++c ) {
+      if( c+1 < width )
+	command( p, "(E %d %d)", QID(r,c), QID(r,c+1) );
+      if( r+1 < height )
+	command( p, "(E %d %d)", QID(r,c), QID(r+1,c) );
+    }
+
+  for( int c=0; c<width; ++c )
+    for( int r=0; r<height; ++r ) {
+      int s = 0, t = 0;
+      if( c >= 1 )
+	s_domain[s++] = QID(r,c-1);
+      if( c >= 2 )
+	t_domain[t++] = QID(r,c-2);
+      if( c >= 1 && r >= 1 )
+	t_domain[t++] = QID(r-1,c-1);
+      if( c >= 1 && r+1 < height )
+	t_domain[t++] = QID(r+1,c-1);
+      signal( s_signal, sizeof(s_signal), s_domain, s );
+      signal( t_signal, sizeof(t_signal), t_domain, t );
+      if( c+1 < width )
+	command( p, "(M %d %.17g %s %s)", QID(r,c), random_angle( p ),
+		 s_signal, t_signal );
+      else { // output column
+	if( s )
+	  command( p, "(X %d %s)", QID(r,c), s_signal );
+	if( t )
+	  command( p, "(Z %d %s)", QID(r,c), t_signal );
+      }
+    }
+#undef QID
+}
+
+char* generate_pattern( const char* spec, unsigned long long seed ) {
+  pattern_t p;
+  int a = 0, b = 0;
+
+  memset( &p, 0, sizeof(p) );
+  p.rng = seed;
+  if( sscanf( spec, "qft:%d", &a ) == 1 && a > 0 && a < 63 )
+    generate_qft( &p, a );
+  else if( sscanf( spec, "ghz:%d", &a ) == 1 && a > 1 )
+    generate_ghz( &p, a );
+  else if( sscanf( spec, "linear:%d", &a ) == 1 && a > 1 )
+    generate_cluster( &p, a, 1 );
+  else if( sscanf( spec, "cluster:%dx%d", &a, &b ) == 2 && a > 1 && b > 0 )
+    generate_cluster( &p, a, b );
+  else if( sscanf( spec, "random:%d,%d", &a, &b ) == 2 && a > 0 && b > 0 )
+    generate_random( &p, a, b );
+  else {
+    printf("ERROR: unknown pattern generator '%s', expected qft:N, ghz:N, "
+	   "linear:N, cluster:WxH or random:N,D\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  if( p.column == 0 ) // empty pattern
+    append( &p, "(" );
+  append( &p, ")\n" );
+  free( p.wires );
+  free( p.pending_h );
+  return p.text;
+}
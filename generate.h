@@ -0,0 +1,20 @@
+#ifndef GENERATE_H
+#define GENERATE_H
+
+#include "qvm.h"
+
+/* Built-in pattern generators (--generate=spec), for scaling studies that
+   sweep sizes without storing pattern files.  spec is one of
+     qft:N        N qubit quantum Fourier transform (without the final
+                  swaps), J-decomposed like the patterns in qft_new/
+     ghz:N        N qubit GHZ state
+     linear:N     linear cluster of N qubits, measured at random angles
+     cluster:WxH  W columns by H rows cluster state, all columns but the
+                  last measured at random angles (with the flow corrections)
+     random:N,D   random J-decomposed circuit over N wires, D layers deep
+   The random angles are drawn from seed.  Returns the pattern as .mc text,
+   to be freed by the caller. */
+
+char* generate_pattern( const char* spec, unsigned long long seed );
+
+#endif
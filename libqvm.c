@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <pthread.h>
+
+#include <sexp.h>
+
+#include "qvm.h"
+#include "libqvm.h"
+#include "dense.h"
+#include "frame.h"
+#include "truncation.h"
+#include "wires.h"
+#include "mps.h"
+#include "outofcore.h"
+#include "cold.h"
+#include "placement.h"
+
+struct qvm {
+  qmem_t* qmem;
+  sexp_t* program;
+  unsigned long long seed;
+  int* qids;           // qids of the last qvm_state
+  size_t qids_size;
+};
+
+// from libquantum's error.h
+extern void* quantum_error_handler( void* f(int) );
+extern const char* quantum_strerr( int code );
+
+/* libsexp's caches, libquantum's memory counter and the options,
+   statistics and angle constants of the evaluator are process-wide, every
+   call that gets to them holds this lock */
+static pthread_mutex_t _lock_ = PTHREAD_MUTEX_INITIALIZER;
+// where an error in the current thread returns to
+static __thread jmp_buf* _recover_ = NULL;
+static pthread_once_t _init_once_ = PTHREAD_ONCE_INIT;
+
+void qvm_exit( int status ) {
+  if( _recover_ )
+    longjmp( *_recover_, 1 );
+  (exit)( status );
+}
+
+// libquantum's errors return to the call as well, instead of abort()
+static void* quantum_failed( int code ) {
+  printf("ERROR: libquantum: %s\n", quantum_strerr( code ));
+  exit(EXIT_FAILURE);
+}
+
+static void init_library( void ) {
+  init_prototypes();
+  quantum_error_handler( quantum_failed );
+}
+
+/* the error may have left the quantum memory of vm halfway through a
+   command, so it is dropped without freeing it */
+static void abandon_qmem( qvm_t* vm ) {
+  vm->qmem = init_qmem();
+  vm->qmem->rng = vm->seed;
+}
+
+/* runs body for vm with _lock_ held, an error in it abandons the quantum
+   memory, unlocks and returns QVM_ERROR */
+#define QVM_GUARDED( vm, ... )			\
+  do {						\
+    jmp_buf recover;				\
+    jmp_buf* const outer = _recover_;		\
+    if( setjmp( recover ) ) {			\
+      _recover_ = outer;			\
+      if( vm )					\
+	abandon_qmem( vm );			\
+      pthread_mutex_unlock( &_lock_ );		\
+      return QVM_ERROR;				\
+    }						\
+    _recover_ = &recover;			\
+    __VA_ARGS__;				\
+    _recover_ = outer;				\
+  } while( 0 )
+
+qvm_t* qvm_new( void ) {
+  qvm_t* vm = calloc( 1, sizeof(qvm_t) );
+  if( vm == NULL )
+    return NULL;
+  pthread_once( &_init_once_, init_library );
+  pthread_mutex_lock( &_lock_ );
+  vm->qmem = init_qmem();
+  pthread_mutex_unlock( &_lock_ );
+  vm->seed = vm->qmem->rng;
+  return vm;
+}
+
+void qvm_free( qvm_t* vm ) {
+  if( vm == NULL )
+    return;
+  pthread_mutex_lock( &_lock_ );
+  free_qmem( vm->qmem );
+  destroy_sexp( vm->program );
+  pthread_mutex_unlock( &_lock_ );
+  free( vm->qids );
+  free( vm );
+}
+
+void qvm_reset( qvm_t* vm ) {
+  pthread_mutex_lock( &_lock_ );
+  free_qmem( vm->qmem );
+  vm->qmem = init_qmem();
+  vm->qmem->rng = vm->seed;
+  pthread_mutex_unlock( &_lock_ );
+}
+
+void qvm_seed( qvm_t* vm, unsigned long long seed ) {
+  vm->seed = seed;
+  vm->qmem->rng = seed;
+}
+
+int qvm_configure( const char* option, const char* value ) {
+  qvm_t* const vm = NULL;
+  const bool on = value == NULL || strcmp( value, "off" ) != 0;
+
+  pthread_mutex_lock( &_lock_ );
+  QVM_GUARDED( vm, {
+    if( strcmp( option, "dense" ) == 0 )
+      dense_configure( value ? value : "off" );
+    else if( strcmp( option, "truncate" ) == 0 )
+      truncation_configure( value ? value : "" );
+    else if( strcmp( option, "mps" ) == 0 ) {
+      if( on )
+	mps_configure( value );
+      else
+	_mps_enabled_ = _mps_auto_ = false;
+    }
+    else if( strcmp( option, "out-of-core" ) == 0 ) {
+      if( on )
+	ooc_configure( value ? value : "" );
+      else
+	_ooc_dir_ = NULL;
+    }
+    else if( strcmp( option, "compress" ) == 0 )
+      cold_configure( on ? (value ? value : "") : "off" );
+    else if( strcmp( option, "numa" ) == 0 )
+      placement_configure_numa( value ? value : "default" );
+    else if( strcmp( option, "huge-pages" ) == 0 )
+      placement_configure_pages( value ? value : "transparent" );
+    else if( strcmp( option, "threads" ) == 0 )
+      dense_configure_threads( value ? value : "" );
+    else if( strcmp( option, "pauli-frame" ) == 0 )
+      _pauli_frame_ = on;
+    else if( strcmp( option, "alt-measure" ) == 0 )
+      _alt_measure_ = on;
+    else if( strcmp( option, "verbose" ) == 0 )
+      _verbose_ = on;
+    else {
+      printf("ERROR: unknown libqvm option '%s'\n", option);
+      exit(EXIT_FAILURE);
+    }
+  } );
+  pthread_mutex_unlock( &_lock_ );
+  return QVM_OK;
+}
+
+int qvm_load( qvm_t* vm, const char* pattern, size_t length, int shorten ) {
+  char* text = malloc( length + 1 );
+  if( text == NULL )
+    return QVM_ERROR;
+  memcpy( text, pattern, length );
+  text[length] = 0;
+  pthread_mutex_lock( &_lock_ );
+  destroy_sexp( vm->program );
+  vm->program = parse_sexp( text, length );
+  free( text );
+  if( vm->program == NULL || vm->program->ty != SEXP_LIST ) {
+    printf("ERROR: cannot read a program from the pattern\n");
+    destroy_sexp( vm->program );
+    vm->program = NULL;
+    pthread_mutex_unlock( &_lock_ );
+    return QVM_ERROR;
+  }
+  if( shorten ) {
+    sexp_t* const program = vm->program;
+    // a failed rewrite may leave the program inconsistent as well
+    vm->program = NULL;
+    QVM_GUARDED( vm, shorten_wires( program, vm->qmem, true ) );
+    vm->program = program;
+  }
+  pthread_mutex_unlock( &_lock_ );
+  return QVM_OK;
+}
+
+int qvm_set_input( qvm_t* vm, const int* qids, int width,
+		   const COMPLEX_FLOAT* amplitudes ) {
+  if( width < 1 || width > DENSE_MAX_WIDTH ) {
+    printf("ERROR: input states take 1 to %d qubits, not %d\n",
+	   DENSE_MAX_WIDTH, width);
+    return QVM_ERROR;
+  }
+  pthread_mutex_lock( &_lock_ );
+  for( int i=0; i<width; ++i )
+    if( qids[i] < 0 || qids[i] >= (int)MAX_QUBITS ||
+	!invalid( find_qubit( qids[i], vm->qmem ) ) ) {
+      printf("ERROR: trying to add already existing or invalid qubit "
+	     "as input state (qid:%d)\n", qids[i]);
+      pthread_mutex_unlock( &_lock_ );
+      return QVM_ERROR;
+    }
+
+  QVM_GUARDED( vm,
+	       add_amplitudes_tangle( qids, width, amplitudes, vm->qmem ) );
+  pthread_mutex_unlock( &_lock_ );
+  return QVM_OK;
+}
+
+int qvm_run( qvm_t* vm ) {
+  if( vm->program == NULL ) {
+    printf("ERROR: no pattern loaded\n");
+    return QVM_ERROR;
+  }
+  pthread_mutex_lock( &_lock_ );
+  truncation_reset();
+  QVM_GUARDED( vm, {
+    if( mps_wanted( vm->program->list, vm->qmem, true ) )
+      mps_run( vm->program->list, vm->qmem );
+    else
+      eval( vm->program->list, vm->qmem );
+    frame_flush( vm->qmem );
+    normalize_qmem( vm->qmem );
+  } );
+  pthread_mutex_unlock( &_lock_ );
+  return QVM_OK;
+}
+
+int qvm_signal( const qvm_t* vm, int qid ) {
+  const signal_map_t* signal_map = &vm->qmem->signal_map;
+  if( qid < 0 || qid >= (int)MAX_QUBITS || !BITTEST(signal_map->entries, qid) )
+    return -1;
+  return BITTEST(signal_map->signals, qid) ? 1 : 0;
+}
+
+int qvm_state( qvm_t* vm, int qid, qvm_state_t* state ) {
+  tangle_t* tangle = NULL;
+  pthread_mutex_lock( &_lock_ );
+  // thawing a cold tangle allocates
+  QVM_GUARDED( vm, {
+      tangle = (tangle_t*)( qid < 0 ? fetch_first_tangle( vm->qmem ) :
+	qid < (int)MAX_QUBITS ? find_qubit( qid, vm->qmem ).tangle : NULL );
+      // the layout of the output file, in place
+      if( tangle )
+	canonicalize_tangle( tangle );
+    } );
+  pthread_mutex_unlock( &_lock_ );
+  if( tangle == NULL )
+    return QVM_ERROR;
+  if( vm->qids_size < (size_t)tangle->size ) {
+    free( vm->qids );
+    vm->qids = malloc( tangle->size * sizeof(int) );
+    vm->qids_size = vm->qids ? tangle->size : 0;
+    if( vm->qids == NULL )
+      return QVM_ERROR;
+  }
+  int n = 0;
+  for( const qid_list_t* cons = tangle->qids; cons; cons = cons->rest )
+    vm->qids[n++] = cons->qid;
+  state->width = n;
+  state->qids = vm->qids;
+  if( is_dense( tangle ) ) {
+    state->size = 1 << tangle->qureg.width;
+    state->nodes = NULL;
+    state->amplitudes = tangle->amplitudes;
+  }
+  else {
+    state->size = tangle->qureg.size;
+    state->nodes = tangle->qureg.node;
+    state->amplitudes = NULL;
+  }
+  return QVM_OK;
+}
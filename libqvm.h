@@ -0,0 +1,64 @@
+#ifndef LIBQVM_H
+#define LIBQVM_H
+
+#include <stddef.h>
+#include <quantum.h>
+
+/* Embeddable interpreter (make lib builds libqvm.a).
+   An instance owns a quantum memory and a loaded pattern.  The evaluator
+   keeps process-wide state (libsexp's caches, libquantum's memory
+   counter, options, statistics, angle constants), so the calls below
+   take one library-wide lock: instances may be used from different
+   threads, but only one call runs at a time.  Results are read in
+   place: qvm_state points into the instance's nodes or dense amplitude
+   array, valid until the instance is changed again.
+   Errors the command line qvm exits on, libquantum's included, make a
+   call return QVM_ERROR instead, after printing the same ERROR message.
+   The quantum memory of the instance may be halfway through a command
+   then, so it is abandoned, not freed, and the instance starts over
+   empty (a failed --shorten-wires rewrite drops the pattern the same way).
+   The library starts no threads of its own that can fail.
+   qvm_configure sets the process-wide options of the command line
+   (dense, truncate, mps, out-of-core, compress, numa, huge-pages, threads,
+   pauli-frame, alt-measure, verbose). */
+
+#define QVM_OK     0
+#define QVM_ERROR -1
+
+typedef struct qvm qvm_t;
+
+/* a tangle of the result, in the order of the output file format; a
+   sparse tangle has nodes, a dense one its 2^width amplitudes indexed by
+   basis state, neither is copied */
+typedef struct qvm_state {
+  int width;
+  const int* qids;                  // width qids
+  int size;                         // nodes, or 2^width amplitudes
+  const quantum_reg_node* nodes;    // basis state and amplitude, or NULL
+  const COMPLEX_FLOAT* amplitudes;  // dense tangles, else NULL
+} qvm_state_t;
+
+qvm_t* qvm_new( void );
+void qvm_free( qvm_t* vm );
+// drops the quantum memory and the signals, keeps the pattern
+void qvm_reset( qvm_t* vm );
+void qvm_seed( qvm_t* vm, unsigned long long seed );
+int qvm_configure( const char* option, const char* value );
+
+// parses one program from the text of a pattern, rewritten as by
+// --shorten-wires if shorten is set
+int qvm_load( qvm_t* vm, const char* pattern, size_t length, int shorten );
+// adds a tangle of width qids with the 2^width amplitudes, as -f does
+int qvm_set_input( qvm_t* vm, const int* qids, int width,
+		   const COMPLEX_FLOAT* amplitudes );
+int qvm_run( qvm_t* vm );
+
+// 0 or 1, -1 for a qubit that was not measured
+int qvm_signal( const qvm_t* vm, int qid );
+// the tangle of qid, or the first one as written by -o for qid < 0
+int qvm_state( qvm_t* vm, int qid, qvm_state_t* state );
+
+// exit() of the library build, returns to the failing API call
+void qvm_exit( int status ) __attribute__((noreturn));
+
+#endif
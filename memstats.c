@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sexp.h>
+
+#include "qvm.h"
+#include "memstats.h"
+#include "dense.h"
+
+typedef struct memstats_sample {
+  size_t amplitudes;
+  size_t hash;
+  size_t qids;
+  size_t program;
+  size_t tangles;
+  size_t largest_tangle;  // bytes of amplitudes and hash
+  int largest_width;
+} memstats_sample_t;
+
+bool _memstats_enabled_ = false;
+
+static memstats_sample_t _live_;
+static memstats_sample_t _category_peak_;
+static memstats_sample_t _peak_;
+static size_t _peak_pc_ = 0;
+static size_t _pc_ = 0;
+static memstats_phase_t _phase_ = MEMSTATS_PARSE;
+static size_t _phase_peak_[MEMSTATS_PHASES];
+
+static const char* _phase_names_[MEMSTATS_PHASES] = {
+  "parse", "eval", "output"
+};
+
+static size_t total( const memstats_sample_t* sample ) {
+  return sample->amplitudes + sample->hash + sample->qids + sample->program;
+}
+
+static size_t qureg_bytes( const quantum_reg* restrict reg ) {
+  return reg->size * sizeof(quantum_reg_node) +
+    (reg->hashw ? ((size_t)1 << reg->hashw) * sizeof(int) : 0);
+}
+
+static void update_peaks( const memstats_sample_t* sample, size_t pc ) {
+  if( sample->amplitudes > _category_peak_.amplitudes )
+    _category_peak_.amplitudes = sample->amplitudes;
+  if( sample->hash > _category_peak_.hash )
+    _category_peak_.hash = sample->hash;
+  if( sample->qids > _category_peak_.qids )
+    _category_peak_.qids = sample->qids;
+  if( sample->program > _category_peak_.program )
+    _category_peak_.program = sample->program;
+  if( total( sample ) > total( &_peak_ ) ) {
+    _peak_ = *sample;
+    _peak_pc_ = pc;
+  }
+  if( total( sample ) > _phase_peak_[_phase_] )
+    _phase_peak_[_phase_] = total( sample );
+}
+
+void memstats_init() {
+  _memstats_enabled_ = true;
+  memset( &_live_, 0, sizeof(_live_) );
+  memset( &_category_peak_, 0, sizeof(_category_peak_) );
+  memset( &_peak_, 0, sizeof(_peak_) );
+  memset( _phase_peak_, 0, sizeof(_phase_peak_) );
+}
+
+void memstats_phase( memstats_phase_t phase ) {
+  if( !_memstats_enabled_ )
+    return;
+  _phase_ = phase;
+  update_peaks( &_live_, _pc_ );
+}
+
+static size_t sexp_bytes( const sexp_t* exp ) {
+  size_t bytes = 0;
+  for( ; exp; exp = exp->next ) {
+    bytes += sizeof(sexp_t);
+    if( exp->ty == SEXP_LIST )
+      bytes += sexp_bytes( exp->list );
+    else
+      bytes += exp->val_allocated;
+  }
+  return bytes;
+}
+
+void memstats_program( const sexp_t* program ) {
+  if( !_memstats_enabled_ )
+    return;
+  _live_.program = sexp_bytes( program );
+  update_peaks( &_live_, _pc_ );
+}
+
+void memstats_sample( const qmem_t* restrict qmem ) {
+  const tangle_t* tangle;
+  if( !_memstats_enabled_ )
+    return;
+
+  memstats_sample_t sample = { 0, 0, 0, _live_.program, 0, 0, 0 };
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
+    tangle = qmem->tangles[i];
+    if( tangle == NULL )
+      continue;
+    const size_t nodes = tangle_amplitude_bytes( tangle );
+    const size_t bytes = nodes + tangle_hash_bytes( tangle );
+    sample.amplitudes += nodes;
+    sample.hash += bytes - nodes;
+    sample.qids += sizeof(tangle_t) + tangle->size * sizeof(qid_list_t);
+    sample.tangles += 1;
+    if( bytes > sample.largest_tangle ) {
+      sample.largest_tangle = bytes;
+      sample.largest_width = tangle->qureg.width;
+    }
+    ++tally;
+  }
+  _live_ = sample;
+  _pc_ = qmem->pc;
+  update_peaks( &_live_, _pc_ );
+}
+
+void memstats_transient( const quantum_reg* restrict reg ) {
+  if( !_memstats_enabled_ )
+    return;
+  memstats_sample_t sample = _live_;
+  const size_t nodes = reg->size * sizeof(quantum_reg_node);
+  const size_t bytes = qureg_bytes( reg );
+  sample.amplitudes += nodes;
+  sample.hash += bytes - nodes;
+  if( bytes > sample.largest_tangle ) {
+    sample.largest_tangle = bytes;
+    sample.largest_width = reg->width;
+  }
+  // the kronecker belongs to the command after the last sample
+  update_peaks( &sample, _pc_ );
+}
+
+void memstats_transient_dense( int width ) {
+  if( !_memstats_enabled_ )
+    return;
+  memstats_sample_t sample = _live_;
+  const size_t bytes = ((size_t)1 << width) * sizeof(COMPLEX_FLOAT);
+  sample.amplitudes += bytes;
+  if( bytes > sample.largest_tangle ) {
+    sample.largest_tangle = bytes;
+    sample.largest_width = width;
+  }
+  update_peaks( &sample, _pc_ );
+}
+
+void memstats_print() {
+  if( !_memstats_enabled_ )
+    return;
+  printf("memory (bytes)            live   category peak   at overall peak\n");
+  printf("  amplitudes      %12lu    %12lu      %12lu\n",
+	 (unsigned long)_live_.amplitudes,
+	 (unsigned long)_category_peak_.amplitudes,
+	 (unsigned long)_peak_.amplitudes);
+  printf("  hash tables     %12lu    %12lu      %12lu\n",
+	 (unsigned long)_live_.hash,
+	 (unsigned long)_category_peak_.hash,
+	 (unsigned long)_peak_.hash);
+  printf("  qid bookkeeping %12lu    %12lu      %12lu\n",
+	 (unsigned long)_live_.qids,
+	 (unsigned long)_category_peak_.qids,
+	 (unsigned long)_peak_.qids);
+  printf("  program         %12lu    %12lu      %12lu\n",
+	 (unsigned long)_live_.program,
+	 (unsigned long)_category_peak_.program,
+	 (unsigned long)_peak_.program);
+  printf("  total           %12lu                      %12lu\n",
+	 (unsigned long)total( &_live_ ), (unsigned long)total( &_peak_ ));
+  printf("peak reached at command %lu with %lu tangles, the largest of width "
+	 "%d holding %lu bytes\n",
+	 (unsigned long)_peak_pc_, (unsigned long)_peak_.tangles,
+	 _peak_.largest_width, (unsigned long)_peak_.largest_tangle);
+  printf("peak per phase:");
+  for( int phase=0; phase<MEMSTATS_PHASES; ++phase )
+    printf(" %s %lu", _phase_names_[phase], (unsigned long)_phase_peak_[phase]);
+  printf("\nlibquantum accounts for %lu bytes still allocated\n",
+	 quantum_memman( 0 ));
+}
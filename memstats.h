@@ -0,0 +1,35 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include "qvm.h"
+
+/* In-process memory accounting (--memstats).
+   Live bytes are split into amplitudes (libquantum nodes or dense arrays),
+   libquantum hash tables, qid bookkeeping (tangles and qid lists) and the
+   parsed program, sampled after every command and right after every
+   kronecker, when the old and the new register are both alive.  At exit a
+   breakdown is printed with the peak of each category, the split at the
+   overall peak, the command index it occurred at and the peak of each
+   phase (parse, eval, output). */
+
+typedef enum memstats_phase {
+  MEMSTATS_PARSE,
+  MEMSTATS_EVAL,
+  MEMSTATS_OUTPUT,
+  MEMSTATS_PHASES
+} memstats_phase_t;
+
+extern bool _memstats_enabled_;
+
+void memstats_init();
+void memstats_phase( memstats_phase_t phase );
+void memstats_program( const sexp_t* program );
+// samples the live state of qmem after a command
+void memstats_sample( const qmem_t* restrict qmem );
+// a register allocated on top of the last sample
+void memstats_transient( const quantum_reg* restrict reg );
+// a dense array of that width allocated on top of the last sample
+void memstats_transient_dense( int width );
+void memstats_print();
+
+#endif
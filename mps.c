@@ -0,0 +1,885 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+#include <assert.h>
+
+#include <sexp.h>
+#include <sexp_ops.h>
+
+#include "qvm.h"
+#include "mps.h"
+#include "outcomes.h"
+
+typedef double complex cplx_t;
+
+static const double _sqrt_half_ = 0.70710678118654752440;
+
+bool _mps_enabled_ = false;
+bool _mps_auto_ = false;
+
+static int _max_bond_ = MPS_DEFAULT_BOND;
+static double _cutoff_ = MPS_DEFAULT_CUTOFF;
+
+typedef struct site {
+  qid_t qid;
+  int left, right;  // bond dimensions
+  cplx_t* a;        // a[(l*2 + s)*right + r]
+} site_t;
+
+typedef struct mps {
+  site_t* sites;
+  int size, capacity;
+  int center;             // orthogonality center, -1 when empty
+  int* position;          // site of every qid, -1 if not in the chain
+  int peak_bond;
+  int peak_size;
+  unsigned long svds;
+  double kept;            // weight left by the truncations
+} mps_t;
+
+// the chain of the last mps_run, for mps_print
+static mps_t _last_;
+static bool _ran_ = false;
+
+static void* mps_alloc( size_t bytes ) {
+  void* p = malloc( bytes ? bytes : 1 );
+  if( p == NULL ) {
+    printf("ERROR: out of memory in the MPS backend\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+void mps_configure( const char* spec ) {
+  char* end;
+
+  _mps_enabled_ = true;
+  if( spec == NULL )
+    return;
+  if( strncmp( spec, "auto", 4 ) == 0 ) {
+    _mps_auto_ = true;
+    spec += 4;
+    if( *spec == 0 )
+      return;
+    if( *spec++ != ',' ) {
+      printf("ERROR: --mps expects bond[,cutoff] or auto[,bond]\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  _max_bond_ = strtol( spec, &end, 10 );
+  if( end == spec || _max_bond_ < 1 || (*end && *end != ',') ||
+      (*end && _mps_auto_) ) {
+    printf("ERROR: --mps expects bond[,cutoff] or auto[,bond], got '%s'\n",
+	   spec);
+    exit(EXIT_FAILURE);
+  }
+  if( *end ) {
+    const char* cutoff = end + 1;
+    _cutoff_ = strtod( cutoff, &end );
+    if( end == cutoff || *end || !(_cutoff_ >= 0) ) {
+      printf("ERROR: --mps expects a cutoff >= 0, got '%s'\n", cutoff);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/* one-sided Jacobi SVD of the row-major m x n matrix a = u diag(s) vh,
+   u is m x r and vh r x n for r = min(m,n), s comes out descending */
+static int svd( int m, int n, const cplx_t* a, cplx_t* u, double* s,
+		cplx_t* vh ) {
+  // the columns of w are orthogonalized, the shorter side is n
+  const bool transpose = n > m;
+  const int rows = transpose ? n : m;
+  const int cols = transpose ? m : n;
+  cplx_t* w = mps_alloc( rows * cols * sizeof(cplx_t) );
+  cplx_t* v = mps_alloc( cols * cols * sizeof(cplx_t) );
+  double* norm = mps_alloc( cols * sizeof(double) );
+  int* order = mps_alloc( cols * sizeof(int) );
+
+  for( int i=0; i<rows; ++i )
+    for( int j=0; j<cols; ++j )
+      w[j*rows + i] = transpose ? conj( a[j*n + i] ) : a[i*n + j];
+  for( int i=0; i<cols*cols; ++i )
+    v[i] = 0;
+  for( int j=0; j<cols; ++j )
+    v[j*cols + j] = 1;
+
+  for( int sweep=0; sweep<64; ++sweep ) {
+    bool rotated = false;
+    for( int p=0; p<cols; ++p )
+      for( int q=p+1; q<cols; ++q ) {
+	cplx_t* wp = w + p*rows;
+	cplx_t* wq = w + q*rows;
+	double alpha = 0, beta = 0;
+	cplx_t gamma = 0;
+	for( int i=0; i<rows; ++i ) {
+	  alpha += creal( wp[i] ) * creal( wp[i] ) +
+	    cimag( wp[i] ) * cimag( wp[i] );
+	  beta += creal( wq[i] ) * creal( wq[i] ) +
+	    cimag( wq[i] ) * cimag( wq[i] );
+	  gamma += conj( wp[i] ) * wq[i];
+	}
+	const double g = cabs( gamma );
+	if( g == 0 || g <= 1e-15 * sqrt( alpha * beta ) )
+	  continue;
+	rotated = true;
+	// a phase makes the inner product real, then a plain rotation
+	const cplx_t phase = conj( gamma ) / g;
+	const double zeta = (beta - alpha) / (2 * g);
+	const double t = (zeta >= 0 ? 1.0 : -1.0) /
+	  (fabs( zeta ) + sqrt( 1 + zeta * zeta ));
+	const double c = 1 / sqrt( 1 + t * t );
+	const double sn = c * t;
+	for( int i=0; i<rows; ++i ) {
+	  const cplx_t x = wp[i], y = wq[i] * phase;
+	  wp[i] = c * x - sn * y;
+	  wq[i] = sn * x + c * y;
+	}
+	cplx_t* vp = v + p*cols;
+	cplx_t* vq = v + q*cols;
+	for( int i=0; i<cols; ++i ) {
+	  const cplx_t x = vp[i], y = vq[i] * phase;
+	  vp[i] = c * x - sn * y;
+	  vq[i] = sn * x + c * y;
+	}
+      }
+    if( !rotated )
+      break;
+  }
+
+  for( int j=0; j<cols; ++j ) {
+    double sum = 0;
+    for( int i=0; i<rows; ++i )
+      sum += creal( w[j*rows + i] ) * creal( w[j*rows + i] ) +
+	cimag( w[j*rows + i] ) * cimag( w[j*rows + i] );
+    norm[j] = sqrt( sum );
+    order[j] = j;
+  }
+  // few columns, insertion sort
+  for( int j=1; j<cols; ++j )
+    for( int k=j; k>0 && norm[order[k]] > norm[order[k-1]]; --k ) {
+      const int swap = order[k];
+      order[k] = order[k-1];
+      order[k-1] = swap;
+    }
+
+  // a = w v^H, for the transpose a^H = w v^H
+  const int r = cols;
+  for( int k=0; k<r; ++k ) {
+    const int j = order[k];
+    const double inverse = norm[j] > 0 ? 1 / norm[j] : 0;
+    s[k] = norm[j];
+    if( transpose ) {
+      for( int i=0; i<m; ++i )
+	u[i*r + k] = v[j*cols + i];
+      for( int i=0; i<n; ++i )
+	vh[k*n + i] = conj( w[j*rows + i] ) * inverse;
+    }
+    else {
+      for( int i=0; i<m; ++i )
+	u[i*r + k] = w[j*rows + i] * inverse;
+      for( int i=0; i<n; ++i )
+	vh[k*n + i] = conj( v[j*cols + i] );
+    }
+  }
+  free( w );
+  free( v );
+  free( norm );
+  free( order );
+  return r;
+}
+
+/* singular values kept out of r, drops the rest from the weight */
+static int truncate_spectrum( mps_t* mps, double* s, int r, int bond ) {
+  double total = 0, kept = 0;
+  int k = 0;
+
+  for( int j=0; j<r; ++j )
+    total += s[j] * s[j];
+  while( k < r && k < bond && s[k] > _cutoff_ * s[0] ) {
+    kept += s[k] * s[k];
+    ++k;
+  }
+  if( k == 0 )
+    k = 1;  // keep the state, even if it is all noise
+  if( kept > 0 && kept < total ) {
+    mps->kept *= kept / total;
+    // the norm of the state stays where it was
+    const double scale = sqrt( total / kept );
+    for( int j=0; j<k; ++j )
+      s[j] *= scale;
+  }
+  ++mps->svds;
+  return k;
+}
+
+static void track_bond( mps_t* mps, int bond ) {
+  if( bond > mps->peak_bond )
+    mps->peak_bond = bond;
+}
+
+/* moves the orthogonality center by one site to the right */
+static void shift_center_right( mps_t* mps ) {
+  site_t* here = &mps->sites[mps->center];
+  site_t* next = &mps->sites[mps->center + 1];
+  const int m = here->left * 2, n = here->right, r = m < n ? m : n;
+  cplx_t* u = mps_alloc( m * r * sizeof(cplx_t) );
+  cplx_t* vh = mps_alloc( r * n * sizeof(cplx_t) );
+  double* s = mps_alloc( r * sizeof(double) );
+
+  svd( m, n, here->a, u, s, vh );
+  const int k = truncate_spectrum( mps, s, r, r );
+  cplx_t* a = mps_alloc( m * k * sizeof(cplx_t) );
+  for( int i=0; i<m; ++i )
+    for( int j=0; j<k; ++j )
+      a[i*k + j] = u[i*r + j];
+  const int width = 2 * next->right;
+  cplx_t* b = mps_alloc( k * width * sizeof(cplx_t) );
+  for( int i=0; i<k; ++i )
+    for( int j=0; j<width; ++j ) {
+      cplx_t sum = 0;
+      for( int l=0; l<n; ++l )
+	sum += vh[i*n + l] * next->a[l*width + j];
+      b[i*width + j] = s[i] * sum;
+    }
+  free( here->a );
+  free( next->a );
+  here->a = a;
+  here->right = k;
+  next->a = b;
+  next->left = k;
+  ++mps->center;
+  free( u );
+  free( vh );
+  free( s );
+}
+
+/* moves the orthogonality center by one site to the left */
+static void shift_center_left( mps_t* mps ) {
+  site_t* here = &mps->sites[mps->center];
+  site_t* prev = &mps->sites[mps->center - 1];
+  const int m = here->left, n = 2 * here->right, r = m < n ? m : n;
+  cplx_t* u = mps_alloc( m * r * sizeof(cplx_t) );
+  cplx_t* vh = mps_alloc( r * n * sizeof(cplx_t) );
+  double* s = mps_alloc( r * sizeof(double) );
+
+  svd( m, n, here->a, u, s, vh );
+  const int k = truncate_spectrum( mps, s, r, r );
+  cplx_t* a = mps_alloc( k * n * sizeof(cplx_t) );
+  memcpy( a, vh, k * n * sizeof(cplx_t) );
+  const int height = prev->left * 2;
+  cplx_t* b = mps_alloc( height * k * sizeof(cplx_t) );
+  for( int i=0; i<height; ++i )
+    for( int j=0; j<k; ++j ) {
+      cplx_t sum = 0;
+      for( int l=0; l<m; ++l )
+	sum += prev->a[i*m + l] * u[l*r + j];
+      b[i*k + j] = sum * s[j];
+    }
+  free( here->a );
+  free( prev->a );
+  here->a = a;
+  here->left = k;
+  prev->a = b;
+  prev->right = k;
+  --mps->center;
+  free( u );
+  free( vh );
+  free( s );
+}
+
+static void move_center( mps_t* mps, int target ) {
+  while( mps->center < target )
+    shift_center_right( mps );
+  while( mps->center > target )
+    shift_center_left( mps );
+}
+
+typedef enum { GATE_CZ, GATE_SWAP } gate_t;
+
+/* applies gate to the sites i and i+1, the center ends on i if left */
+static void apply_two_site( mps_t* mps, int i, gate_t gate, bool left ) {
+  if( mps->center != i && mps->center != i+1 )
+    move_center( mps, i );
+  site_t* a = &mps->sites[i];
+  site_t* b = &mps->sites[i+1];
+  const int l = a->left, d = a->right, r = b->right;
+  const int m = 2 * l, n = 2 * r, rank = m < n ? m : n;
+  cplx_t* theta = mps_alloc( m * n * sizeof(cplx_t) );
+
+  // theta[(x,s1),(s2,y)] after the gate
+  for( int x=0; x<l; ++x )
+    for( int s1=0; s1<2; ++s1 )
+      for( int s2=0; s2<2; ++s2 )
+	for( int y=0; y<r; ++y ) {
+	  const int t1 = gate == GATE_SWAP ? s2 : s1;
+	  const int t2 = gate == GATE_SWAP ? s1 : s2;
+	  cplx_t sum = 0;
+	  for( int k=0; k<d; ++k )
+	    sum += a->a[(x*2 + t1)*d + k] * b->a[(k*2 + t2)*r + y];
+	  if( gate == GATE_CZ && s1 && s2 )
+	    sum = -sum;
+	  theta[(x*2 + s1)*n + s2*r + y] = sum;
+	}
+  if( gate == GATE_SWAP ) {
+    const qid_t qid = a->qid;
+    a->qid = b->qid;
+    b->qid = qid;
+    mps->position[a->qid] = i;
+    mps->position[b->qid] = i+1;
+  }
+
+  cplx_t* u = mps_alloc( m * rank * sizeof(cplx_t) );
+  cplx_t* vh = mps_alloc( rank * n * sizeof(cplx_t) );
+  double* s = mps_alloc( rank * sizeof(double) );
+  svd( m, n, theta, u, s, vh );
+  const int k = truncate_spectrum( mps, s, rank, _max_bond_ );
+  free( a->a );
+  free( b->a );
+  a->a = mps_alloc( m * k * sizeof(cplx_t) );
+  b->a = mps_alloc( k * n * sizeof(cplx_t) );
+  for( int x=0; x<m; ++x )
+    for( int j=0; j<k; ++j )
+      a->a[x*k + j] = u[x*rank + j] * (left ? s[j] : 1);
+  for( int j=0; j<k; ++j )
+    for( int y=0; y<n; ++y )
+      b->a[j*n + y] = vh[j*n + y] * (left ? 1 : s[j]);
+  a->right = k;
+  b->left = k;
+  mps->center = left ? i : i+1;
+  track_bond( mps, k );
+  free( theta );
+  free( u );
+  free( vh );
+  free( s );
+}
+
+/* a |+> site for qid at index i, its bonds are the bond it sits on */
+static void insert_site( mps_t* mps, int i, qid_t qid ) {
+  if( mps->size == mps->capacity ) {
+    mps->capacity = mps->capacity ? 2 * mps->capacity : 64;
+    mps->sites = realloc( mps->sites, mps->capacity * sizeof(site_t) );
+    if( mps->sites == NULL ) {
+      printf("ERROR: out of memory in the MPS backend\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  const int bond = i > 0 ? mps->sites[i-1].right : 1;
+  memmove( &mps->sites[i+1], &mps->sites[i],
+	   (mps->size - i) * sizeof(site_t) );
+  site_t* site = &mps->sites[i];
+  site->qid = qid;
+  site->left = site->right = bond;
+  site->a = mps_alloc( bond * 2 * bond * sizeof(cplx_t) );
+  for( int x=0; x<bond; ++x )
+    for( int s=0; s<2; ++s )
+      for( int y=0; y<bond; ++y )
+	site->a[(x*2 + s)*bond + y] = x == y ? _sqrt_half_ : 0;
+  ++mps->size;
+  if( mps->size > mps->peak_size )
+    mps->peak_size = mps->size;
+  for( int j=i; j<mps->size; ++j )
+    mps->position[mps->sites[j].qid] = j;
+  // the new site is an isometry both ways, the canonical form holds
+  if( mps->center < 0 )
+    mps->center = i;
+  else if( mps->center >= i )
+    ++mps->center;
+}
+
+/* the site of qid, a new |+> site (after after, or last) if there is none */
+static int site_of( mps_t* mps, qid_t qid, int after ) {
+  if( qid < 0 || qid >= (int)MAX_QUBITS ) {
+    printf("ERROR: qid %d out of range\n", qid);
+    exit(EXIT_FAILURE);
+  }
+  if( mps->position[qid] < 0 )
+    insert_site( mps, after < 0 ? mps->size : after + 1, qid );
+  return mps->position[qid];
+}
+
+static void mps_E( mps_t* mps, qid_t qid1, qid_t qid2 ) {
+  int i = site_of( mps, qid1, mps->position[qid2] );
+  int j = site_of( mps, qid2, i );
+  if( i > j ) {
+    const int swap = i;
+    i = j;
+    j = swap;
+  }
+  // bring the right one next to the left one and take it back after the
+  // CZ, moving sites for good would scramble the order of the chain
+  const int back = j;
+  if( j > i+1 && mps->center != j && mps->center != j-1 )
+    move_center( mps, j-1 );
+  for( ; j > i+1; --j )
+    apply_two_site( mps, j-1, GATE_SWAP, true );
+  apply_two_site( mps, i, GATE_CZ, false );
+  for( ; j < back; ++j )
+    apply_two_site( mps, j, GATE_SWAP, false );
+}
+
+static void mps_pauli( mps_t* mps, qid_t qid, char op ) {
+  const int i = site_of( mps, qid, -1 );
+  const site_t* site = &mps->sites[i];
+  for( int x=0; x<site->left; ++x )
+    for( int y=0; y<site->right; ++y ) {
+      cplx_t* zero = &site->a[(x*2)*site->right + y];
+      cplx_t* one = &site->a[(x*2 + 1)*site->right + y];
+      if( op == 'X' ) {
+	const cplx_t swap = *zero;
+	*zero = *one;
+	*one = swap;
+      }
+      else
+	*one = -*one;
+    }
+}
+
+/* measures qid in the basis (|0> +- e^{i angle}|1>)/sqrt(2), as the normal
+   evaluator does, and folds the projected site into a neighbour */
+static int mps_M( mps_t* mps, qid_t qid, double angle, qmem_t* qmem ) {
+  const int i = site_of( mps, qid, -1 );
+  move_center( mps, i );
+  site_t* site = &mps->sites[i];
+  const int l = site->left, r = site->right;
+  const cplx_t kick = cexp( -I * angle );
+  cplx_t* projected[2];
+  double prob[2] = { 0, 0 };
+
+  for( int signal=0; signal<2; ++signal ) {
+    projected[signal] = mps_alloc( l * r * sizeof(cplx_t) );
+    for( int x=0; x<l; ++x )
+      for( int y=0; y<r; ++y ) {
+	const cplx_t p = (site->a[(x*2)*r + y] + (signal ? -kick : kick) *
+			  site->a[(x*2 + 1)*r + y]) * _sqrt_half_;
+	projected[signal][x*r + y] = p;
+	prob[signal] += creal( p ) * creal( p ) + cimag( p ) * cimag( p );
+      }
+  }
+  const double norm = prob[0] + prob[1];
+  const int signal = outcomes_next( qmem, qid, norm > 0 ? prob[0] / norm : 1 );
+  cplx_t* m = projected[signal];
+  const double scale = prob[signal] > 0 ? 1 / sqrt( prob[signal] ) : 0;
+  free( projected[!signal] );
+
+  // fold m into the left neighbour, or the right one for the first site
+  if( i > 0 ) {
+    site_t* prev = &mps->sites[i-1];
+    const int height = prev->left * 2;
+    cplx_t* a = mps_alloc( height * r * sizeof(cplx_t) );
+    for( int x=0; x<height; ++x )
+      for( int y=0; y<r; ++y ) {
+	cplx_t sum = 0;
+	for( int k=0; k<l; ++k )
+	  sum += prev->a[x*l + k] * m[k*r + y];
+	a[x*r + y] = sum * scale;
+      }
+    free( prev->a );
+    prev->a = a;
+    prev->right = r;
+    mps->center = i-1;
+  }
+  else if( i+1 < mps->size ) {
+    site_t* next = &mps->sites[i+1];
+    const int width = 2 * next->right;
+    cplx_t* a = mps_alloc( l * width * sizeof(cplx_t) );
+    for( int x=0; x<l; ++x )
+      for( int y=0; y<width; ++y ) {
+	cplx_t sum = 0;
+	for( int k=0; k<r; ++k )
+	  sum += m[x*r + k] * next->a[k*width + y];
+	a[x*width + y] = sum * scale;
+      }
+    free( next->a );
+    next->a = a;
+    next->left = l;
+    mps->center = i;
+  }
+  else
+    mps->center = -1;
+  free( m );
+  free( site->a );
+  memmove( &mps->sites[i], &mps->sites[i+1],
+	   (mps->size - i - 1) * sizeof(site_t) );
+  --mps->size;
+  mps->position[qid] = -1;
+  for( int j=i; j<mps->size; ++j )
+    mps->position[mps->sites[j].qid] = j;
+
+  set_signal( qid, signal, &qmem->signal_map );
+  outcomes_log( signal );
+  return signal;
+}
+
+/* the sites first..last contracted into 2^(last-first+1) amplitudes, the
+   first site most significant */
+static cplx_t* contract( const mps_t* mps, int first, int last ) {
+  size_t states = 1;
+  int bond = 1;
+  cplx_t* vector = mps_alloc( sizeof(cplx_t) );
+  vector[0] = 1;
+  for( int i=first; i<=last; ++i ) {
+    const site_t* site = &mps->sites[i];
+    cplx_t* next = mps_alloc( states * 2 * site->right * sizeof(cplx_t) );
+    for( size_t state=0; state<states; ++state )
+      for( int s=0; s<2; ++s )
+	for( int y=0; y<site->right; ++y ) {
+	  cplx_t sum = 0;
+	  for( int k=0; k<bond; ++k )
+	    sum += vector[state*bond + k] * site->a[(k*2 + s)*site->right + y];
+	  next[(state*2 + s)*site->right + y] = sum;
+	}
+    free( vector );
+    vector = next;
+    states *= 2;
+    bond = site->right;
+  }
+  return vector;
+}
+
+/* the pieces firsts[k]..lasts[k] of the chain as one tangle of qmem, the
+   product of their states with the first piece most significant */
+static void write_tangle( const mps_t* mps, const int* firsts,
+			  const int* lasts, int count, qmem_t* restrict qmem ) {
+  int width = 0;
+  for( int k=0; k<count; ++k )
+    width += lasts[k] - firsts[k] + 1;
+  if( width > MPS_OUTPUT_WIDTH ) {
+    printf("ERROR: the MPS holds %d entangled qubits, more than the %d "
+	   "that can be written out\n", width, MPS_OUTPUT_WIDTH);
+    exit(EXIT_FAILURE);
+  }
+  size_t states = 1;
+  cplx_t* vector = mps_alloc( sizeof(cplx_t) );
+  vector[0] = 1;
+  for( int k=0; k<count; ++k ) {
+    const size_t piece_states = (size_t)1 << (lasts[k] - firsts[k] + 1);
+    cplx_t* piece = contract( mps, firsts[k], lasts[k] );
+    cplx_t* next = mps_alloc( states * piece_states * sizeof(cplx_t) );
+    for( size_t i=0; i<states; ++i )
+      for( size_t j=0; j<piece_states; ++j )
+	next[i*piece_states + j] = vector[i] * piece[j];
+    free( piece );
+    free( vector );
+    vector = next;
+    states *= piece_states;
+  }
+  double norm = 0;
+  for( size_t i=0; i<states; ++i )
+    norm += creal( vector[i] ) * creal( vector[i] ) +
+      cimag( vector[i] ) * cimag( vector[i] );
+  norm = norm > 0 ? 1 / sqrt( norm ) : 0;
+  COMPLEX_FLOAT* amplitudes = mps_alloc( states * sizeof(COMPLEX_FLOAT) );
+  qid_t* qids = mps_alloc( width * sizeof(qid_t) );
+  for( size_t i=0; i<states; ++i ) {
+    const cplx_t amplitude = vector[i] * norm;
+    // the same dust the sparse backend never creates
+    amplitudes[i] = cabs( amplitude ) < 1e-7 ? 0 :
+      (float)creal( amplitude ) + (float)cimag( amplitude ) * IMAGINARY;
+  }
+  for( int k=0, n=0; k<count; ++k )
+    for( int i=firsts[k]; i<=lasts[k]; ++i )
+      qids[n++] = mps->sites[i].qid;
+  add_amplitudes_tangle( qids, width, amplitudes, qmem );
+  free( vector );
+  free( amplitudes );
+  free( qids );
+}
+
+// union-find over qids, the tangles the normal evaluator would have
+static int root_of( int* parent, int qid ) {
+  while( parent[qid] != qid )
+    qid = parent[qid] = parent[parent[qid]];
+  return qid;
+}
+
+static void join( int* parent, int a, int b ) {
+  a = root_of( parent, a );
+  b = root_of( parent, b );
+  if( a != b )
+    parent[b] = a;
+}
+
+/* the chain split where the bond is 1, the pieces of one tangle of the
+   normal evaluator are written out together so the output has the same
+   tangles */
+static void write_chain( const mps_t* mps, int* parent,
+			 qmem_t* restrict qmem ) {
+  int* firsts = mps_alloc( mps->size * sizeof(int) );
+  int* lasts = mps_alloc( mps->size * sizeof(int) );
+  int* group_firsts = mps_alloc( mps->size * sizeof(int) );
+  int* group_lasts = mps_alloc( mps->size * sizeof(int) );
+  bool* written = mps_alloc( mps->size * sizeof(bool) );
+  int pieces = 0;
+  for( int first=0, i=0; i<mps->size; ++i )
+    if( i+1 == mps->size || mps->sites[i].right == 1 ) {
+      // a piece is entangled within, whatever the E commands were
+      for( int j=first+1; j<=i; ++j )
+	join( parent, mps->sites[first].qid, mps->sites[j].qid );
+      firsts[pieces] = first;
+      lasts[pieces] = i;
+      written[pieces++] = false;
+      first = i+1;
+    }
+  for( int k=0; k<pieces; ++k ) {
+    if( written[k] )
+      continue;
+    const int root = root_of( parent, mps->sites[firsts[k]].qid );
+    int count = 0;
+    for( int l=k; l<pieces; ++l )
+      if( !written[l] && root_of( parent, mps->sites[firsts[l]].qid ) == root ) {
+	group_firsts[count] = firsts[l];
+	group_lasts[count++] = lasts[l];
+	written[l] = true;
+      }
+    write_tangle( mps, group_firsts, group_lasts, count, qmem );
+  }
+  free( firsts );
+  free( lasts );
+  free( group_firsts );
+  free( group_lasts );
+  free( written );
+}
+
+void mps_run( sexp_t* program, qmem_t* restrict qmem ) {
+  mps_t mps = { NULL, 0, 0, -1, NULL, 1, 0, 0, 1 };
+  qid_t qid, qid2;
+
+  mps.position = mps_alloc( MAX_QUBITS * sizeof(int) );
+  int* parent = mps_alloc( MAX_QUBITS * sizeof(int) );
+  for( size_t q=0; q<MAX_QUBITS; ++q ) {
+    mps.position[q] = -1;
+    parent[q] = q;
+  }
+  if( qmem->size ) {
+    printf("ERROR: --mps starts from |+> qubits and can't take an input "
+	   "state\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for( sexp_t* exp = program; exp; exp = exp->next ) {
+    sexp_t* command = exp->ty == SEXP_LIST ? exp->list : exp;
+    switch( get_opname( command ) ) {
+    case 'E':
+      if( !command->next || !command->next->next ) {
+	printf("Entangle did not have two qubit arguments\n");
+	exit(EXIT_FAILURE);
+      }
+      qid = get_qid( command->next );
+      qid2 = get_qid( command->next->next );
+      site_of( &mps, qid, -1 );
+      mps_E( &mps, qid, qid2 );
+      join( parent, qid, qid2 );
+      break;
+    case 'M': {
+      double angle;
+      qid = parse_measurement_angle( command, qmem, &angle );
+      mps_M( &mps, qid, angle, qmem );
+      break;
+    }
+    case 'X':
+    case 'Z':
+      if( parse_correction( command, qmem, &qid ) )
+	mps_pauli( &mps, qid, get_opname( command ) );
+      break;
+    default:
+      printf("unknown command: %c\n", get_opname( command ));
+      exp = NULL;
+      break;
+    }
+    if( exp == NULL || exp->ty != SEXP_LIST )
+      break;
+    qmem->pc += 1;
+  }
+
+  // a sweep both ways drops the bonds measurements left without weight
+  if( mps.size ) {
+    move_center( &mps, 0 );
+    move_center( &mps, mps.size - 1 );
+  }
+  write_chain( &mps, parent, qmem );
+  _last_ = mps;
+  _ran_ = true;
+  for( int i=0; i<mps.size; ++i )
+    free( mps.sites[i].a );
+  free( mps.sites );
+  free( mps.position );
+  free( parent );
+}
+
+void mps_print() {
+  if( !_ran_ )
+    return;
+  printf("mps: %d qubits at most, bond %d at most (limit %d), %lu SVDs, "
+	 "discarded weight %g\n", _last_.peak_size, _last_.peak_bond,
+	 _max_bond_, _last_.svds, 1 - _last_.kept);
+}
+
+/* --- prediction, the chain without amplitudes --- */
+
+typedef struct shadow {
+  qid_t* qids;
+  int* bits;      // bits[i]: bond between site i and i+1
+  int size;
+  int* position;
+  // tangles of the normal evaluator, union-find over qids
+  int* parent;
+  int* width;
+} shadow_t;
+
+static int shadow_root( shadow_t* sh, int qid ) {
+  return root_of( sh->parent, qid );
+}
+
+static int min3( int a, int b, int c ) {
+  const int m = a < b ? a : b;
+  return m < c ? m : c;
+}
+
+static void shadow_reindex( shadow_t* sh, int from ) {
+  for( int j=from; j<sh->size; ++j )
+    sh->position[sh->qids[j]] = j;
+}
+
+static int shadow_site( shadow_t* sh, qid_t qid, int after, int* peak ) {
+  if( sh->position[qid] >= 0 )
+    return sh->position[qid];
+  const int i = after < 0 ? sh->size : after + 1;
+  memmove( &sh->qids[i+1], &sh->qids[i], (sh->size - i) * sizeof(qid_t) );
+  memmove( &sh->bits[i+1], &sh->bits[i], (sh->size - i) * sizeof(int) );
+  sh->qids[i] = qid;
+  sh->bits[i] = i > 0 ? sh->bits[i-1] : 0;
+  ++sh->size;
+  if( i+1 == sh->size )
+    sh->bits[i] = 0;
+  shadow_reindex( sh, i );
+  sh->parent[qid] = qid;
+  sh->width[qid] = 1;
+  if( 1 > *peak )
+    *peak = 1;
+  return i;
+}
+
+/* CZ on the sites i and j > i adds at most a bit to the bonds in between,
+   the swaps there and back included, and at most a bit to the neighbouring
+   bonds when adjacent */
+static void shadow_cz( shadow_t* sh, int i, int j, int* peak ) {
+  for( int c=i; c<j; ++c ) {
+    int bits = sh->bits[c] + 1;
+    if( j == i+1 )
+      bits = min3( bits, (i > 0 ? sh->bits[i-1] : 0) + 1, sh->bits[j] + 1 );
+    sh->bits[c] = min3( bits, c+1, sh->size - c - 1 );
+    if( sh->bits[c] > *peak )
+      *peak = sh->bits[c];
+  }
+}
+
+void mps_predict( const sexp_t* program, int* bond_bits, int* width,
+		  int* output ) {
+  shadow_t sh;
+  sh.qids = mps_alloc( MAX_QUBITS * sizeof(qid_t) );
+  sh.bits = mps_alloc( (MAX_QUBITS + 1) * sizeof(int) );
+  sh.position = mps_alloc( MAX_QUBITS * sizeof(int) );
+  sh.parent = mps_alloc( MAX_QUBITS * sizeof(int) );
+  sh.width = mps_alloc( MAX_QUBITS * sizeof(int) );
+  sh.size = 0;
+  for( size_t q=0; q<MAX_QUBITS; ++q )
+    sh.position[q] = -1;
+  *bond_bits = 0;
+  *width = 0;
+
+  for( const sexp_t* exp = program; exp; exp = exp->next ) {
+    if( exp->ty != SEXP_LIST || exp->list == NULL ||
+	exp->list->ty != SEXP_VALUE || exp->list->next == NULL ||
+	exp->list->next->ty != SEXP_VALUE )
+      break;
+    sexp_t* command = exp->list;
+    const qid_t qid = get_qid( command->next );
+    if( qid < 0 || qid >= (int)MAX_QUBITS )
+      break;
+    switch( get_opname( command ) ) {
+    case 'E': {
+      if( command->next->next == NULL ||
+	  command->next->next->ty != SEXP_VALUE )
+	break;
+      const qid_t qid2 = get_qid( command->next->next );
+      if( qid2 < 0 || qid2 >= (int)MAX_QUBITS || qid2 == qid )
+	break;
+      int i = shadow_site( &sh, qid, sh.position[qid2], width );
+      int j = shadow_site( &sh, qid2, i, width );
+      if( i > j ) {
+	const int swap = i;
+	i = j;
+	j = swap;
+      }
+      shadow_cz( &sh, i, j, bond_bits );
+      // tangles merge in the normal evaluator
+      const int a = shadow_root( &sh, qid ), b = shadow_root( &sh, qid2 );
+      if( a != b ) {
+	sh.parent[b] = a;
+	sh.width[a] += sh.width[b];
+	if( sh.width[a] > *width )
+	  *width = sh.width[a];
+      }
+      break;
+    }
+    case 'M': {
+      const int i = shadow_site( &sh, qid, -1, width );
+      // the new bond is no wider than either neighbour
+      if( i > 0 && sh.bits[i] < sh.bits[i-1] )
+	sh.bits[i-1] = sh.bits[i];
+      memmove( &sh.qids[i], &sh.qids[i+1],
+	       (sh.size - i - 1) * sizeof(qid_t) );
+      memmove( &sh.bits[i], &sh.bits[i+1], (sh.size - i - 1) * sizeof(int) );
+      --sh.size;
+      sh.position[qid] = -1;
+      shadow_reindex( &sh, i );
+      sh.width[shadow_root( &sh, qid )] -= 1;
+      break;
+    }
+    default:
+      shadow_site( &sh, qid, -1, width );
+      break;
+    }
+  }
+  // run_mps writes out the qubits left in every tangle together
+  *output = 0;
+  for( int i=0; i<sh.size; ++i )
+    if( sh.width[shadow_root( &sh, sh.qids[i] )] > *output )
+      *output = sh.width[shadow_root( &sh, sh.qids[i] )];
+  free( sh.qids );
+  free( sh.bits );
+  free( sh.position );
+  free( sh.parent );
+  free( sh.width );
+}
+
+bool mps_wanted( const sexp_t* program, const qmem_t* restrict qmem,
+		 bool silent ) {
+  int bits, width, output;
+
+  if( !_mps_enabled_ )
+    return false;
+  if( qmem->size ) {
+    if( !_mps_auto_ ) {
+      printf("ERROR: --mps starts from |+> qubits and can't take an input "
+	     "state\n");
+      exit(EXIT_FAILURE);
+    }
+    if( !silent )
+      printf("mps: an input state is loaded, using tangles\n");
+    return false;
+  }
+  if( !_mps_auto_ )
+    return true;
+  mps_predict( program, &bits, &width, &output );
+  const bool wanted = width > MPS_AUTO_WIDTH && output <= MPS_OUTPUT_WIDTH &&
+    bits < 30 && (1 << bits) <= _max_bond_;
+  if( !silent )
+    printf("mps: predicted bond 2^%d, tangles of up to %d qubits, output of "
+	   "%d qubits, %s\n", bits, width, output,
+	   wanted ? "using the MPS" : "using tangles");
+  return wanted;
+}
@@ -0,0 +1,46 @@
+#ifndef MPS_H
+#define MPS_H
+
+#include "qvm.h"
+
+/* Matrix product state backend (--mps[=bond[,cutoff]], --mps=auto[,bond]).
+   The whole quantum memory is one chain of sites, one per qubit, with a
+   tensor of left bond x 2 x right bond amplitudes each.  A new qubit is
+   inserted next to its E partner, E on sites further apart first swaps
+   one of them along the chain.  Every two-site update is split again by
+   an SVD that keeps at most bond singular values above cutoff times the
+   largest one, the discarded weight is summed up and printed at the end.
+   Measurements project the site in the orthogonality center and fold it
+   into a neighbour, corrections are applied to their site directly.
+   At the end the chain is split where the bond is 1, and the pieces
+   whose qubits share a tangle of the normal evaluator (by their E
+   commands) are written out together as one tangle of qmem, so the
+   output holds the same tangles.
+   With auto the pattern is run on the MPS only if mps_predict() bounds
+   its bond below bond while the tangles would get wider than
+   MPS_AUTO_WIDTH qubits, and the output fits MPS_OUTPUT_WIDTH.  The
+   chain always starts empty, so there is no input state (-f, --resume). */
+
+#define MPS_DEFAULT_BOND 64
+#define MPS_DEFAULT_CUTOFF 1e-12
+#define MPS_AUTO_WIDTH 20
+#define MPS_OUTPUT_WIDTH 24  // widest tangle written out
+
+extern bool _mps_enabled_;
+extern bool _mps_auto_;
+
+void mps_configure( const char* spec );
+/* upper bounds of the bond dimension (in bits) of the MPS run, of the
+   widest tangle of the normal evaluator and of the widest piece written
+   out, from the E and M commands only */
+void mps_predict( const sexp_t* program, int* bond_bits, int* width,
+		  int* output );
+/* decides --mps=auto, prints the prediction unless silent; never with an
+   input state in qmem, which is an error for a plain --mps */
+bool mps_wanted( const sexp_t* program, const qmem_t* restrict qmem,
+		 bool silent );
+void mps_run( sexp_t* program, qmem_t* restrict qmem );
+// statistics of the last run, nothing without one
+void mps_print();
+
+#endif
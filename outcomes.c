@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "qvm.h"
+#include "outcomes.h"
+
+#define TRACE_MAGIC "QVMTRACE"
+
+typedef enum {
+  OUTCOMES_SAMPLE,
+  OUTCOMES_POSTSELECT,
+  OUTCOMES_REPLAY
+} outcome_policy_t;
+
+static outcome_policy_t _policy_ = OUTCOMES_SAMPLE;
+static int _postselect_value_ = 0;
+
+// replayed trace
+static unsigned char* _replay_bits_ = NULL;
+static uint64_t _replay_length_ = 0;
+static uint64_t _replay_next_ = 0;
+
+// recorded trace
+static const char* _record_file_ = NULL;
+static unsigned char* _record_bits_ = NULL;
+static uint64_t _record_length_ = 0;
+static size_t _record_capacity_ = 0; // bytes
+
+void outcomes_postselect( int value ) {
+  _policy_ = OUTCOMES_POSTSELECT;
+  _postselect_value_ = value ? 1 : 0;
+}
+
+void outcomes_replay( const char* file ) {
+  char magic[8];
+  assert( file );
+  FILE* input = fopen( file, "rb" );
+  if( !input ) {
+    perror("ERROR: opening outcome trace");
+    exit(EXIT_FAILURE);
+  }
+  if( fread( magic, sizeof(magic), 1, input ) != 1 ||
+      memcmp( magic, TRACE_MAGIC, sizeof(magic) ) != 0 ||
+      fread( &_replay_length_, sizeof(_replay_length_), 1, input ) != 1 ) {
+    printf("ERROR: %s is not an outcome trace\n", file);
+    exit(EXIT_FAILURE);
+  }
+  const size_t bytes = (_replay_length_ + CHAR_BIT - 1) / CHAR_BIT;
+  _replay_bits_ = malloc( bytes ? bytes : 1 );
+  if( bytes && fread( _replay_bits_, bytes, 1, input ) != 1 ) {
+    printf("ERROR: outcome trace %s is truncated\n", file);
+    exit(EXIT_FAILURE);
+  }
+  fclose( input );
+  _replay_next_ = 0;
+  _policy_ = OUTCOMES_REPLAY;
+}
+
+void outcomes_record( const char* file ) {
+  _record_file_ = file;
+}
+
+void outcomes_skip( size_t n ) {
+  if( _policy_ == OUTCOMES_REPLAY )
+    _replay_next_ += n;
+}
+
+bool outcomes_forced() {
+  return _policy_ != OUTCOMES_SAMPLE;
+}
+
+bool outcomes_recording() {
+  return _record_file_ != NULL;
+}
+
+int outcomes_next( qmem_t* restrict qmem, qid_t qid, double prob_zero ) {
+  int signal;
+  switch( _policy_ ) {
+  case OUTCOMES_POSTSELECT:
+    signal = _postselect_value_;
+    break;
+  case OUTCOMES_REPLAY:
+    if( _replay_next_ >= _replay_length_ ) {
+      printf("ERROR: outcome trace ran out after %lu measurements\n",
+	     (unsigned long)_replay_length_);
+      exit(EXIT_FAILURE);
+    }
+    signal = BITTEST(_replay_bits_, _replay_next_) ? 1 : 0;
+    ++_replay_next_;
+    break;
+  default:
+    return qmem_uniform( qmem ) >= prob_zero;
+  }
+  if( (signal ? 1.0 - prob_zero : prob_zero) <= 0.0 ) {
+    printf("ERROR: forced outcome %d of qubit %d has probability 0\n",
+	   signal, qid);
+    exit(EXIT_FAILURE);
+  }
+  return signal;
+}
+
+void outcomes_log( int signal ) {
+  if( _record_file_ == NULL )
+    return;
+  if( _record_length_ == (uint64_t)_record_capacity_ * CHAR_BIT ) {
+    const size_t capacity = _record_capacity_ ? 2 * _record_capacity_ : 64;
+    _record_bits_ = realloc( _record_bits_, capacity );
+    memset( _record_bits_ + _record_capacity_, 0,
+	    capacity - _record_capacity_ );
+    _record_capacity_ = capacity;
+  }
+  if( signal )
+    BITSET(_record_bits_, _record_length_);
+  ++_record_length_;
+}
+
+void outcomes_finish() {
+  if( _record_file_ ) {
+    FILE* output = fopen( _record_file_, "wb" );
+    const size_t bytes = (_record_length_ + CHAR_BIT - 1) / CHAR_BIT;
+    if( !output ||
+	fwrite( TRACE_MAGIC, 8, 1, output ) != 1 ||
+	fwrite( &_record_length_, sizeof(_record_length_), 1, output ) != 1 ||
+	(bytes && fwrite( _record_bits_, bytes, 1, output ) != 1) ||
+	fclose( output ) != 0 )
+      perror("ERROR: writing outcome trace");
+  }
+  free( _record_bits_ );
+  free( _replay_bits_ );
+  _record_bits_ = _replay_bits_ = NULL;
+  _record_file_ = NULL;
+}
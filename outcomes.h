@@ -0,0 +1,32 @@
+#ifndef OUTCOMES_H
+#define OUTCOMES_H
+
+#include "qvm.h"
+
+/* Measurement outcome policy.
+   By default every measurement samples its outcome from the qmem RNG.  An
+   outcome can instead be forced, either by post-selecting on a fixed value
+   or by replaying the outcomes recorded by an earlier run, so two runs
+   (e.g. of different backends) take exactly the same path.  Forced
+   measurements only project and renormalize.  Recording writes every
+   outcome to a compact trace: an 8 byte magic, the number of outcomes as a
+   64 bit integer and the outcomes packed 8 to a byte, in measurement
+   order. */
+
+void outcomes_postselect( int value );
+void outcomes_replay( const char* file );
+// NULL stops recording
+void outcomes_record( const char* file );
+// skip the outcomes of n measurements, used when resuming a checkpoint
+void outcomes_skip( size_t n );
+bool outcomes_forced();
+bool outcomes_recording();
+
+// the signal of the next measurement, prob_zero is the probability of 0
+int outcomes_next( qmem_t* restrict qmem, qid_t qid, double prob_zero );
+// appends signal to the trace being recorded, if any
+void outcomes_log( int signal );
+// writes out the recorded trace
+void outcomes_finish();
+
+#endif
@@ -0,0 +1,188 @@
+// sync_file_range
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "qvm.h"
+#include "outofcore.h"
+#include "placement.h"
+
+const char* _ooc_dir_ = NULL;
+size_t _ooc_threshold_ = (size_t)256 << 20;
+
+typedef struct ooc_map {
+  char* base;
+  size_t bytes;
+  int fd;                  // -1 for the mappings of placement.h
+  // released last, on its way to the disk
+  size_t pending_offset;
+  size_t pending_bytes;
+  struct ooc_map* next;
+} ooc_map_t;
+
+// enumerate runs branches on several threads
+static pthread_mutex_t _ooc_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static ooc_map_t* _maps_ = NULL;
+static size_t _mapped_ = 0;
+static size_t _peak_ = 0;
+static unsigned long _files_ = 0;
+
+void ooc_configure( const char* spec ) {
+  static char dir[PATH_MAX];
+  const char* comma = strchr( spec, ',' );
+  const size_t length = comma ? (size_t)(comma - spec) : strlen( spec );
+  char* end = NULL;
+  double megabytes = 256;
+  if( comma ) {
+    megabytes = strtod( comma + 1, &end );
+    if( end == comma + 1 || *end != '\0' )
+      megabytes = -1;
+  }
+  if( length == 0 || length >= sizeof(dir) || !(megabytes >= 0) ) {
+    printf("ERROR: --out-of-core expects dir[,megabytes], got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  memcpy( dir, spec, length );
+  dir[length] = '\0';
+  _ooc_dir_ = dir;
+  _ooc_threshold_ = (size_t)(megabytes * (1 << 20));
+}
+
+static ooc_map_t* find_map( const void* p ) {
+  for( ooc_map_t* map=_maps_; map; map=map->next )
+    if( map->base == p )
+      return map;
+  return NULL;
+}
+
+static void track( char* base, size_t bytes, int fd ) {
+  ooc_map_t* map = malloc( sizeof(ooc_map_t) );
+  if( map == NULL ) {
+    printf("ERROR: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  map->base = base;
+  map->bytes = bytes;
+  map->fd = fd;
+  map->pending_offset = map->pending_bytes = 0;
+  pthread_mutex_lock( &_ooc_lock_ );
+  map->next = _maps_;
+  _maps_ = map;
+  if( fd >= 0 ) {
+    _mapped_ += bytes;
+    if( _mapped_ > _peak_ )
+      _peak_ = _mapped_;
+    ++_files_;
+  }
+  pthread_mutex_unlock( &_ooc_lock_ );
+}
+
+static void* map_file( size_t bytes ) {
+  char path[PATH_MAX];
+  if( snprintf( path, sizeof(path), "%s/qvm-amplitudes-XXXXXX", _ooc_dir_ )
+      >= (int)sizeof(path) ) {
+    printf("ERROR: out-of-core directory name too long\n");
+    exit(EXIT_FAILURE);
+  }
+  const int fd = mkstemp( path );
+  if( fd < 0 ) {
+    printf("ERROR: cannot create an out-of-core file in %s: %s\n",
+	   _ooc_dir_, strerror( errno ));
+    exit(EXIT_FAILURE);
+  }
+  unlink( path );
+  // a sparse file reads as zeros, the reservation only takes blocks
+  const int error = posix_fallocate( fd, 0, bytes );
+  if( error ) {
+    printf("ERROR: cannot reserve %zu MB for amplitudes in %s: %s\n",
+	   bytes >> 20, _ooc_dir_, strerror( error ));
+    exit(EXIT_FAILURE);
+  }
+  char* base = mmap( NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( base == MAP_FAILED ) {
+    printf("ERROR: cannot map %zu MB of amplitudes: %s\n",
+	   bytes >> 20, strerror( errno ));
+    exit(EXIT_FAILURE);
+  }
+  madvise( base, bytes, MADV_SEQUENTIAL );
+  track( base, bytes, fd );
+  return base;
+}
+
+void* ooc_alloc( size_t bytes ) {
+  if( _ooc_dir_ && bytes >= _ooc_threshold_ && bytes > 0 )
+    return map_file( bytes );
+  if( placement_wanted( bytes ) ) {
+    size_t length;
+    char* base = placement_map( bytes, &length );
+    if( base )
+      track( base, length, -1 );
+    return base;
+  }
+  return calloc( 1, bytes );
+}
+
+// arrays mapped before out-of-core was turned off are still looked up
+void ooc_free( void* p ) {
+  pthread_mutex_lock( &_ooc_lock_ );
+  ooc_map_t** link = &_maps_;
+  while( *link && (*link)->base != p )
+    link = &(*link)->next;
+  ooc_map_t* map = *link;
+  if( map ) {
+    *link = map->next;
+    if( map->fd >= 0 )
+      _mapped_ -= map->bytes;
+  }
+  pthread_mutex_unlock( &_ooc_lock_ );
+  if( map == NULL ) {
+    free( p );
+    return;
+  }
+  // nothing is written back, the file is gone with its descriptor
+  munmap( map->base, map->bytes );
+  if( map->fd >= 0 )
+    close( map->fd );
+  free( map );
+}
+
+/* Writing a block back runs behind the kernel: the block just released
+   starts, the one before it, which had the time of a whole block, is
+   waited for and then dropped from the page tables and the page cache. */
+void ooc_release( const void* p, size_t offset, size_t bytes ) {
+  if( _ooc_dir_ == NULL )
+    return;
+  // an array is only used by one thread, the lock guards the list
+  pthread_mutex_lock( &_ooc_lock_ );
+  ooc_map_t* map = find_map( p );
+  pthread_mutex_unlock( &_ooc_lock_ );
+  if( map == NULL || map->fd < 0 )
+    return;
+  sync_file_range( map->fd, offset, bytes, SYNC_FILE_RANGE_WRITE );
+  if( map->pending_bytes ) {
+    sync_file_range( map->fd, map->pending_offset, map->pending_bytes,
+		     SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+		     SYNC_FILE_RANGE_WAIT_AFTER );
+    madvise( map->base + map->pending_offset, map->pending_bytes,
+	     MADV_DONTNEED );
+    posix_fadvise( map->fd, map->pending_offset, map->pending_bytes,
+		   POSIX_FADV_DONTNEED );
+  }
+  map->pending_offset = offset;
+  map->pending_bytes = bytes;
+}
+
+void ooc_print() {
+  if( _files_ == 0 )
+    return;
+  printf("out-of-core: %lu arrays mapped in %s, %zu MB at most\n",
+	 _files_, _ooc_dir_, _peak_ >> 20);
+}
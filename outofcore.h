@@ -0,0 +1,35 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include "qvm.h"
+
+/* Out-of-core amplitudes (--out-of-core=dir[,megabytes]).
+   Dense amplitude arrays of at least megabytes (256 by default, 0 for
+   all of them) are memory mapped files in dir instead of heap memory, so
+   a tangle larger than RAM pages to the disk instead of running out of
+   memory.  The files are unlinked right after they are created and
+   reserved in full, a full disk fails there and not in the middle of a
+   kernel.
+   The dense kernels sweep their arrays in blocks of OOC_BLOCK amplitudes
+   and hand every finished block to ooc_release(), which starts writing
+   it back and drops the block released before it from memory once it is
+   on disk.  A kernel then keeps a few blocks per array in memory, and the
+   disk sees long sequential reads and writes.
+   ooc_alloc() also hands out the placed mappings of placement.h. */
+
+#define OOC_BLOCK ((MAX_UNSIGNED) 1 << 20)   // amplitudes, 8 MB
+
+extern const char* _ooc_dir_;     // NULL unless out-of-core
+extern size_t _ooc_threshold_;    // bytes
+
+void ooc_configure( const char* spec );
+
+// zeroed bytes, mapped from a file if they reach the threshold
+void* ooc_alloc( size_t bytes );
+void ooc_free( void* p );
+// done with bytes at offset of an array of ooc_alloc() for now
+void ooc_release( const void* p, size_t offset, size_t bytes );
+// arrays mapped and the most bytes mapped at once
+void ooc_print();
+
+#endif
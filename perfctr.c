@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "qvm.h"
+#include "perfctr.h"
+
+#define CACHE_LINE 64
+#define COUNTERS 3
+
+typedef struct perfctr_total {
+  unsigned long long calls;
+  unsigned long long amplitudes;
+  unsigned long long ns;
+  unsigned long long values[COUNTERS];
+} perfctr_total_t;
+
+bool _perfctr_enabled_ = false;
+
+static int _group_ = -1;        // leader fd, -1 without counters
+static int _fds_[COUNTERS];
+static perfctr_total_t _totals_[PERFCTR_KERNELS];
+
+static const char* _kernel_names_[PERFCTR_KERNELS] = {
+  "cz", "measure", "merge_tangles", "add_qubit"
+};
+
+static const unsigned long long _events_[COUNTERS] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES
+};
+
+static int open_counter( unsigned long long config, int group ) {
+  struct perf_event_attr attr;
+  memset( &attr, 0, sizeof(attr) );
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = group == -1;  // the group starts with its leader
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall( __NR_perf_event_open, &attr, 0, -1, group, 0 );
+}
+
+void perfctr_init() {
+  _perfctr_enabled_ = true;
+  memset( _totals_, 0, sizeof(_totals_) );
+  for( int i=0; i<COUNTERS; ++i ) {
+    _fds_[i] = open_counter( _events_[i], i ? _fds_[0] : -1 );
+    if( _fds_[i] < 0 ) {
+      printf("WARNING: hardware counters unavailable (%s), "
+	     "reporting time only\n", strerror(errno));
+      for( int j=0; j<i; ++j )
+	close( _fds_[j] );
+      return;
+    }
+  }
+  _group_ = _fds_[0];
+  ioctl( _group_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP );
+  ioctl( _group_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP );
+}
+
+void perfctr_read( perfctr_sample_t* sample ) {
+  struct timespec now;
+  uint64_t buffer[1 + COUNTERS];
+
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  sample->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  if( _group_ < 0 ||
+      read( _group_, buffer, sizeof(buffer) ) != sizeof(buffer) ) {
+    memset( sample->values, 0, sizeof(sample->values) );
+    return;
+  }
+  for( int i=0; i<COUNTERS; ++i )
+    sample->values[i] = buffer[1 + i];
+}
+
+void perfctr_record( perfctr_kernel_t kernel,
+		     const perfctr_sample_t* start,
+		     size_t amplitudes ) {
+  perfctr_sample_t end;
+  perfctr_read( &end );
+  perfctr_total_t* total = &_totals_[kernel];
+  total->calls += 1;
+  total->amplitudes += amplitudes;
+  total->ns += end.ns - start->ns;
+  for( int i=0; i<COUNTERS; ++i )
+    total->values[i] += end.values[i] - start->values[i];
+}
+
+void perfctr_print() {
+  if( !_perfctr_enabled_ )
+    return;
+  if( _group_ >= 0 )
+    printf("kernel             calls   amplitudes    seconds     IPC  "
+	   "misses/amp  bytes/amp\n");
+  else
+    printf("kernel             calls   amplitudes    seconds\n");
+  for( int k=0; k<PERFCTR_KERNELS; ++k ) {
+    const perfctr_total_t* total = &_totals_[k];
+    printf("  %-14s %8llu %12llu %10.6f", _kernel_names_[k],
+	   total->calls, total->amplitudes, total->ns * 1e-9);
+    if( _group_ >= 0 ) {
+      const double amplitudes = total->amplitudes ? total->amplitudes : 1;
+      printf("  %6.3f  %10.4f %10.2f",
+	     total->values[0] ? (double)total->values[1] / total->values[0] : 0,
+	     total->values[2] / amplitudes,
+	     total->values[2] * (double)CACHE_LINE / amplitudes);
+    }
+    printf("\n");
+  }
+  if( _group_ >= 0 ) {
+    for( int i=0; i<COUNTERS; ++i )
+      close( _fds_[i] );
+    _group_ = -1;
+  }
+}
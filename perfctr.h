@@ -0,0 +1,53 @@
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include "qvm.h"
+
+/* Hardware performance counters around the state-update kernels
+   (--perfctr).
+   Cycles, instructions and last-level cache misses are read with
+   perf_event_open around qop_cz, the measurement path, merge_tangles and
+   add_qubit.  An E between two tangles is counted once, under
+   merge_tangles, which applies its CZ in the same pass.  The counters
+   follow the calling thread only (grouped reads cannot inherit), so the
+   dense products run on one thread under --perfctr.  At exit IPC, misses
+   per amplitude and the memory traffic per amplitude (misses times the
+   cache line size, an estimate of bandwidth) are reported per kernel.
+   When the counters cannot be opened, e.g. in a container, only time and
+   amplitudes are reported. */
+
+typedef enum perfctr_kernel {
+  PERFCTR_CZ,
+  PERFCTR_MEASURE,
+  PERFCTR_MERGE,
+  PERFCTR_ADD_QUBIT,
+  PERFCTR_KERNELS
+} perfctr_kernel_t;
+
+typedef struct perfctr_sample {
+  unsigned long long ns;
+  unsigned long long values[3];  // cycles, instructions, LLC misses
+} perfctr_sample_t;
+
+extern bool _perfctr_enabled_;
+
+void perfctr_init();
+void perfctr_read( perfctr_sample_t* sample );
+void perfctr_record( perfctr_kernel_t kernel,
+		     const perfctr_sample_t* start,
+		     size_t amplitudes );
+void perfctr_print();
+
+static inline void perfctr_begin( perfctr_sample_t* sample ) {
+  if( _perfctr_enabled_ )
+    perfctr_read( sample );
+}
+
+static inline void perfctr_end( perfctr_kernel_t kernel,
+				const perfctr_sample_t* start,
+				size_t amplitudes ) {
+  if( _perfctr_enabled_ )
+    perfctr_record( kernel, start, amplitudes );
+}
+
+#endif
@@ -0,0 +1,176 @@
+// MAP_ANONYMOUS, MAP_HUGETLB
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef QVM_NUMA
+#include <numa.h>
+#endif
+
+#include "qvm.h"
+#include "placement.h"
+
+placement_policy_t _placement_policy_ = PLACEMENT_DEFAULT;
+huge_pages_t _huge_pages_ = HUGE_PAGES_OFF;
+
+static bool _placing_ = false;   // set by either option
+#ifdef QVM_NUMA
+static bool _numa_ = false;      // more than one node to place on
+#endif
+static int _nodes_ = 1;
+// enumerate allocates on several threads
+static pthread_mutex_t _placement_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long _arrays_ = 0;
+static unsigned long _explicit_ = 0;
+static unsigned long _fallbacks_ = 0;
+
+static const char* _policy_names_[] = {
+  "default", "interleave", "blocked", "local"
+};
+static const char* _pages_names_[] = {
+  "off", "transparent", "explicit"
+};
+
+void placement_configure_numa( const char* spec ) {
+  int policy = -1;
+  for( int i=0; i<4; ++i )
+    if( strcmp( spec, _policy_names_[i] ) == 0 )
+      policy = i;
+  if( policy < 0 ) {
+    printf("ERROR: --numa expects default, interleave, blocked or local, "
+	   "got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  _placement_policy_ = policy;
+  _placing_ = true;
+#ifndef QVM_NUMA
+  if( policy != PLACEMENT_DEFAULT )
+    printf("WARNING: built without libnuma (make NUMA=1), --numa=%s is "
+	   "ignored\n", spec);
+#else
+  if( numa_available() < 0 ) {
+    if( policy != PLACEMENT_DEFAULT )
+      printf("WARNING: no NUMA support, --numa=%s is ignored\n", spec);
+    return;
+  }
+  _nodes_ = numa_num_configured_nodes();
+  _numa_ = _nodes_ > 1;
+  if( policy == PLACEMENT_INTERLEAVE && _numa_ )
+    numa_set_interleave_mask( numa_all_nodes_ptr );
+#endif
+}
+
+void placement_configure_pages( const char* spec ) {
+  int pages = -1;
+  for( int i=0; i<3; ++i )
+    if( strcmp( spec, _pages_names_[i] ) == 0 )
+      pages = i;
+  if( pages < 0 ) {
+    printf("ERROR: --huge-pages expects transparent, explicit or off, "
+	   "got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  _huge_pages_ = pages;
+  _placing_ = true;
+}
+
+bool placement_wanted( size_t bytes ) {
+  return _placing_ && bytes >= PLACEMENT_MIN_BYTES;
+}
+
+// an anonymous mapping starting on a multiple of align
+static char* map_aligned( size_t length, size_t align ) {
+  char* base = mmap( NULL, length + align, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+  if( base == MAP_FAILED )
+    return NULL;
+  const size_t head = (align - (size_t)base % align) % align;
+  if( head )
+    munmap( base, head );
+  if( align - head )
+    munmap( base + head + length, align - head );
+  return base + head;
+}
+
+#ifdef QVM_NUMA
+static void place( char* base, size_t length, size_t page ) {
+  switch( _placement_policy_ ) {
+  case PLACEMENT_DEFAULT:
+    break;
+  case PLACEMENT_INTERLEAVE:
+    numa_interleave_memory( base, length, numa_all_nodes_ptr );
+    break;
+  case PLACEMENT_LOCAL:
+    numa_setlocal_memory( base, length );
+    break;
+  case PLACEMENT_BLOCKED: {
+    // whole pages per share, the last node takes the rest
+    size_t share = (length / _nodes_ + page - 1) / page * page;
+    for( int node=0, k=0; node<=numa_max_node() && k<_nodes_; ++node ) {
+      if( !numa_bitmask_isbitset( numa_all_nodes_ptr, node ) )
+	continue;
+      const size_t from = k * share;
+      if( from >= length )
+	break;
+      numa_tonode_memory( base + from,
+			  length - from < share || k == _nodes_ - 1 ?
+			  length - from : share, node );
+      ++k;
+    }
+    break;
+  }
+  }
+}
+#endif
+
+void* placement_map( size_t bytes, size_t* length ) {
+  const bool huge = _huge_pages_ != HUGE_PAGES_OFF;
+  const size_t page =
+    huge ? HUGE_PAGE_BYTES : (size_t)sysconf( _SC_PAGESIZE );
+  *length = (bytes + page - 1) / page * page;
+  char* base = NULL;
+  bool pooled = false;
+  if( _huge_pages_ == HUGE_PAGES_EXPLICIT ) {
+    base = mmap( NULL, *length, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    pooled = base != MAP_FAILED;
+    if( !pooled )
+      base = NULL;
+  }
+  if( base == NULL ) {
+    base = map_aligned( *length, page );
+    if( base == NULL )
+      return NULL;
+    if( huge )
+      madvise( base, *length, MADV_HUGEPAGE );
+  }
+#ifdef QVM_NUMA
+  if( _numa_ )
+    place( base, *length, page );
+#endif
+
+  pthread_mutex_lock( &_placement_lock_ );
+  ++_arrays_;
+  if( pooled )
+    ++_explicit_;
+  else if( _huge_pages_ == HUGE_PAGES_EXPLICIT && _fallbacks_++ == 0 )
+    printf("WARNING: the hugetlb pool has no %zu MB left, using "
+	   "transparent huge pages\n", *length >> 20);
+  pthread_mutex_unlock( &_placement_lock_ );
+  return base;
+}
+
+void placement_print() {
+  if( _arrays_ == 0 )
+    return;
+  printf("placement: %lu arrays, numa %s over %d node%s, huge pages %s",
+	 _arrays_, _policy_names_[_placement_policy_], _nodes_,
+	 _nodes_ == 1 ? "" : "s", _pages_names_[_huge_pages_]);
+  if( _huge_pages_ == HUGE_PAGES_EXPLICIT )
+    printf(" (%lu from the pool)", _explicit_);
+  printf("\n");
+}
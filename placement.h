@@ -0,0 +1,54 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include "qvm.h"
+
+/* Page placement of large amplitude arrays (--numa=policy and
+   --huge-pages[=transparent|explicit|off]).
+   With either option, dense amplitude arrays of at least
+   PLACEMENT_MIN_BYTES get an anonymous mapping of their own instead of
+   heap memory, and their pages are placed before anything touches them:
+     default     first touch, every page on the node of the thread that
+                 writes it first, for the single threaded evaluator one node
+     interleave  page by page round robin over all nodes; also made the
+                 policy of the process, so the registers libquantum
+                 allocates itself are interleaved as well
+     blocked     one contiguous share of the array per node, in node
+                 order, as a kernel that splits the array into equal
+                 parts over threads pinned node by node would first touch it
+     local       all pages on the node of the allocating thread
+   transparent huge pages align the mapping to HUGE_PAGE_BYTES and ask for
+   them with madvise(MADV_HUGEPAGE), explicit ones come from the reserved
+   hugetlb pool and fall back to transparent ones when it runs dry.  NUMA
+   policies are ignored with a warning on kernels without NUMA support and
+   in builds without QVM_NUMA (make NUMA=1, links libnuma), where only the
+   huge page options take effect.
+   bench.sh --placement compares the combinations. */
+
+#define PLACEMENT_MIN_BYTES ((size_t)2 << 20)
+#define HUGE_PAGE_BYTES ((size_t)2 << 20)
+
+typedef enum {
+  PLACEMENT_DEFAULT,
+  PLACEMENT_INTERLEAVE,
+  PLACEMENT_BLOCKED,
+  PLACEMENT_LOCAL
+} placement_policy_t;
+
+typedef enum {
+  HUGE_PAGES_OFF,
+  HUGE_PAGES_TRANSPARENT,
+  HUGE_PAGES_EXPLICIT
+} huge_pages_t;
+
+extern placement_policy_t _placement_policy_;
+extern huge_pages_t _huge_pages_;
+
+void placement_configure_numa( const char* spec );
+void placement_configure_pages( const char* spec );
+bool placement_wanted( size_t bytes );
+// zeroed pages for bytes, *length of them to unmap; NULL if out of memory
+void* placement_map( size_t bytes, size_t* length );
+void placement_print();
+
+#endif
@@ -0,0 +1,65 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "qvm.h"
+#include "profile.h"
+
+typedef struct profile_entry {
+  unsigned long long calls;
+  unsigned long long ns;
+} profile_entry_t;
+
+static const char* _profile_names_[PROFILE_IDS] = {
+  "E", "M", "X", "Z",
+  "parse", "lookup", "kronecker", "cz", "merge_cz", "phase_kick", "hadamard",
+  "measure", "sigma", "normalize"
+};
+
+bool _profile_enabled_ = false;
+
+static profile_entry_t _profile_[PROFILE_IDS];
+static unsigned long long _profile_start_;
+
+unsigned long long profile_now() {
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void profile_record( profile_id_t id, unsigned long long start ) {
+  _profile_[id].calls += 1;
+  _profile_[id].ns += profile_now() - start;
+}
+
+void profile_init() {
+  _profile_enabled_ = true;
+  _profile_start_ = profile_now();
+}
+
+static void write_entries( FILE* output, int first, int last ) {
+  for( int id=first; id<last; ++id )
+    fprintf( output, "    \"%s\": {\"calls\": %llu, \"seconds\": %.9f}%s\n",
+	     _profile_names_[id], _profile_[id].calls, _profile_[id].ns * 1e-9,
+	     id+1 < last ? "," : "" );
+}
+
+void profile_write( const char* file ) {
+  if( !_profile_enabled_ )
+    return;
+  const double total = (profile_now() - _profile_start_) * 1e-9;
+  FILE* output = fopen( file, "w" );
+  if( !output ) {
+    perror("ERROR: opening profile file");
+    return;
+  }
+  fprintf( output, "{\n  \"total_seconds\": %.9f,\n", total );
+  fprintf( output, "  \"commands\": {\n" );
+  write_entries( output, PROFILE_E, PROFILE_PARSE );
+  fprintf( output, "  },\n  \"kernels\": {\n" );
+  write_entries( output, PROFILE_PARSE, PROFILE_IDS );
+  fprintf( output, "  }\n}\n" );
+  fclose( output );
+}
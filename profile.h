@@ -0,0 +1,50 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "qvm.h"
+
+/* Opt-in profiler (--profile=file).
+   Accumulates wall time and call counts per command type and per kernel
+   and writes them as JSON at exit.  Command times include the kernels they
+   call; kernel times are disjoint.  Hash table rebuilds happen inside
+   libquantum's gates and are part of the hadamard kernel.  When disabled,
+   every hook costs a single branch. */
+
+typedef enum profile_id {
+  // commands
+  PROFILE_E,
+  PROFILE_M,
+  PROFILE_X,
+  PROFILE_Z,
+  // kernels
+  PROFILE_PARSE,
+  PROFILE_LOOKUP,
+  PROFILE_KRONECKER,
+  PROFILE_CZ,
+  PROFILE_MERGE_CZ,   // merge_tangles, the CZ of the E is fused into it
+  PROFILE_PHASE_KICK,
+  PROFILE_HADAMARD,
+  PROFILE_MEASURE,
+  PROFILE_SIGMA,
+  PROFILE_NORMALIZE,
+  PROFILE_IDS
+} profile_id_t;
+
+extern bool _profile_enabled_;
+
+unsigned long long profile_now();
+void profile_record( profile_id_t id, unsigned long long start );
+
+static inline unsigned long long profile_begin() {
+  return _profile_enabled_ ? profile_now() : 0;
+}
+
+static inline void profile_end( profile_id_t id, unsigned long long start ) {
+  if( _profile_enabled_ )
+    profile_record( id, start );
+}
+
+void profile_init();
+void profile_write( const char* file );
+
+#endif
@@ -0,0 +1,488 @@
+/* Python bindings over libqvm (make python).
+
+     import qvm, numpy
+     m = qvm.Machine( seed=3 )
+     m.load( open( "ghz-3.mc" ).read() )
+     m.run()                  # the GIL is released while the pattern runs
+     s = m.state()            # the first tangle, as written by -o
+     a = numpy.asarray( s.amplitudes )   # complex64, no copy
+     b = numpy.asarray( s.basis )        # uint64 basis states, no copy
+
+   amplitudes and basis export the register of the machine through the
+   buffer protocol: strided views into the (amplitude, state) nodes of a
+   sparse tangle.  A dense tangle exports its amplitude array as it is,
+   indexed by basis state, and basis is None.
+   While a view is exported the machine refuses to run, load or reset, and
+   a State taken before the last run cannot export anymore.
+   run() lets other Python threads go on while the pattern runs, but
+   libqvm runs one call at a time, so machines in different threads take
+   turns instead of running in parallel. */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdbool.h>
+
+#include "libqvm.h"
+
+static PyObject* _qvm_error_;
+
+typedef struct {
+  PyObject_HEAD
+  qvm_t* vm;
+  unsigned long generation;  // bumped whenever the quantum memory changes
+  Py_ssize_t exports;        // buffers handed out
+  bool running;
+} MachineObject;
+
+typedef struct {
+  PyObject_HEAD
+  MachineObject* machine;
+  unsigned long generation;
+  PyObject* qids;            // tuple
+  Py_ssize_t size;
+  const quantum_reg_node* nodes;
+  const COMPLEX_FLOAT* amplitudes;  // dense, nodes is NULL
+} StateObject;
+
+typedef struct {
+  PyObject_HEAD
+  StateObject* state;
+  bool amplitudes;           // else the basis states
+  Py_ssize_t shape;
+  Py_ssize_t stride;
+} ArrayObject;
+
+static PyTypeObject StateType;
+static PyTypeObject ArrayType;
+
+/* the machine may change its quantum memory */
+static bool machine_idle( MachineObject* self ) {
+  if( self->running ) {
+    PyErr_SetString( PyExc_RuntimeError,
+		     "the machine is running in another thread" );
+    return false;
+  }
+  if( self->exports ) {
+    PyErr_SetString( PyExc_BufferError,
+		     "the amplitudes of the machine are still exported" );
+    return false;
+  }
+  return true;
+}
+
+static int Machine_init( MachineObject* self, PyObject* args,
+			 PyObject* kwds ) {
+  static char* keywords[] = { "seed", NULL };
+  PyObject* seed = Py_None;
+
+  if( !PyArg_ParseTupleAndKeywords( args, kwds, "|O", keywords, &seed ) )
+    return -1;
+  if( self->vm == NULL && (self->vm = qvm_new()) == NULL ) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  if( seed != Py_None ) {
+    const unsigned long long value = PyLong_AsUnsignedLongLong( seed );
+    if( PyErr_Occurred() )
+      return -1;
+    qvm_seed( self->vm, value );
+  }
+  return 0;
+}
+
+static void Machine_dealloc( MachineObject* self ) {
+  qvm_free( self->vm );
+  Py_TYPE(self)->tp_free( (PyObject*)self );
+}
+
+static PyObject* Machine_load( MachineObject* self, PyObject* args,
+			       PyObject* kwds ) {
+  static char* keywords[] = { "pattern", "shorten_wires", NULL };
+  const char* pattern;
+  Py_ssize_t length;
+  int shorten = 0;
+
+  if( !PyArg_ParseTupleAndKeywords( args, kwds, "s#|p", keywords,
+				    &pattern, &length, &shorten ) ||
+      !machine_idle( self ) )
+    return NULL;
+  ++self->generation;
+  if( qvm_load( self->vm, pattern, length, shorten ) != QVM_OK ) {
+    PyErr_SetString( _qvm_error_, "cannot load the pattern" );
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject* Machine_set_input( MachineObject* self, PyObject* args ) {
+  PyObject* qids_arg;
+  PyObject* amplitudes_arg;
+  Py_buffer view;
+  int qids[64];
+
+  if( !PyArg_ParseTuple( args, "OO", &qids_arg, &amplitudes_arg ) ||
+      !machine_idle( self ) )
+    return NULL;
+  PyObject* qids_seq = PySequence_Fast( qids_arg, "qids must be a sequence" );
+  if( qids_seq == NULL )
+    return NULL;
+  const Py_ssize_t width = PySequence_Fast_GET_SIZE( qids_seq );
+  if( width < 1 || width >= 31 ) {
+    Py_DECREF( qids_seq );
+    PyErr_SetString( PyExc_ValueError, "input states take 1 to 30 qubits" );
+    return NULL;
+  }
+  for( Py_ssize_t i=0; i<width; ++i ) {
+    qids[i] = PyLong_AsLong( PySequence_Fast_GET_ITEM( qids_seq, i ) );
+    if( PyErr_Occurred() ) {
+      Py_DECREF( qids_seq );
+      return NULL;
+    }
+  }
+  Py_DECREF( qids_seq );
+
+  const Py_ssize_t states = (Py_ssize_t)1 << width;
+  COMPLEX_FLOAT* copy = NULL;
+  const COMPLEX_FLOAT* amplitudes;
+  // complex64 buffers are read in place, anything else is converted
+  if( PyObject_GetBuffer( amplitudes_arg, &view,
+			  PyBUF_C_CONTIGUOUS | PyBUF_FORMAT ) == 0 ) {
+    if( view.format == NULL || strcmp( view.format, "Zf" ) != 0 ||
+	view.len != states * (Py_ssize_t)sizeof(COMPLEX_FLOAT) ) {
+      PyBuffer_Release( &view );
+      PyErr_Format( PyExc_ValueError,
+		    "amplitudes must be %zd complex64 values", states );
+      return NULL;
+    }
+    amplitudes = view.buf;
+  }
+  else {
+    PyErr_Clear();
+    view.obj = NULL;
+    PyObject* seq = PySequence_Fast( amplitudes_arg,
+				     "amplitudes must be a sequence" );
+    if( seq == NULL )
+      return NULL;
+    if( PySequence_Fast_GET_SIZE( seq ) != states ) {
+      Py_DECREF( seq );
+      PyErr_Format( PyExc_ValueError, "expected %zd amplitudes", states );
+      return NULL;
+    }
+    copy = PyMem_Malloc( states * sizeof(COMPLEX_FLOAT) );
+    if( copy == NULL ) {
+      Py_DECREF( seq );
+      return PyErr_NoMemory();
+    }
+    for( Py_ssize_t i=0; i<states; ++i ) {
+      const Py_complex z =
+	PyComplex_AsCComplex( PySequence_Fast_GET_ITEM( seq, i ) );
+      copy[i] = z.real + z.imag * IMAGINARY;
+    }
+    Py_DECREF( seq );
+    if( PyErr_Occurred() ) {
+      PyMem_Free( copy );
+      return NULL;
+    }
+    amplitudes = copy;
+  }
+
+  ++self->generation;
+  const int status = qvm_set_input( self->vm, qids, width, amplitudes );
+  if( view.obj )
+    PyBuffer_Release( &view );
+  PyMem_Free( copy );
+  if( status != QVM_OK ) {
+    PyErr_SetString( _qvm_error_, "cannot set the input state" );
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject* Machine_run( MachineObject* self, PyObject* unused ) {
+  int status;
+
+  if( !machine_idle( self ) )
+    return NULL;
+  ++self->generation;
+  self->running = true;
+  // libqvm's lock keeps other machines out meanwhile
+  Py_BEGIN_ALLOW_THREADS
+  status = qvm_run( self->vm );
+  Py_END_ALLOW_THREADS
+  self->running = false;
+  if( status != QVM_OK ) {
+    PyErr_SetString( _qvm_error_,
+		     "the pattern failed, see the ERROR printed by qvm" );
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject* Machine_reset( MachineObject* self, PyObject* unused ) {
+  if( !machine_idle( self ) )
+    return NULL;
+  ++self->generation;
+  qvm_reset( self->vm );
+  Py_RETURN_NONE;
+}
+
+static PyObject* Machine_signal( MachineObject* self, PyObject* args ) {
+  int qid;
+
+  if( !PyArg_ParseTuple( args, "i", &qid ) )
+    return NULL;
+  if( self->running ) {
+    PyErr_SetString( PyExc_RuntimeError,
+		     "the machine is running in another thread" );
+    return NULL;
+  }
+  const int signal = qvm_signal( self->vm, qid );
+  if( signal < 0 )
+    Py_RETURN_NONE;
+  return PyLong_FromLong( signal );
+}
+
+static PyObject* Machine_state( MachineObject* self, PyObject* args ) {
+  qvm_state_t state;
+  int qid = -1;
+
+  if( !PyArg_ParseTuple( args, "|i", &qid ) )
+    return NULL;
+  if( self->running ) {
+    PyErr_SetString( PyExc_RuntimeError,
+		     "the machine is running in another thread" );
+    return NULL;
+  }
+  if( qvm_state( self->vm, qid, &state ) != QVM_OK )
+    Py_RETURN_NONE;
+  PyObject* qids = PyTuple_New( state.width );
+  if( qids == NULL )
+    return NULL;
+  for( int i=0; i<state.width; ++i )
+    PyTuple_SET_ITEM( qids, i, PyLong_FromLong( state.qids[i] ) );
+  StateObject* result = PyObject_New( StateObject, &StateType );
+  if( result == NULL ) {
+    Py_DECREF( qids );
+    return NULL;
+  }
+  Py_INCREF( self );
+  result->machine = self;
+  result->generation = self->generation;
+  result->qids = qids;
+  result->size = state.size;
+  result->nodes = state.nodes;
+  result->amplitudes = state.amplitudes;
+  return (PyObject*)result;
+}
+
+static PyMethodDef Machine_methods[] = {
+  {"load", (PyCFunction)Machine_load, METH_VARARGS | METH_KEYWORDS,
+   "load(pattern, shorten_wires=False): parse a pattern"},
+  {"set_input", (PyCFunction)Machine_set_input, METH_VARARGS,
+   "set_input(qids, amplitudes): add an input state of 2^len(qids) "
+   "amplitudes"},
+  {"run", (PyCFunction)Machine_run, METH_NOARGS,
+   "run(): evaluate the loaded pattern without holding the GIL"},
+  {"reset", (PyCFunction)Machine_reset, METH_NOARGS,
+   "reset(): drop the quantum memory and the signals"},
+  {"signal", (PyCFunction)Machine_signal, METH_VARARGS,
+   "signal(qid): 0 or 1, None if qid was not measured"},
+  {"state", (PyCFunction)Machine_state, METH_VARARGS,
+   "state(qid=-1): the tangle of qid, or the first one; None if there is "
+   "none"},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MachineType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "qvm.Machine",
+  .tp_basicsize = sizeof(MachineObject),
+  .tp_dealloc = (destructor)Machine_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Machine(seed=None): an interpreter instance",
+  .tp_methods = Machine_methods,
+  .tp_init = (initproc)Machine_init,
+  .tp_new = PyType_GenericNew,
+};
+
+static void State_dealloc( StateObject* self ) {
+  Py_DECREF( self->qids );
+  Py_DECREF( self->machine );
+  PyObject_Del( self );
+}
+
+static PyObject* state_array( StateObject* self, bool amplitudes ) {
+  ArrayObject* array = PyObject_New( ArrayObject, &ArrayType );
+  if( array == NULL )
+    return NULL;
+  Py_INCREF( self );
+  array->state = self;
+  array->amplitudes = amplitudes;
+  array->shape = self->size;
+  array->stride = self->amplitudes ? sizeof(COMPLEX_FLOAT) :
+    sizeof(quantum_reg_node);
+  return (PyObject*)array;
+}
+
+static PyObject* State_amplitudes( StateObject* self, void* closure ) {
+  return state_array( self, true );
+}
+
+static PyObject* State_basis( StateObject* self, void* closure ) {
+  // the index of a dense amplitude is its basis state
+  if( self->amplitudes )
+    Py_RETURN_NONE;
+  return state_array( self, false );
+}
+
+static PyObject* State_qids( StateObject* self, void* closure ) {
+  Py_INCREF( self->qids );
+  return self->qids;
+}
+
+static PyObject* State_width( StateObject* self, void* closure ) {
+  return PyLong_FromSsize_t( PyTuple_GET_SIZE( self->qids ) );
+}
+
+static PyGetSetDef State_getset[] = {
+  {"amplitudes", (getter)State_amplitudes, NULL,
+   "complex64 amplitudes, exported without copying", NULL},
+  {"basis", (getter)State_basis, NULL,
+   "uint64 basis states of the amplitudes, exported without copying; None "
+   "for a dense state, whose amplitudes are indexed by basis state", NULL},
+  {"qids", (getter)State_qids, NULL, "qids of the tangle", NULL},
+  {"width", (getter)State_width, NULL, "number of qids", NULL},
+  {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyTypeObject StateType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "qvm.State",
+  .tp_basicsize = sizeof(StateObject),
+  .tp_dealloc = (destructor)State_dealloc,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "a tangle of a Machine, valid until it runs again",
+  .tp_getset = State_getset,
+};
+
+static void Array_dealloc( ArrayObject* self ) {
+  Py_DECREF( self->state );
+  PyObject_Del( self );
+}
+
+static int Array_getbuffer( ArrayObject* self, Py_buffer* view, int flags ) {
+  StateObject* state = self->state;
+  static const quantum_reg_node empty;
+
+  if( state->generation != state->machine->generation ) {
+    PyErr_SetString( PyExc_BufferError,
+		     "the state is stale, its machine has changed since" );
+    return -1;
+  }
+  if( (flags & PyBUF_WRITABLE) == PyBUF_WRITABLE ) {
+    PyErr_SetString( PyExc_BufferError, "the state is read-only" );
+    return -1;
+  }
+  // amplitudes and states of nodes interleave, the views are strided
+  if( (flags & PyBUF_STRIDES) != PyBUF_STRIDES && self->shape > 1 &&
+      state->amplitudes == NULL ) {
+    PyErr_SetString( PyExc_BufferError, "the state is a strided buffer" );
+    return -1;
+  }
+  const quantum_reg_node* nodes = state->size ? state->nodes : &empty;
+  if( state->amplitudes )
+    view->buf = (void*)state->amplitudes;
+  else
+    view->buf = self->amplitudes ? (void*)&nodes->amplitude :
+      (void*)&nodes->state;
+  view->itemsize = self->amplitudes ? sizeof(COMPLEX_FLOAT) :
+    sizeof(MAX_UNSIGNED);
+  view->len = self->shape * view->itemsize;
+  view->readonly = 1;
+  view->format = (flags & PyBUF_FORMAT) ? (self->amplitudes ? "Zf" : "Q") :
+    NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ?
+    &self->stride : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  view->obj = (PyObject*)self;
+  Py_INCREF( self );
+  ++state->machine->exports;
+  return 0;
+}
+
+static void Array_releasebuffer( ArrayObject* self, Py_buffer* view ) {
+  --self->state->machine->exports;
+}
+
+static PyBufferProcs Array_buffer = {
+  (getbufferproc)Array_getbuffer,
+  (releasebufferproc)Array_releasebuffer
+};
+
+static Py_ssize_t Array_length( ArrayObject* self ) {
+  return self->shape;
+}
+
+static PySequenceMethods Array_sequence = {
+  .sq_length = (lenfunc)Array_length,
+};
+
+static PyTypeObject ArrayType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "qvm.Array",
+  .tp_basicsize = sizeof(ArrayObject),
+  .tp_dealloc = (destructor)Array_dealloc,
+  .tp_as_sequence = &Array_sequence,
+  .tp_as_buffer = &Array_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "a read-only strided view of a State, see numpy.asarray()",
+};
+
+static PyObject* qvm_configure_option( PyObject* module, PyObject* args ) {
+  const char* option;
+  const char* value = NULL;
+
+  if( !PyArg_ParseTuple( args, "s|z", &option, &value ) )
+    return NULL;
+  if( qvm_configure( option, value ) != QVM_OK ) {
+    PyErr_Format( _qvm_error_, "cannot set option '%s'", option );
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef qvm_methods[] = {
+  {"configure", qvm_configure_option, METH_VARARGS,
+   "configure(option, value=None): set a process-wide option, one of "
+   "dense, truncate, pauli-frame, alt-measure and verbose"},
+  {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef qvm_module = {
+  PyModuleDef_HEAD_INIT,
+  "qvm",
+  "measurement calculus patterns evaluated in-process",
+  -1,
+  qvm_methods
+};
+
+PyMODINIT_FUNC PyInit_qvm( void ) {
+  if( PyType_Ready( &MachineType ) < 0 || PyType_Ready( &StateType ) < 0 ||
+      PyType_Ready( &ArrayType ) < 0 )
+    return NULL;
+  PyObject* module = PyModule_Create( &qvm_module );
+  if( module == NULL )
+    return NULL;
+  _qvm_error_ = PyErr_NewException( "qvm.Error", NULL, NULL );
+  Py_INCREF( _qvm_error_ );
+  Py_INCREF( &MachineType );
+  if( PyModule_AddObject( module, "Error", _qvm_error_ ) < 0 ||
+      PyModule_AddObject( module, "Machine", (PyObject*)&MachineType ) < 0 ) {
+    Py_DECREF( module );
+    return NULL;
+  }
+  return module;
+}
@@ -0,0 +1,23 @@
+# builds the qvm extension against ../libqvm.a, see qvmmodule.c
+#   make python
+import os
+from setuptools import setup, Extension
+
+# a position independent libsexp, the bundled one is not
+sexp_lib = os.environ.get("SEXP_LIB", "../sexp/lib")
+# libqvm.a built with make NUMA=1 needs libnuma
+numa = ["numa"] if os.environ.get("NUMA") == "1" else []
+
+setup(
+    name="qvm",
+    ext_modules=[
+        Extension(
+            "qvm",
+            sources=["qvmmodule.c"],
+            include_dirs=["..", "../sexp/include"],
+            extra_objects=["../libqvm.a"],
+            library_dirs=[sexp_lib],
+            libraries=["sexp", "quantum", "pthread", "m", "z"] + numa,
+        )
+    ],
+)
@@ -21,10 +21,29 @@
 
 #include "bitmask.h"
 #include "qvm.h"
+#include "checkpoint.h"
+#include "shots.h"
+#include "enumerate.h"
+#include "outcomes.h"
+#include "stats.h"
+#include "profile.h"
+#include "trace.h"
+#include "memstats.h"
+#include "perfctr.h"
+#include "generate.h"
+#include "dense.h"
+#include "truncation.h"
+#include "frame.h"
+#include "wires.h"
+#include "server.h"
+#include "batch.h"
+#include "mps.h"
+#include "distributed.h"
+#include "outofcore.h"
+#include "cold.h"
+#include "placement.h"
 
 #define STRING_SIZE (size_t)UCHAR_MAX	
-#define MAX_TANGLES (size_t)SHRT_MAX
-#define MAX_QUBITS  (size_t)SHRT_MAX
 
 #define car hd_sexp
 #define cdr next_sexp
@@ -44,21 +63,14 @@ quantum_reg _proto_dual_diag_qubit_;
 /************
  ** TANGLE **
  ************/
-typedef struct qid_list {
-  qid_t qid;
-  struct qid_list* rest;
-} qid_list_t;
-
-typedef struct tangle { 
-  tangle_size_t size;
-  qid_list_t* qids;
-  quantum_reg qureg;
- } tangle_t;  
-
 tangle_t* init_tangle() {
   tangle_t* tangle = (tangle_t*) malloc(sizeof(tangle_t));   //ALLOC tangle
   tangle->size = 0;
   tangle->qids = NULL;
+  tangle->amplitudes = NULL;
+  tangle->occupied = 0;
+  tangle->touched = 0;
+  tangle->cold = NULL;
   return tangle;
 }
 
@@ -76,6 +88,8 @@ void free_tangle( tangle_t* tangle ) {
   tangle->size = 0;
   tangle->qids = NULL;
   quantum_delete_qureg( &tangle->qureg );
+  ooc_free( tangle->amplitudes );
+  cold_free( tangle );
   free( tangle ); //FREE tangle
 }
 
@@ -92,11 +106,33 @@ const qid_list_t* cons = qids;
   printf("]");
 }
 
+// prints a dense tangle as quantum_print_qureg() would print its nodes
+static void print_dense( const tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  quantum_reg_node nodes[32];
+  quantum_reg reg = { .width = tangle->qureg.width, .node = nodes };
+  for( MAX_UNSIGNED i=0; i<states; ++i )
+    if( quantum_prob_inline( tangle->amplitudes[i] ) > DENSE_EPSILON ) {
+      if( reg.size == 32 ) {
+	printf("<a large quantum state>, really print? (y/N): ");
+	return;
+      }
+      nodes[reg.size++] = (quantum_reg_node){ .amplitude =
+					      tangle->amplitudes[i],
+					      .state = i };
+    }
+  quantum_print_qureg( reg );
+}
+
 void print_tangle( const tangle_t* restrict tangle ) {
   assert( tangle );
   print_qids( tangle->qids );
   printf(" ,\n    {\n");
-  if( tangle->qureg.size > 32 ) {
+  if( is_cold( tangle ) )
+    printf("<a compressed quantum state>\n");
+  else if( is_dense( tangle ) )
+    print_dense( tangle );
+  else if( tangle->qureg.size > 32 ) {
     printf("<a large quantum state>, really print? (y/N): ");
     /* if( getchar() == 'y' ) */
     /*   quantum_print_qureg( tangle->qureg ); */
@@ -109,18 +145,13 @@ void print_tangle( const tangle_t* restrict tangle ) {
 /***********
  ** QUBIT **
  ***********/
-typedef struct qubit {
-  tangle_t* tangle;
-  qid_t qid;
-  pos_t pos;
-} qubit_t;
-
-qubit_t _invalid_qubit_ = { NULL, -1, -1 };
+qubit_t _invalid_qubit_ = { NULL, -1, -1, -1 };
 
 // use this function to return a correct qureg position
-//  libquantum uses an reverse order (least significant == 0)
+//  the bit of a qubit is chosen by the engine and need not follow the
+//  order of the qids, canonicalize_tangle() restores that order
 int get_target( const qubit_t qubit ) {
-  return qubit.tangle->size - qubit.pos - 1;
+  return qubit.bit;
 }
 
 bool invalid( const qubit_t qubit ) {
@@ -135,20 +166,6 @@ quantum_reg* get_qureg( const qubit_t qubit ) {
 /**********
  ** QMEM **
  **********/
-typedef struct signal_map {
-  // two bitfields
-  //  entries : if qid has an entry, not needed for correct programs
-  //  signals : value of the signal
-  unsigned char entries[BITNSLOTS(MAX_QUBITS)];
-  unsigned char signals[BITNSLOTS(MAX_QUBITS)];
-} signal_map_t;
-
-typedef struct qmem {
-  size_t size;
-  signal_map_t signal_map;
-  tangle_t* tangles[MAX_TANGLES];
-} qmem_t;
-
 
 void print_signal_map( const signal_map_t* restrict signal_map ) {
   printf(" {\n");
@@ -160,6 +177,21 @@ void print_signal_map( const signal_map_t* restrict signal_map ) {
   printf(" }\n");
 }
 
+/* one character per measured qid, in increasing qid order */
+char* signal_outcome_string( const signal_map_t* restrict signal_map ) {
+  size_t length = 0;
+  for( int qid=0 ; qid<MAX_QUBITS ; ++qid )
+    if( BITTEST(signal_map->entries, qid) )
+      ++length;
+  char* outcome = malloc( length + 1 );
+  length = 0;
+  for( int qid=0 ; qid<MAX_QUBITS ; ++qid )
+    if( BITTEST(signal_map->entries, qid) )
+      outcome[length++] = BITTEST(signal_map->signals, qid) ? '1' : '0';
+  outcome[length] = 0;
+  return outcome;
+}
+
 bool get_signal( const qid_t qid, 
 		 const signal_map_t* restrict signal_map ) {
   if( BITTEST(signal_map->entries,qid) )
@@ -203,7 +235,7 @@ find_qubit_in_tangle( const qid_t qid,
        qids;
        ++i, qids=qids->rest ) {
     if( qids->qid == qid ) 
-      return (qubit_t){ (tangle_t*)tangle, qid, i };
+      return (qubit_t){ (tangle_t*)tangle, qid, i, qids->bit };
   }
   return _invalid_qubit_;
 }
@@ -211,17 +243,23 @@ find_qubit_in_tangle( const qid_t qid,
 qubit_t 
 find_qubit(const qid_t qid, const qmem_t* restrict qmem) {
   tangle_t* tangle;
-  qubit_t qubit;
+  qubit_t qubit = _invalid_qubit_;
+  const unsigned long long start = profile_begin();
   for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
     tangle = qmem->tangles[i];
     if( tangle ) {
       qubit = find_qubit_in_tangle(qid, tangle);
       if( !invalid(qubit) )
-	return qubit;      
+	break;
       ++tally;
     }
   }
-  return _invalid_qubit_;
+  profile_end( PROFILE_LOOKUP, start );
+  if( !invalid(qubit) ) {
+    qubit.tangle->touched = qmem->pc;
+    cold_thaw( qubit.tangle );
+  }
+  return qubit;
 }
 
 qid_list_t* add_qid( const qid_t qid, qid_list_t* restrict qids ) {
@@ -229,6 +267,7 @@ qid_list_t* add_qid( const qid_t qid, qid_list_t* restrict qids ) {
   // ALLOC QUBIT LIST
   qid_list_t* restrict new_qids = (qid_list_t*) malloc(sizeof(qid_list_t));
   new_qids->qid = qid;
+  new_qids->bit = 0;
   new_qids->rest = qids;
   return new_qids;
 }
@@ -241,6 +280,73 @@ void append_qids( qid_list_t* new_qids, qid_list_t* target_qids ) {
   target_qids->rest = new_qids;  
 }
 
+/* the layout libquantum and the file formats use: the first qid is the
+   most significant bit */
+void set_canonical_bits( tangle_t* restrict tangle ) {
+  int bit = tangle->size;
+  for( qid_list_t* cons = tangle->qids; cons; cons=cons->rest )
+    cons->bit = --bit;
+}
+
+/* swaps bits of the dense amplitudes in place until every qid sits on
+   its canonical bit */
+static void canonicalize_dense( tangle_t* restrict tangle ) {
+  qid_list_t* on_bit[sizeof(MAX_UNSIGNED) * CHAR_BIT];
+  for( qid_list_t* cons = tangle->qids; cons; cons=cons->rest )
+    on_bit[cons->bit] = cons;
+  int wanted = tangle->size;
+  for( qid_list_t* cons = tangle->qids; cons; cons=cons->rest ) {
+    --wanted;
+    if( cons->bit == wanted )
+      continue;
+    qid_list_t* other = on_bit[wanted];
+    dense_swap_bits( cons->bit, wanted, tangle );
+    other->bit = cons->bit;
+    on_bit[other->bit] = other;
+    cons->bit = wanted;
+    on_bit[wanted] = cons;
+  }
+}
+
+/* permutes the basis states back into the canonical layout, needed
+   before anything outside the evaluator looks at the amplitudes */
+void canonicalize_tangle( tangle_t* restrict tangle ) {
+  pos_t bits[sizeof(MAX_UNSIGNED) * CHAR_BIT];
+  int count = 0;
+  bool canonical = true;
+
+  cold_thaw( tangle );
+  if( is_dense( tangle ) ) {
+    canonicalize_dense( tangle );
+    return;
+  }
+  for( qid_list_t* cons = tangle->qids; cons; cons=cons->rest ) {
+    bits[count] = cons->bit;
+    canonical = canonical && cons->bit == tangle->size - count - 1;
+    ++count;
+  }
+  if( canonical )
+    return;
+  quantum_reg* reg = &tangle->qureg;
+  for( int i=0; i<reg->size; ++i ) {
+    const MAX_UNSIGNED state = reg->node[i].state;
+    MAX_UNSIGNED canonical_state = 0;
+    for( int pos=0; pos<count; ++pos )
+      canonical_state |= ((state >> bits[pos]) & 1) << (count - pos - 1);
+    reg->node[i].state = canonical_state;
+  }
+  // libquantum rebuilds the hash table before its next lookup
+  set_canonical_bits( tangle );
+}
+
+void canonicalize_qmem( qmem_t* restrict qmem ) {
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i )
+    if( qmem->tangles[i] ) {
+      canonicalize_tangle( qmem->tangles[i] );
+      ++tally;
+    }
+}
+
 /* void remove_qid( qid_t qid, qid_list_t* restrict qids ) { */
 /*   qid_list_t* restrict next; */
 /*   if( qids ) { */
@@ -279,34 +385,80 @@ void print_qmem( const qmem_t* restrict qmem ) {
   print_signal_map( &qmem->signal_map );
 }
 
+void init_prototypes() {
+  // instantiate prototypes (libquantum quregs)
+  _proto_diag_qubit_ = quantum_new_qureg(0, 1);
+  _proto_dual_diag_qubit_ = quantum_new_qureg(0, 2);
+  quantum_hadamard(0, &_proto_diag_qubit_);
+  quantum_hadamard(0, &_proto_dual_diag_qubit_);
+  quantum_hadamard(1, &_proto_dual_diag_qubit_);
+  quantum_gate2(0, 1, _cz_gate_, &_proto_dual_diag_qubit_);  
+}
+
+void free_prototypes() {
+  quantum_delete_qureg( &_proto_diag_qubit_ );
+  quantum_delete_qureg( &_proto_dual_diag_qubit_ );
+}
+
 qmem_t* init_qmem() {
   qmem_t* restrict qmem = malloc(sizeof(qmem_t)); //ALLOC qmem
 
   qmem->size = 0;
+  qmem->pc = 0;
   //qmem->tangles = calloc(MAX_TANGLES,sizeof(tangle_t*)); //ALLOC tangles
   //memset(&qmem->tangles, 0, sizeof(tangle_t*) * MAX_TANGLES);
   for( int i=0; i<MAX_TANGLES; ++i )
     qmem->tangles[i] = NULL;
   qmem->signal_map = (signal_map_t){{0},{0}};
-  
-  // instantiate prototypes (libquantum quregs)
-  _proto_diag_qubit_ = quantum_new_qureg(0, 1);
-  _proto_dual_diag_qubit_ = quantum_new_qureg(0, 2);
-  quantum_hadamard(0, &_proto_diag_qubit_);
-  quantum_hadamard(0, &_proto_dual_diag_qubit_);
-  quantum_hadamard(1, &_proto_dual_diag_qubit_);
-  quantum_gate2(0, 1, _cz_gate_, &_proto_dual_diag_qubit_);  
+  qmem->frame = (pauli_frame_t){{0},{0},0};
 
   // seed RNG
   //sranddev();
-  srand(time(0));
+  qmem->rng = time(0);
   return qmem;
 }
 
-void free_qmem(qmem_t* qmem) {
-  quantum_delete_qureg( &_proto_diag_qubit_ );
-  quantum_delete_qureg( &_proto_dual_diag_qubit_ );
+/* Deep copy of qmem, tangles keep their slot so that find_qubit visits them
+   in the same order as in the original */
+qmem_t* clone_qmem( const qmem_t* restrict qmem ) {
+  qmem_t* restrict copy = malloc(sizeof(qmem_t)); //ALLOC qmem
+  tangle_t* tangle;
+
+  copy->size = qmem->size;
+  copy->pc = qmem->pc;
+  copy->rng = qmem->rng;
+  copy->signal_map = qmem->signal_map;
+  copy->frame = qmem->frame;
+  for( int i=0, tally=0 ; i<MAX_TANGLES ; ++i ) {
+    copy->tangles[i] = NULL;
+    if( tally < qmem->size && qmem->tangles[i] ) {
+      tangle = init_tangle();
+      tangle->size = qmem->tangles[i]->size;
+      for( const qid_list_t* cons = qmem->tangles[i]->qids;
+	   cons;
+	   cons=cons->rest ) {
+	qid_list_t* copied = add_qid( cons->qid, NULL );
+	copied->bit = cons->bit;
+	if( tangle->qids )
+	  append_qids( copied, tangle->qids );
+	else
+	  tangle->qids = copied;
+      }
+      tangle->touched = qmem->tangles[i]->touched;
+      if( is_cold( qmem->tangles[i] ) )
+	cold_copy( qmem->tangles[i], tangle );
+      else {
+	quantum_copy_qureg( &qmem->tangles[i]->qureg, &tangle->qureg );
+	dense_copy( qmem->tangles[i], tangle );
+      }
+      copy->tangles[i] = tangle;
+      ++tally;
+    }
+  }
+  return copy;
+}
 
+void free_qmem(qmem_t* qmem) {
   for( int i=0, tally=0 ; tally < qmem->size ; i++ ) {
     assert(i<MAX_TANGLES);
     if( qmem->tangles[i] ) {
@@ -319,6 +471,20 @@ void free_qmem(qmem_t* qmem) {
   free(qmem); //FREE qmem
 }
 
+/* splitmix64, the complete RNG state is the single word in qmem so it can be
+   checkpointed and restored */
+unsigned long long qmem_rand( qmem_t* restrict qmem ) {
+  unsigned long long z = (qmem->rng += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* uniform in [0,1) */
+double qmem_uniform( qmem_t* restrict qmem ) {
+  return (qmem_rand( qmem ) >> 11) * (1.0 / 9007199254740992.0);
+}
+
 tangle_t* get_free_tangle(qmem_t* qmem) {
   tangle_t* restrict new_tangle = init_tangle();
   assert(new_tangle);
@@ -326,6 +492,7 @@ tangle_t* get_free_tangle(qmem_t* qmem) {
   for(int i=0; i<MAX_TANGLES; ++i) {
     if( qmem->tangles[i] == NULL ) {
       qmem->tangles[i] = new_tangle;
+      new_tangle->touched = qmem->pc;
       return new_tangle;
     }
   }
@@ -344,6 +511,7 @@ add_dual_tangle( const qid_t qid1,
   tangle->qids = add_qid( qid2, tangle->qids );
   tangle->qids = add_qid( qid1, tangle->qids );
   tangle->size = 2;
+  set_canonical_bits( tangle );
 
   // update qmem info
   qmem->size += 1;
@@ -351,6 +519,7 @@ add_dual_tangle( const qid_t qid1,
   // init quantum state
   quantum_copy_qureg(&_proto_dual_diag_qubit_,
 		     &tangle->qureg);
+  STATS_TOUCH( &tangle->qureg );
   return tangle;
 }
 
@@ -367,26 +536,49 @@ add_tangle( const qid_t qid,
   // init quantum state
   quantum_copy_qureg(&_proto_diag_qubit_,
 		     &tangle->qureg);
+  STATS_TOUCH( &tangle->qureg );
   return tangle;
 }
 
 
 /* Adds new qubit BEHIND existing state: |q> x |+>
+   Physically the new qubit takes the top bit, which leaves the bits of the
+   qubits already in the tangle where they are.
  */
 void
 add_qubit( const qid_t qid, 
 	   tangle_t* restrict tangle) {
   assert(tangle);
   // appends new qid:  qids := [[qids...],qid]
-  append_qids( add_qid(qid,NULL), tangle->qids );
+  qid_list_t* new_qid = add_qid(qid,NULL);
+  new_qid->bit = tangle->qureg.width;
+  append_qids( new_qid, tangle->qids );
   tangle->size += 1;
   // tensor |+> to tangle
+  perfctr_sample_t counters;
+  perfctr_begin( &counters );
+  const unsigned long long start = profile_begin();
+  if( is_dense( tangle ) ||
+      dense_wanted( tangle->qureg.width + 1, 2.0 * tangle_occupied( tangle ) ) ) {
+    dense_add_qubit( &_proto_diag_qubit_, tangle );
+    profile_end( PROFILE_KRONECKER, start );
+    if( _memstats_enabled_ )
+      memstats_transient_dense( tangle->qureg.width );
+    STATS_TOUCH( &tangle->qureg );
+    perfctr_end( PERFCTR_ADD_QUBIT, &counters, tangle_amplitudes( tangle ) );
+    return;
+  }
   const quantum_reg new_qureg = 
-    quantum_kronecker(&tangle->qureg,&_proto_diag_qubit_);
+    quantum_kronecker(&_proto_diag_qubit_,&tangle->qureg);
+  profile_end( PROFILE_KRONECKER, start );
+  if( _memstats_enabled_ )
+    memstats_transient( &new_qureg );
   // out with the old
   quantum_delete_qureg( &tangle->qureg );
   // in with the new
   tangle->qureg = new_qureg;
+  STATS_TOUCH( &tangle->qureg );
+  perfctr_end( PERFCTR_ADD_QUBIT, &counters, new_qureg.size );
 }
 
 void 
@@ -438,22 +630,85 @@ delete_qubit(const qubit_t qubit,
   }
 }
 
+/* quantum_kronecker() with a CZ between bit target_1 of reg_1 and bit
+   target_2 of reg_2 applied on the way */
+static quantum_reg kronecker_cz( const quantum_reg* restrict reg_1,
+				 const quantum_reg* restrict reg_2,
+				 int target_1, int target_2 ) {
+  const MAX_UNSIGNED mask_1 = (MAX_UNSIGNED) 1 << target_1;
+  const MAX_UNSIGNED mask_2 = (MAX_UNSIGNED) 1 << target_2;
+  quantum_reg reg;
+  reg.width = reg_1->width + reg_2->width;
+  reg.size = reg_1->size * reg_2->size;
+  reg.hashw = reg.width + 2;
+  reg.node = calloc( reg.size, sizeof(quantum_reg_node) );
+  reg.hash = calloc( (size_t)1 << reg.hashw, sizeof(int) );
+  if( reg.node == NULL || reg.hash == NULL ) {
+    printf("ERROR: out of memory merging tangles of width %d\n", reg.width);
+    exit(EXIT_FAILURE);
+  }
+  quantum_memman( reg.size * sizeof(quantum_reg_node) +
+		  ((long)1 << reg.hashw) * sizeof(int) );
+  quantum_reg_node* restrict node = reg.node;
+  for( int i=0; i<reg_1->size; ++i ) {
+    const MAX_UNSIGNED upper = reg_1->node[i].state << reg_2->width;
+    const COMPLEX_FLOAT factor = reg_1->node[i].amplitude;
+    const MAX_UNSIGNED mask = reg_1->node[i].state & mask_1 ? mask_2 : 0;
+    for( int j=0; j<reg_2->size; ++j, ++node ) {
+      node->state = upper | reg_2->node[j].state;
+      node->amplitude = (reg_2->node[j].state & mask ? -factor : factor) *
+	reg_2->node[j].amplitude;
+    }
+  }
+  return reg;
+}
+
+/* tangle_1 (x) tangle_2 into tangle_1, followed by the CZ of eval_E()
+   between bit target_1 of tangle_1 and bit target_2 of tangle_2 in the
+   same pass */
 void 
 merge_tangles(tangle_t* restrict tangle_1, 
 	      tangle_t* restrict tangle_2, 
+	      int target_1, int target_2,
 	      qmem_t* restrict qmem) {
   assert( tangle_1 && tangle_2 );
+  // tangle_1 ends up in the upper bits
+  for( qid_list_t* cons = tangle_1->qids; cons; cons=cons->rest )
+    cons->bit += tangle_2->qureg.width;
   tangle_1->size = tangle_1->size + tangle_2->size;
   // append qids of tangle_2 to tangle_1, destructively
   append_qids( tangle_2->qids, tangle_1->qids);
   // tensor both quregs
-  const quantum_reg new_qureg = 
-    quantum_kronecker( &tangle_1->qureg, &tangle_2->qureg );
-  // out with the old
-  quantum_delete_qureg( &tangle_1->qureg );
-  quantum_delete_qureg( &tangle_2->qureg );
-  // in with the new
-  tangle_1->qureg = new_qureg;
+  perfctr_sample_t counters;
+  perfctr_begin( &counters );
+  const unsigned long long start = profile_begin();
+  const int width = tangle_1->qureg.width + tangle_2->qureg.width;
+  if( is_dense( tangle_1 ) || is_dense( tangle_2 ) ||
+      dense_wanted( width, (double)tangle_occupied( tangle_1 ) *
+		    tangle_occupied( tangle_2 ) ) ) {
+    dense_merge( tangle_1, tangle_2, target_1, target_2 );
+    profile_end( PROFILE_MERGE_CZ, start );
+    if( _memstats_enabled_ )
+      memstats_transient_dense( width );
+  }
+  else {
+    const quantum_reg new_qureg = 
+      kronecker_cz( &tangle_1->qureg, &tangle_2->qureg, target_1, target_2 );
+    profile_end( PROFILE_MERGE_CZ, start );
+    if( _memstats_enabled_ )
+      memstats_transient( &new_qureg );
+    // out with the old
+    quantum_delete_qureg( &tangle_1->qureg );
+    quantum_delete_qureg( &tangle_2->qureg );
+    // in with the new
+    tangle_1->qureg = new_qureg;
+  }
+  if( _truncation_enabled_ ) {
+    truncation_prune( tangle_1 );
+    tangle_update_representation( tangle_1 );
+  }
+  STATS_TOUCH( &tangle_1->qureg );
+  perfctr_end( PERFCTR_MERGE, &counters, tangle_amplitudes( tangle_1 ) );
 
   tangle_2->qids = NULL; // avoids the qid_list from being collected
   delete_tangle( tangle_2, qmem ); //free the tangle
@@ -519,9 +774,16 @@ void add_new_constant(const char* name, double value) {
 	   " to add one more\n", sizeof(_angle_constants_));
     exit(EXIT_FAILURE);
   }
+  // name is a buffer of parse_angle(), the table outlives it
+  char* copy = malloc( strlen( name ) + 1 );
+  if( copy == NULL ) {
+    printf("ERROR: out of memory adding an angle constant\n");
+    exit(EXIT_FAILURE);
+  }
+  strcpy( copy, name );
   angle_constant_t* restrict entry = 
     &_angle_constants_[_angle_constants_free_++];
-  entry->name = name;
+  entry->name = copy;
   entry->value = value;
 }
 
@@ -690,8 +952,8 @@ quantum_diag_measure(int pos, double angle, quantum_reg* restrict reg)
   //int value=0;
   quantum_reg out;
   MAX_UNSIGNED pos2 = (MAX_UNSIGNED) 1 << pos;
-  double limit = (1.0 / ((MAX_UNSIGNED) 1 << reg->width)) / 1000000;
-  double prob=0, norm = 0;
+  const double limit = truncation_limit( reg->width );
+  double prob=0, norm = 0, dropped = 0;
   COMPLEX_FLOAT amp = 0;
 
   // TODO: currently just measures to <+_alpha|
@@ -744,10 +1006,14 @@ quantum_diag_measure(int pos, double angle, quantum_reg* restrict reg)
 	out.node[free].state = state;
 	++free;
       }
+      else
+	dropped += prob;
       amp = 0;
     }
   }
   out.size = free;
+  if( _truncation_enabled_ && dropped > 0 )
+    truncation_discarded( dropped / (norm + dropped) );
   if( out.size != reg->size ) {
     out.node = realloc(out.node, (out.size)*sizeof(quantum_reg_node));
     if(out.node == NULL) 
@@ -786,25 +1052,103 @@ void qop_cz( const qubit_t qubit_1, const qubit_t qubit_2 ) {
   // manual cz because a) libquantum's gate2 appears to be bugggy and
   //  can be implemented optimally relatively easily, similar to cnot
   quantum_reg* reg = get_qureg( qubit_1 );
-  MAX_UNSIGNED bitmask = 
-    ((MAX_UNSIGNED) 1 << tar1) | ((MAX_UNSIGNED) 1 << tar2);
-  for(int i=0; i<reg->size; i++)
-    {
-      /* Flip the target bit of a basis state if the control bit is set */     
-      if((reg->node[i].state & bitmask) == bitmask)
-	reg->node[i].amplitude *= (COMPLEX_FLOAT)-1;
-    }
+  perfctr_sample_t counters;
+  perfctr_begin( &counters );
+  const unsigned long long start = profile_begin();
+  STATS_TOUCH( reg );
+  if( is_dense( qubit_1.tangle ) )
+    dense_cz( tar1, tar2, qubit_1.tangle );
+  else {
+    MAX_UNSIGNED bitmask = 
+      ((MAX_UNSIGNED) 1 << tar1) | ((MAX_UNSIGNED) 1 << tar2);
+    for(int i=0; i<reg->size; i++)
+      {
+	/* Flip the target bit of a basis state if the control bit is set */     
+	if((reg->node[i].state & bitmask) == bitmask)
+	  reg->node[i].amplitude *= (COMPLEX_FLOAT)-1;
+      }
+  }
+  profile_end( PROFILE_CZ, start );
+  perfctr_end( PERFCTR_CZ, &counters, tangle_amplitudes( qubit_1.tangle ) );
   //  quantum_gate2(tar1, tar2, _cz_gate_, get_qureg(qubit_1)); 
 }
 
+/* probability of finding the target bit 0, relative to the norm of reg */
+double quantum_prob_zero( int target, const quantum_reg* restrict reg ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  double zero = 0, one = 0;
+  STATS_TOUCH( reg );
+  for( int i=0; i<reg->size; ++i ) {
+    if( reg->node[i].state & mask )
+      one += quantum_prob_inline( reg->node[i].amplitude );
+    else
+      zero += quantum_prob_inline( reg->node[i].amplitude );
+  }
+  return zero + one > 0 ? zero / (zero + one) : 1.0;
+}
+
+/* Projects the target bit onto value and removes it from the register.
+   Unlike quantum_bmeasure, which shifts all higher bits down, the top bit
+   moves into the freed one, so measuring the top qubit is a plain copy of
+   one half; the caller remaps the qubit that had the top bit.
+   prob is the probability of value, used to renormalize. */
+void quantum_collapse( int target, int value, double prob, 
+		       quantum_reg* restrict reg ) {
+  const MAX_UNSIGNED mask = (MAX_UNSIGNED) 1 << target;
+  const MAX_UNSIGNED top = (MAX_UNSIGNED) 1 << (reg->width - 1);
+  const MAX_UNSIGNED wanted = value ? mask : 0;
+  const float norm = 1.0 / sqrt( prob );
+  int size = 0;
+  double kept = 0;
+
+  assert( prob > 0 );
+  STATS_TOUCH( reg );
+  for( int i=0; i<reg->size; ++i ) {
+    const MAX_UNSIGNED state = reg->node[i].state;
+    if( (state & mask) == wanted ) {
+      kept += quantum_prob_inline( reg->node[i].amplitude );
+      reg->node[size].state = (state & top) && top != mask ? 
+	(state & ~top) | mask : state & ~mask;
+      reg->node[size].amplitude = reg->node[i].amplitude;
+      ++size;
+    }
+  }
+  if( kept == 0 ) {
+    printf("ERROR: collapsing onto an outcome with zero probability\n");
+    exit(EXIT_FAILURE);
+  }
+  for( int i=0; i<size; ++i )
+    reg->node[i].amplitude *= norm;
+  if( size != reg->size ) {
+    quantum_memman( -(long)(reg->size - size) * (long)sizeof(quantum_reg_node) );
+    reg->node = realloc( reg->node, size * sizeof(quantum_reg_node) );
+    if( reg->node == NULL )
+      quantum_error(QUANTUM_ENOMEM);
+  }
+  reg->size = size;
+  reg->width -= 1;
+}
+
 void qop_x( const qubit_t qubit ) {
   assert( !invalid(qubit) );
-  quantum_sigma_x( get_target(qubit), get_qureg(qubit) );
+  const unsigned long long start = profile_begin();
+  STATS_TOUCH( get_qureg(qubit) );
+  if( is_dense( qubit.tangle ) )
+    dense_sigma_x( get_target(qubit), qubit.tangle );
+  else
+    quantum_sigma_x( get_target(qubit), get_qureg(qubit) );
+  profile_end( PROFILE_SIGMA, start );
 }
 
 void qop_z( const qubit_t qubit ) {
   assert( !invalid(qubit) );
-  quantum_sigma_z( get_target(qubit), get_qureg(qubit) );
+  const unsigned long long start = profile_begin();
+  STATS_TOUCH( get_qureg(qubit) );
+  if( is_dense( qubit.tangle ) )
+    dense_sigma_z( get_target(qubit), qubit.tangle );
+  else
+    quantum_sigma_z( get_target(qubit), get_qureg(qubit) );
+  profile_end( PROFILE_SIGMA, start );
 }
 
 /* Apply a phase kick by the angle GAMMA */
@@ -856,6 +1200,9 @@ void eval_E(sexp_t* exp, qmem_t* qmem) {
     exit(EXIT_FAILURE);
   }
   qid2 = get_qid( exp );
+  // pending X corrections turn into Z corrections on the partner
+  if( _pauli_frame_ )
+    frame_cz( qid1, qid2, qmem );
 
   // get tangle for qid1
   qubit_1 = find_qubit( qid1, qmem );
@@ -880,9 +1227,12 @@ void eval_E(sexp_t* exp, qmem_t* qmem) {
 	qop_cz( qubit_1, qubit_2 );
 	return;
       }
-      else
-	// both tangles are non-NULL, merge both
-	merge_tangles(qubit_1.tangle, qubit_2.tangle, qmem);
+      else {
+	// both tangles are non-NULL, merge both and apply the CZ with it
+	merge_tangles(qubit_1.tangle, qubit_2.tangle,
+		      get_target(qubit_1), get_target(qubit_2), qmem);
+	return;
+      }
   // get valid qubit entries
   qubit_1 = find_qubit( qid1, qmem );
   qubit_2 = find_qubit( qid2, qmem );
@@ -935,13 +1285,25 @@ bool satisfy_signals( const sexp_t* restrict exp,
   exit(EXIT_FAILURE);
 }
 
-void eval_M(sexp_t* exp, qmem_t* qmem) {
-  int qid;
-  double angle = 0.0;
-  tangle_t* tangle;
-  int signal;
-  assert( qmem );
+/* parses the angle of every M in program once, so the constants nobody
+   knows are asked for now and not by the threads of --enumerate */
+void resolve_angle_constants( const sexp_t* program ) {
+  for( ; program; program = program->next ) {
+    sexp_t* command = program->ty == SEXP_LIST ? program->list : NULL;
+    if( command && command->ty == SEXP_VALUE &&
+	get_opname( command ) == 'M' && command->next && command->next->next )
+      parse_angle( command->next->next );
+  }
+}
+
+/* Parses (M qid angle s t): returns the target qid, angle gets the angle
+   (0 when missing) corrected by the s- and t-signals */
+qid_t parse_measurement_angle( sexp_t* exp, 
+			       const qmem_t* restrict qmem, 
+			       double* angle ) {
+  qid_t qid;
 
+  *angle = 0.0;
   // move to the first argument
   exp = cdr(exp);
   if( !exp ) {
@@ -953,20 +1315,28 @@ void eval_M(sexp_t* exp, qmem_t* qmem) {
   // move to the second argument
   exp = cdr(exp);
   if( exp ) { // default is 0
-    angle = parse_angle( exp );
+    *angle = parse_angle( exp );
     // change angles by s- and t-signals when available
     exp = cdr(exp);
     if( exp ) { //s-signal, flips sign
       if( _verbose_ )
-	printf("before angle correction, angle: %f\n", angle);
+	printf("before angle correction, angle: %f\n", *angle);
       if( satisfy_signals(exp, qmem) )
-	angle = -angle;
+	*angle = -*angle;
       exp = cdr(exp);
       if( exp )  //t-signal, adds PI to angle
 	if( satisfy_signals(exp, qmem) )
-	  angle += M_PI;
+	  *angle += M_PI;
     }
   }
+  return qid;
+}
+
+qubit_t parse_measurement( sexp_t* exp, qmem_t* qmem, double* angle ) {
+  tangle_t* tangle;
+  assert( qmem );
+
+  const qid_t qid = parse_measurement_angle( exp, qmem, angle );
   
   //  printf("  Measuring qubits %d\n",qid);
 
@@ -976,71 +1346,186 @@ void eval_M(sexp_t* exp, qmem_t* qmem) {
     tangle = add_tangle( qid, qmem );
     qubit = find_qubit_in_tangle( qid, tangle );
   }
+  if( _pauli_frame_ )
+    frame_measure( qid, angle, qmem );
+  if( _verbose_ )
+    printf("  measuring qubit %d on angle %2.4f\n", qid, *angle);
+  return qubit;
+}
+
+/* First half of a measurement: rotates the measured qubit so that the
+   measurement becomes a computational basis one and returns the
+   probability of signal 0 */
+qid_t eval_M_rotate( sexp_t* exp, qmem_t* qmem, double* prob_zero ) {
+  double angle;
+  const qubit_t qubit = parse_measurement( exp, qmem, &angle );
+
   // libquantum can only measure in ortho basis,
   //  but <+|q = <0|Hq makes it diagonal
   //  and <+_a| = <+|P_-a
-  if( _verbose_ )
-    printf("  measuring qubit %d on angle %2.4f\n", qid, angle);
   /* printf("   before + correction:\n"); */
   /* quantum_print_qureg( qubit.tangle->qureg ); */
   
   //  quantum_inv_phase_kick( get_target(qubit), angle, get_qureg(qubit) );
 
-  if( _alt_measure_ )
-    signal = quantum_diag_measure( get_target(qubit), 
-				   angle,
-				   get_qureg(qubit) );
-  else {
+  unsigned long long start = profile_begin();
+  if( is_dense( qubit.tangle ) )
+    dense_phase_kick( get_target(qubit), -angle, qubit.tangle );
+  else
     quantum_phase_kick( get_target(qubit), -angle, get_qureg( qubit ) );
+  STATS_TOUCH( get_qureg( qubit ) );
+  profile_end( PROFILE_PHASE_KICK, start );
   
-    //printf("   after kick: \n");
-    //  quantum_print_qureg( qubit.tangle->qureg );
+  //printf("   after kick: \n");
+  //  quantum_print_qureg( qubit.tangle->qureg );
 
+  start = profile_begin();
+  if( is_dense( qubit.tangle ) )
+    dense_hadamard( get_target(qubit), qubit.tangle );
+  else {
     quantum_hadamard( get_target(qubit), get_qureg( qubit ) );
+    // the sparse tangle may have filled up
+    tangle_update_representation( qubit.tangle );
+  }
+  STATS_TOUCH( get_qureg( qubit ) );
+  profile_end( PROFILE_HADAMARD, start );
   
-    //printf("   measuring : \n"     );
-    // quantum_print_qureg( qubit.tangle->qureg );
-    signal = quantum_bmeasure( get_target(qubit), get_qureg( qubit ) );
-
-    // this should be performed, wtf
-    /* quantum_hadamard( get_target(qubit), get_qureg( qubit ) ); */
-    /* quantum_phase_kick( get_target(qubit), angle, get_qureg( qubit ) ); */
-
-    //signal = quantum_diag_measure( get_target(qubit), angle, get_qureg(qubit) );
+  //printf("   measuring : \n"     );
+  // quantum_print_qureg( qubit.tangle->qureg );
+  start = profile_begin();
+  if( is_dense( qubit.tangle ) ) {
+    STATS_TOUCH( get_qureg( qubit ) );
+    *prob_zero = dense_prob_zero( get_target(qubit), qubit.tangle );
   }
+  else
+    *prob_zero = quantum_prob_zero( get_target(qubit), get_qureg( qubit ) );
+  profile_end( PROFILE_MEASURE, start );
+  return qubit.qid;
+}
 
+/* Second half of a measurement: projects the rotated qubit onto the signal,
+   records the signal and removes the qubit from qmem */
+void eval_M_collapse( const qid_t qid, 
+		      const int signal, 
+		      const double prob_zero, 
+		      qmem_t* qmem ) {
+  const qubit_t qubit = find_qubit( qid, qmem );
+  assert( !invalid(qubit) );
+  const pos_t top = get_qureg( qubit )->width - 1;
+
+  const unsigned long long start = profile_begin();
+  if( is_dense( qubit.tangle ) ) {
+    STATS_TOUCH( get_qureg( qubit ) );
+    dense_collapse( get_target(qubit), 
+		    signal, 
+		    signal ? 1.0 - prob_zero : prob_zero,
+		    qubit.tangle );
+  }
+  else
+    quantum_collapse( get_target(qubit), 
+		      signal, 
+		      signal ? 1.0 - prob_zero : prob_zero,
+		      get_qureg( qubit ) );
+  if( _truncation_enabled_ )
+    truncation_prune( qubit.tangle );
+  tangle_update_representation( qubit.tangle );
+  profile_end( PROFILE_MEASURE, start );
+
+  // the qubit on the top bit moved into the measured one
+  for( qid_list_t* cons = qubit.tangle->qids; cons; cons=cons->rest )
+    if( cons->bit == top && cons->qid != qid ) {
+      cons->bit = get_target(qubit);
+      break;
+    }
 
-  
+  // this should be performed, wtf
+  /* quantum_hadamard( get_target(qubit), get_qureg( qubit ) ); */
+  /* quantum_phase_kick( get_target(qubit), angle, get_qureg( qubit ) ); */
 
   /* printf("   result is %d\n",signal); */
   set_signal( qid, signal, &qmem->signal_map );
+  if( _pauli_frame_ )
+    frame_outcome( qid, signal, qmem );
 
   // remove measured qubit from memory
   delete_qubit( qubit, qmem );
 }
 
-
-void eval_X(sexp_t* exp, qmem_t* qmem) {
-  qid_t qid;
-  qubit_t qubit;
-  tangle_t* restrict tangle;
+void eval_M(sexp_t* exp, qmem_t* qmem) {
+  double angle;
+  double prob_zero;
+  int signal;
+  perfctr_sample_t counters;
   assert( qmem );
 
+  if( _alt_measure_ ) {
+    const qubit_t qubit = parse_measurement( exp, qmem, &angle );
+    const size_t amplitudes = tangle_amplitudes( qubit.tangle );
+    perfctr_begin( &counters );
+    const unsigned long long start = profile_begin();
+    STATS_TOUCH( get_qureg(qubit) );
+    if( is_dense( qubit.tangle ) )
+      signal = dense_diag_measure( get_target(qubit), angle, qubit.tangle );
+    else
+      signal = quantum_diag_measure( get_target(qubit), 
+				     angle,
+				     get_qureg(qubit) );
+    profile_end( PROFILE_MEASURE, start );
+    perfctr_end( PERFCTR_MEASURE, &counters, amplitudes );
+    // diag_measure shifts the bits above the measured one down
+    for( qid_list_t* cons = qubit.tangle->qids; cons; cons=cons->rest )
+      if( cons->bit > get_target(qubit) )
+	cons->bit -= 1;
+    set_signal( qubit.qid, signal, &qmem->signal_map );
+    if( _pauli_frame_ )
+      frame_outcome( qubit.qid, signal, qmem );
+    delete_qubit( qubit, qmem );
+    outcomes_log( signal );
+    return;
+  }
+  perfctr_begin( &counters );
+  const qid_t qid = eval_M_rotate( exp, qmem, &prob_zero );
+  // the rotated tangle, the amplitudes the collapse goes over
+  const size_t amplitudes = 
+    _perfctr_enabled_ ? tangle_amplitudes( find_qubit( qid, qmem ).tangle ) : 0;
+  // sampled, post-selected or replayed
+  signal = outcomes_next( qmem, qid, prob_zero );
+  eval_M_collapse( qid, signal, prob_zero, qmem );
+  perfctr_end( PERFCTR_MEASURE, &counters, amplitudes );
+  outcomes_log( signal );
+}
+
+
+/* the target of a correction, false if its signal does not hold */
+bool parse_correction( sexp_t* exp, const qmem_t* restrict qmem, qid_t* qid ) {
+  const char op = get_opname( exp );
+
   // move to the first argument
   exp = cdr(exp);
   if( !exp ) {
-    printf("X-correction did not have any target qubit argument\n");
+    printf("%c-correction did not have any target qubit argument\n", op);
     exit(EXIT_FAILURE);
   }
-  qid = get_qid( exp );
+  *qid = get_qid( exp );
 
   if( cdr(exp) ) { 
     if( _verbose_ )
       printf(" (signal was: %d)\n", satisfy_signals( cdr(exp), qmem ));
     // there is a signal argument, bail out early if not satisfied
     if( satisfy_signals( cdr(exp), qmem ) == 0)
-      return;
+      return false;
   }
+  return true;
+}
+
+void eval_X(sexp_t* exp, qmem_t* qmem) {
+  qid_t qid;
+  qubit_t qubit;
+  tangle_t* restrict tangle;
+  assert( qmem );
+
+  if( !parse_correction( exp, qmem, &qid ) )
+    return;
 
   qubit = find_qubit( qid, qmem );
   if( invalid(qubit) ) {
@@ -1048,7 +1533,10 @@ void eval_X(sexp_t* exp, qmem_t* qmem) {
     tangle = add_tangle( qid, qmem );
     qubit = find_qubit_in_tangle( qid, tangle );
   }
-  qop_x( qubit );
+  if( _pauli_frame_ )
+    frame_x( qid, qmem );
+  else
+    qop_x( qubit );
 }
 
 void eval_Z(sexp_t* exp, qmem_t* qmem) {
@@ -1057,21 +1545,8 @@ void eval_Z(sexp_t* exp, qmem_t* qmem) {
   tangle_t* restrict tangle;
   assert( qmem );
 
-  // move to the first argument
-  exp = cdr(exp);
-  if( !exp ) {
-    printf("Z-correction did not have any target qubit argument\n");
-    exit(EXIT_FAILURE);
-  }
-  qid = get_qid( exp );
-
-  if( cdr(exp) ) { 
-    // there is a signal argument, bail out early if not satisfied
-    if( _verbose_ )
-      printf(" (signal was: %d)\n", satisfy_signals( cdr(exp), qmem ));
-    if( satisfy_signals( cdr(exp), qmem ) == 0 )
-      return;
-  }
+  if( !parse_correction( exp, qmem, &qid ) )
+    return;
 
   qubit = find_qubit( qid, qmem );
   if( invalid(qubit) ) {
@@ -1079,25 +1554,25 @@ void eval_Z(sexp_t* exp, qmem_t* qmem) {
     tangle = add_tangle( qid, qmem );
     qubit = find_qubit_in_tangle( qid, tangle );
   }
-  qop_z( qubit );
+  if( _pauli_frame_ )
+    frame_z( qid, qmem );
+  else
+    qop_z( qubit );
 }
  
-// expects a list, evals the first argument and calls itself tail-recursively
-void eval( sexp_t* restrict exp, qmem_t* restrict qmem ) {
+/* evaluates the single command at the head of exp, 
+   returns false when the command is unknown */
+bool eval_command( sexp_t* restrict exp, qmem_t* restrict qmem ) {
   CSTRING* str = snew(0);
   sexp_t* command;
-  sexp_t* rest;
   char opname;
 
   assert( qmem );
+  assert( exp );
 
-  if( exp == NULL )
-    return;
-  
   //ensure_list( exp );
   if( exp->ty == SEXP_LIST ) {
     command = car(exp);
-    rest = cdr(exp);
     if( _verbose_ ) {
       print_sexp_cstr( &str, exp, STRING_SIZE );
       printf("evaluating %s\n", toCharPtr(str));
@@ -1106,7 +1581,6 @@ void eval( sexp_t* restrict exp, qmem_t* restrict qmem ) {
   else {
     assert( exp->ty == SEXP_VALUE );
     command = exp;
-    rest = NULL;
     sexp_t tmp_list = (sexp_t){SEXP_LIST, NULL, 0, 0, exp, NULL, 0,
 			       NULL, 0};
     //    print_sexp_cstr( &str, new_sexp_list(exp), STRING_SIZE );
@@ -1120,34 +1594,55 @@ void eval( sexp_t* restrict exp, qmem_t* restrict qmem ) {
 
   sdestroy( str );
     
+  const unsigned long long trace_start = trace_begin();
+  const unsigned long long start = profile_begin();
   switch ( opname ) {
   case 'E': 
     eval_E( command, qmem ); 
-    if( _verbose_ )
-      print_qmem(qmem);
-    eval( rest, qmem ); 
+    profile_end( PROFILE_E, start );
     break;
   case 'M': 
     eval_M( command, qmem ); 
-    if( _verbose_ )
-      print_qmem(qmem);
-    eval( rest, qmem ); 
+    profile_end( PROFILE_M, start );
     break;
   case 'X': 
     eval_X( command, qmem ); 
-    if( _verbose_ )
-      print_qmem(qmem);
-    eval( rest, qmem ); 
+    profile_end( PROFILE_X, start );
     break;
   case 'Z': 
     eval_Z( command, qmem );
-    if( _verbose_ )
-      print_qmem(qmem);
-    eval( rest, qmem ); 
+    profile_end( PROFILE_Z, start );
     break;
   default: 
     printf("unknown command: %c\n", opname);
+    return false;
+  }
+  if( _verbose_ ) {
+    frame_flush( qmem );
+    canonicalize_qmem( qmem );
+    print_qmem(qmem);
+  }
+  trace_command( command, qmem, trace_start );
+  qmem->pc += 1;
+  stats_command();
+  cold_sweep( qmem );
+  if( _memstats_enabled_ )
+    memstats_sample( qmem );
+  checkpoint_poll( qmem );
+  return true;
+}
+
+// expects a list, evals the first argument and calls itself tail-recursively
+void eval( sexp_t* restrict exp, qmem_t* restrict qmem ) {
+  if( exp == NULL )
+    return;
+  if( exp->ty == SEXP_VALUE ) { 
+    // the program is a single command, its arguments are not commands
+    eval_command( exp, qmem );
+    return;
   }
+  if( eval_command( exp, qmem ) )
+    eval( cdr(exp), qmem ); 
 }
 
 COMPLEX_FLOAT parse_complex( const char* str ) {
@@ -1199,6 +1694,7 @@ void parse_tangle( const sexp_t* exp, qmem_t* restrict qmem ) {
     qids=qids->next;
     append_qids( add_qid(get_qid(qids), NULL), tangle->qids );
   }
+  set_canonical_bits( tangle );
 
   quantum_reg* reg = &tangle->qureg;
   sexp_t* amp = amps_exp->list;
@@ -1209,6 +1705,35 @@ void parse_tangle( const sexp_t* exp, qmem_t* restrict qmem ) {
   } 
 }
 
+/* adds a tangle of the 2^width amplitudes, the first qid is the most
+   significant bit; the qids must not be in qmem yet */
+tangle_t* add_amplitudes_tangle( const qid_t* qids, 
+				 int width,
+				 const COMPLEX_FLOAT* amplitudes,
+				 qmem_t* restrict qmem ) {
+  const size_t states = (size_t)1 << width;
+  int size = 0;
+  for( size_t i=0; i<states; ++i )
+    size += amplitudes[i] != 0;
+
+  tangle_t* tangle = get_free_tangle( qmem );
+  qmem->size += 1;
+  tangle->size = width;
+  tangle->qureg = quantum_new_qureg_size( size, width );
+  tangle->qids = add_qid( qids[0], NULL );
+  for( int i=1; i<width; ++i )
+    append_qids( add_qid( qids[i], NULL ), tangle->qids );
+  set_canonical_bits( tangle );
+  quantum_reg* reg = &tangle->qureg;
+  for( size_t i=0, n=0; i<states; ++i )
+    if( amplitudes[i] != 0 ) {
+      reg->node[n].state = i;
+      reg->node[n].amplitude = amplitudes[i];
+      ++n;
+    }
+  return tangle;
+}
+
 const tangle_t* fetch_first_tangle( const qmem_t* restrict qmem ) {
 
   for(int i=0; i<MAX_TANGLES; ++i) {
@@ -1220,18 +1745,40 @@ const tangle_t* fetch_first_tangle( const qmem_t* restrict qmem ) {
 }
 
 
+/* the (basis amplitude) entries of write_output_state() for a dense
+   tangle, the occupied states in increasing order */
+static void write_dense_amplitudes( FILE* file,
+				    const tangle_t* restrict tangle ) {
+  const MAX_UNSIGNED states = (MAX_UNSIGNED) 1 << tangle->qureg.width;
+  const COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  bool first = true;
+  for( MAX_UNSIGNED block=0; block<states; block+=OOC_BLOCK ) {
+    const MAX_UNSIGNED end = states - block > OOC_BLOCK ?
+      block + OOC_BLOCK : states;
+    for( MAX_UNSIGNED i=block; i<end; ++i ) {
+      if( !(quantum_prob_inline( amplitudes[i] ) > DENSE_EPSILON) )
+	continue;
+      fprintf( file, "%s(%lli % .12g%+.12gi)", first ? "" : "\n  ", i,
+	       quantum_real( amplitudes[i] ), quantum_imag( amplitudes[i] ) );
+      first = false;
+    }
+    ooc_release( amplitudes, block * sizeof(COMPLEX_FLOAT),
+		 (end - block) * sizeof(COMPLEX_FLOAT) );
+  }
+}
+
 /* prints ONLY THE FIRST TANGLE in sexpr form to file, same format as input file, but
    also produces 0's */
 void 
-produce_output_file( const char* output_file, 
-		     const qmem_t* restrict qmem ) {
+write_output_state( FILE* file, 
+		    const qmem_t* restrict qmem ) {
   CSTRING* out = snew(STRING_SIZE); 
   char str[STRING_SIZE];
   //  int count=0;
   quantum_reg reg;
   const tangle_t* tangle = fetch_first_tangle(qmem);
   assert( tangle );
-  assert( output_file );
+  assert( file );
   saddch(out,'(');
   // print qids
   saddch(out, '(');
@@ -1248,6 +1795,14 @@ produce_output_file( const char* output_file,
 
   // print (basis amplitude)
   saddch(out, '(');
+  if( is_dense( tangle ) ) {
+    // straight from the amplitudes, without holding all the text at once
+    fputs(toCharPtr(out), file);
+    sdestroy(out);
+    write_dense_amplitudes( file, tangle );
+    fputs("))\n", file);
+    return;
+  }
   reg = tangle->qureg;
   for( int i=0; i<reg.size; ++i ) {
     sprintf(str,"(%lli ", reg.node[i].state);
@@ -1263,12 +1818,19 @@ produce_output_file( const char* output_file,
   saddch(out, ')');
   saddch(out, ')');
   saddch(out, '\n');
-  FILE* file = fopen(output_file, "w");
   fputs(toCharPtr(out), file);
-  fclose(file);
   sdestroy(out);
 }
 
+void 
+produce_output_file( const char* output_file, 
+		     const qmem_t* restrict qmem ) {
+  assert( output_file );
+  FILE* file = fopen(output_file, "w");
+  write_output_state( file, qmem );
+  fclose(file);
+}
+
 void initialize_input_state( const char* input_file, qmem_t* qmem ) {
   if( input_file == NULL )
     return;
@@ -1293,21 +1855,135 @@ void quantum_normalize( quantum_reg reg ) {
     }
 }
 
+void normalize_qmem( qmem_t* restrict qmem ) {
+  int tally=0;
+  tangle_t* tangle=NULL;
+  for( int t=0; tally<qmem->size; ++t ) {
+    tangle = qmem->tangles[t];
+    if( tangle ) {
+      const unsigned long long start = profile_begin();
+      canonicalize_tangle( tangle );
+      if( is_dense( tangle ) )
+	dense_normalize( tangle );
+      else
+	quantum_normalize( tangle->qureg );
+      profile_end( PROFILE_NORMALIZE, start );
+      ++tally;
+    }
+  }
+}
+
+// the library build brings its own entry points, see libqvm.h
+#ifndef QVM_LIBRARY
+
+/* long-only options */
+enum {
+  OPT_SEED = 256,
+  OPT_CHECKPOINT_FILE,
+  OPT_RESUME,
+  OPT_SHOTS,
+  OPT_ENUMERATE,
+  OPT_POSTSELECT,
+  OPT_REPLAY,
+  OPT_RECORD,
+  OPT_STATS,
+  OPT_PROFILE,
+  OPT_TRACE,
+  OPT_MEMSTATS,
+  OPT_PERFCTR,
+  OPT_GENERATE,
+  OPT_EMIT,
+  OPT_DENSE,
+  OPT_TRUNCATE,
+  OPT_NO_PAULI_FRAME,
+  OPT_SHORTEN_WIRES,
+  OPT_SERVE,
+  OPT_BATCH,
+  OPT_MPS,
+  OPT_OUT_OF_CORE,
+  OPT_COMPRESS,
+  OPT_NUMA,
+  OPT_HUGE_PAGES,
+  OPT_THREADS
+};
+
+static const struct option _long_options_[] = {
+  {"interactive",      no_argument,       NULL, 'i'},
+  {"silent",           no_argument,       NULL, 's'},
+  {"verbose",          no_argument,       NULL, 'v'},
+  {"checkpoint-every", required_argument, NULL, 'c'},
+  {"checkpoint-file",  required_argument, NULL, OPT_CHECKPOINT_FILE},
+  {"resume",           required_argument, NULL, OPT_RESUME},
+  {"seed",             required_argument, NULL, OPT_SEED},
+  {"shots",            required_argument, NULL, OPT_SHOTS},
+  {"enumerate",        optional_argument, NULL, OPT_ENUMERATE},
+  {"postselect",       required_argument, NULL, OPT_POSTSELECT},
+  {"replay",           required_argument, NULL, OPT_REPLAY},
+  {"record",           required_argument, NULL, OPT_RECORD},
+  {"stats",            required_argument, NULL, OPT_STATS},
+  {"profile",          required_argument, NULL, OPT_PROFILE},
+  {"trace",            required_argument, NULL, OPT_TRACE},
+  {"memstats",         no_argument,       NULL, OPT_MEMSTATS},
+  {"perfctr",          no_argument,       NULL, OPT_PERFCTR},
+  {"generate",         required_argument, NULL, OPT_GENERATE},
+  {"emit",             no_argument,       NULL, OPT_EMIT},
+  {"dense",            required_argument, NULL, OPT_DENSE},
+  {"truncate",         required_argument, NULL, OPT_TRUNCATE},
+  {"no-pauli-frame",   no_argument,       NULL, OPT_NO_PAULI_FRAME},
+  {"shorten-wires",    no_argument,       NULL, OPT_SHORTEN_WIRES},
+  {"serve",            required_argument, NULL, OPT_SERVE},
+  {"batch",            no_argument,       NULL, OPT_BATCH},
+  {"mps",              optional_argument, NULL, OPT_MPS},
+  {"out-of-core",      required_argument, NULL, OPT_OUT_OF_CORE},
+  {"compress",         optional_argument, NULL, OPT_COMPRESS},
+  {"numa",             required_argument, NULL, OPT_NUMA},
+  {"huge-pages",       optional_argument, NULL, OPT_HUGE_PAGES},
+  {"threads",          required_argument, NULL, OPT_THREADS},
+  {"jobs",             required_argument, NULL, 'j'},
+  {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char* argv[]) {
   sexp_iowrap_t* input_port;
   sexp_t* mc_program;
-  qmem_t* restrict qmem = init_qmem();
+  qmem_t* restrict qmem;
   CSTRING* str = snew( 0 );
 
   int interactive = 0;
   int silent = 0;
   char* output_file = NULL;
+  char* checkpoint_file = "qvm.ckpt";
+  char* resume_file = NULL;
+  char* stats_file = NULL;
+  char* profile_file = NULL;
+  char* trace_file = NULL;
+  bool memstats = false;
+  bool perfctr = false;
+  char* generate = NULL;
+  char* pattern = NULL;
+  bool emit = false;
+  bool shorten = false;
+  char* serve = NULL;
+  bool batch = false;
+  size_t checkpoint_every = 0;
+  size_t shots = 0;
+  size_t jobs = 0;
+  bool enumerate = false;
+  double enumerate_threshold = 1e-12;
+  bool seeded = false;
+  unsigned long long seed = 0;
   int program_fd;
   int c;
      
+#ifdef QVM_MPI
+  distributed_init( &argc, &argv );
+#endif
+  init_prototypes();
+  qmem = init_qmem();
   opterr = 0;
     
-  while ((c = getopt (argc, argv, "isvmf:o::")) != -1)
+  while ((c = getopt_long (argc, argv, "isvmf:o::c:j:", 
+			   _long_options_, NULL)) != -1)
     switch (c)
       {
       case 'i':
@@ -1328,13 +2004,110 @@ int main(int argc, char* argv[]) {
       case 'o':
 	output_file = optarg;
 	break;
+      case 'c':
+	checkpoint_every = strtoul(optarg, NULL, 10);
+	break;
+      case OPT_CHECKPOINT_FILE:
+	checkpoint_file = optarg;
+	break;
+      case OPT_RESUME:
+	resume_file = optarg;
+	break;
+      case OPT_SHOTS:
+	shots = strtoul(optarg, NULL, 10);
+	break;
+      case OPT_ENUMERATE:
+	enumerate = true;
+	if( optarg )
+	  enumerate_threshold = strtod(optarg, NULL);
+	break;
+      case OPT_POSTSELECT:
+	if( strcmp( optarg, "0" ) != 0 && strcmp( optarg, "1" ) != 0 ) {
+	  printf("ERROR: --postselect expects 0 or 1, got '%s'\n", optarg);
+	  exit(EXIT_FAILURE);
+	}
+	outcomes_postselect( optarg[0] - '0' );
+	break;
+      case OPT_REPLAY:
+	outcomes_replay( optarg );
+	break;
+      case OPT_RECORD:
+	outcomes_record( optarg );
+	break;
+      case OPT_STATS:
+	stats_file = optarg;
+	break;
+      case OPT_PROFILE:
+	profile_file = optarg;
+	break;
+      case OPT_TRACE:
+	trace_file = optarg;
+	break;
+      case OPT_MEMSTATS:
+	memstats = true;
+	break;
+      case OPT_PERFCTR:
+	perfctr = true;
+	break;
+      case OPT_GENERATE:
+	generate = optarg;
+	break;
+      case OPT_EMIT:
+	emit = true;
+	break;
+      case OPT_DENSE:
+	dense_configure( optarg );
+	break;
+      case OPT_TRUNCATE:
+	truncation_configure( optarg );
+	break;
+      case OPT_NO_PAULI_FRAME:
+	_pauli_frame_ = false;
+	break;
+      case OPT_SHORTEN_WIRES:
+	shorten = true;
+	break;
+      case OPT_SERVE:
+	serve = optarg;
+	break;
+      case OPT_BATCH:
+	batch = true;
+	break;
+      case OPT_MPS:
+	mps_configure( optarg );
+	break;
+      case OPT_OUT_OF_CORE:
+	ooc_configure( optarg );
+	break;
+      case OPT_COMPRESS:
+	cold_configure( optarg ? optarg : "" );
+	break;
+      case OPT_NUMA:
+	placement_configure_numa( optarg );
+	break;
+      case OPT_HUGE_PAGES:
+	placement_configure_pages( optarg ? optarg : "transparent" );
+	break;
+      case OPT_THREADS:
+	dense_configure_threads( optarg );
+	break;
+      case 'j':
+	jobs = strtoul(optarg, NULL, 10);
+	break;
+      case OPT_SEED:
+	seeded = true;
+	seed = strtoull(optarg, NULL, 10);
+	break;
       case '?':
-	if (optopt == 'f')
+	if (optopt == 'f' || optopt == 'c' || optopt == 'j')
 	  fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 	else if (optopt == 'o') {
 	  output_file = "out";
 	  break;
 	}
+	else if (optopt == 0 || optopt >= OPT_SEED)
+	  fprintf (stderr, "Unknown or incomplete option `%s'.\n", 
+		   argv[optind-1]);
 	else if (isprint (optopt))
 	  fprintf (stderr, "Unknown option `-%c'.\n", optopt);
 	else
@@ -1346,18 +2119,125 @@ int main(int argc, char* argv[]) {
 	abort ();
       }
      
-  //  
+  // libquantum's diag_measure samples on its own
+  if( _alt_measure_ && (outcomes_forced() || outcomes_recording()) ) {
+    printf("WARNING: -m is not available with --postselect, --replay or "
+	   "--record\n");
+    _alt_measure_ = 0;
+  }
+  // the checkpoint brings its own quantum memory
+  if( resume_file && qmem->size ) {
+    printf("ERROR: --resume restores the state of the checkpoint and can't "
+	   "take an input state (-f)\n");
+    exit(EXIT_FAILURE);
+  }
+  if( seeded )
+    qmem->rng = seed;
+#ifdef QVM_MPI
+  // the ranks evaluate one pattern together, rank 0 speaks for them
+  if( serve || batch || interactive || shots || enumerate || resume_file ||
+      checkpoint_every || emit || _mps_enabled_ ) {
+    if( _rank_ == 0 )
+      printf("ERROR: qvm-mpi evaluates single patterns, without --serve, "
+	     "--batch, -i, --shots, --enumerate, --emit, --mps or "
+	     "checkpointing\n");
+    distributed_finish();
+    return EXIT_FAILURE;
+  }
+  if( _rank_ != 0 ) {
+    silent = 1;
+    output_file = NULL;
+    stats_file = profile_file = trace_file = NULL;
+    memstats = perfctr = false;
+    outcomes_record( NULL );
+  }
+#endif
+  // the workers of -j already keep every CPU busy
+  if( (serve || batch || shots || enumerate) && _dense_threads_ == 0 )
+    _dense_threads_ = 1;
+  if( serve ) {
+    if( interactive || shots || enumerate || resume_file || checkpoint_every ||
+	stats_file || profile_file || trace_file || memstats || perfctr ||
+	generate || outcomes_forced() || outcomes_recording() || qmem->size )
+      printf("WARNING: --serve only takes --seed, --dense, --truncate, "
+	     "--shorten-wires, --no-pauli-frame, -m, -v and -j\n");
+    server_run( serve, jobs, shorten, seeded, seed );
+    sdestroy( str );
+    free_qmem( qmem );
+    free_prototypes();
+    return 0;
+  }
+  if( batch ) {
+    if( interactive || shots || enumerate || resume_file || checkpoint_every ||
+	stats_file || profile_file || trace_file || memstats || perfctr ||
+	generate || outcomes_forced() || outcomes_recording() )
+      printf("WARNING: --batch only takes --seed, --dense, --truncate, "
+	     "--shorten-wires, --no-pauli-frame, -f, -m, -v and -j\n");
+    const size_t failed = batch_run( argv + optind, argc - optind, qmem,
+				     jobs, shorten, seeded, seed );
+    sdestroy( str );
+    free_qmem( qmem );
+    free_prototypes();
+    return failed ? EXIT_FAILURE : 0;
+  }
+  // the enumeration threads would race on the counters
+  if( stats_file && enumerate )
+    printf("WARNING: --stats is not available with --enumerate\n");
+  else if( stats_file )
+    stats_init();
+  if( profile_file && enumerate )
+    printf("WARNING: --profile is not available with --enumerate\n");
+  else if( profile_file )
+    profile_init();
+  if( trace_file && (enumerate || shots) )
+    printf("WARNING: --trace only covers plain runs\n");
+  else if( trace_file )
+    trace_init( trace_file );
+  // shots run in forked children and enumeration takes both outcomes,
+  // neither leaves one sequence of outcomes to record
+  if( outcomes_recording() && (enumerate || shots) ) {
+    printf("WARNING: --record is not available with --enumerate or --shots\n");
+    outcomes_record( NULL );
+  }
+  if( memstats && enumerate )
+    printf("WARNING: --memstats is not available with --enumerate\n");
+  else if( memstats )
+    memstats_init();
+  // counters are per thread, enumeration workers would not be counted
+  if( perfctr && enumerate )
+    printf("WARNING: --perfctr is not available with --enumerate\n");
+  else if( perfctr ) {
+    // nor would the product threads, keep the dense kernels on this one
+    if( _dense_threads_ > 1 )
+      printf("WARNING: --perfctr runs the dense products on one thread\n");
+    _dense_threads_ = 1;
+    perfctr_init();
+  }
+  // the error bound is per run, branches would share it
+  if( _truncation_enabled_ && enumerate ) {
+    printf("WARNING: --truncate is not available with --enumerate\n");
+    _truncation_enabled_ = false;
+    _truncation_epsilon_ = TRUNCATION_DEFAULT_EPSILON;
+  }
 
-  if (_verbose_) {
-    printf("Initial QMEM:\n ");
-    print_qmem( qmem );
+  // the chain has no branches to share and no checkpoint format
+  if( _mps_enabled_ && (interactive || enumerate || shots ||
+			checkpoint_every || resume_file) ) {
+    printf("WARNING: --mps is not available with --interactive, --enumerate, "
+	   "--shots or checkpointing\n");
+    _mps_enabled_ = false;
   }
+
   if( interactive ) {
     printf("Starting QVM in interactive mode.\n qvm> ");
+    if( checkpoint_every || resume_file )
+      printf("WARNING: checkpointing is not available in interactive mode\n");
     input_port = init_iowrap( 0 );  // we are going to read from stdin
     mc_program = read_one_sexp( input_port );
     while( mc_program ) {
       eval( mc_program->list, qmem );
+      frame_flush( qmem );
+      canonicalize_qmem( qmem );
       print_qmem( qmem );
       printf("\n qvm> ");
       destroy_sexp( mc_program );
@@ -1365,15 +2245,33 @@ int main(int argc, char* argv[]) {
     }
   }
   else {
-    // read input program
-    program_fd = 
-      optind < argc ?                // did the user pass a non-option argument?
-      open(argv[optind], O_RDONLY) : // open the file
-      0;                             // otherwise, use stdin
-    input_port = init_iowrap( program_fd );
-    mc_program = read_one_sexp( input_port );
-    if( program_fd )
-      close( program_fd );
+    const unsigned long long parse_start = profile_begin();
+    if( generate ) {
+      // random angles come from the measurement RNG, --seed fixes them too
+      pattern = generate_pattern( generate, qmem_rand( qmem ) );
+      if( emit ) {
+	fputs( pattern, stdout );
+	free( pattern );
+	free_qmem( qmem );
+	free_prototypes();
+	return 0;
+      }
+      input_port = NULL;
+      mc_program = parse_sexp( pattern, strlen( pattern ) );
+    }
+    else {
+      // read input program
+      program_fd = 
+	optind < argc ?                // did the user pass a non-option argument?
+	open(argv[optind], O_RDONLY) : // open the file
+	0;                             // otherwise, use stdin
+      input_port = init_iowrap( program_fd );
+      mc_program = read_one_sexp( input_port );
+      if( program_fd )
+	close( program_fd );
+    }
+    profile_end( PROFILE_PARSE, parse_start );
+    memstats_program( mc_program );
     
     if (!silent) {
       print_sexp_cstr( &str, mc_program, STRING_SIZE );
@@ -1381,21 +2279,57 @@ int main(int argc, char* argv[]) {
     }
     // emit dot file
     /* sexp_to_dotfile( mc_program->list, "mc_program.dot" ); */
-    
-    eval( mc_program->list, qmem );
+    if( shorten )
+      shorten_wires( mc_program, qmem, silent );
+
+    const unsigned long long program_hash = checkpoint_program_hash( mc_program );
+    sexp_t* start = mc_program->list;
+    if( resume_file ) {
+      free_qmem( qmem );
+      qmem = checkpoint_load( resume_file, program_hash );
+      if( seeded ) // a fresh seed lets many runs share one deterministic prefix
+	qmem->rng = seed;
+      for( size_t i=0; start && i<qmem->pc; ++i ) {
+	if( start->ty == SEXP_LIST && get_opname( car(start) ) == 'M' )
+	  outcomes_skip( 1 );
+	start = cdr(start);
+      }
+      if( !silent )
+	printf("Resuming from %s after %lu commands\n", 
+	       resume_file, (unsigned long)qmem->pc);
+    }
+    memstats_phase( MEMSTATS_EVAL );
+    if( enumerate && outcomes_forced() )
+      printf("WARNING: forced outcomes are ignored when enumerating\n");
+    else if( shots && outcomes_forced() )
+      printf("WARNING: forced outcomes make every shot take the same path\n");
+    if( enumerate ) {
+      enumerate_run( start, qmem, enumerate_threshold, jobs );
+      goto cleanup;
+    }
+    if( shots ) {
+      shots_run( start, qmem, shots, jobs );
+      goto cleanup;
+    }
+    checkpoint_init( checkpoint_file, checkpoint_every, program_hash );
+
+#ifdef QVM_MPI
+    distributed_run( start, qmem );
+#else
+    if( mps_wanted( start, qmem, silent ) )
+      mps_run( start, qmem );
+    else
+      eval( start, qmem );
+#endif
+    checkpoint_finish();
   }
 
   //normalize at the end, not during measurement
+  memstats_phase( MEMSTATS_OUTPUT );
+  // corrections left on the output qubits
+  frame_flush( qmem );
 
-  int tally=0;
-  tangle_t* tangle=NULL;
-  for( int t=0; tally<qmem->size; ++t ) {
-    tangle = qmem->tangles[t];
-    if( tangle ) {
-      quantum_normalize( tangle->qureg );
-      ++tally;
-    }
-  }
+  normalize_qmem( qmem );
   
   if (!silent) {
     printf("Resulting quantum memory is:\n");
@@ -1406,12 +2340,40 @@ int main(int argc, char* argv[]) {
     produce_output_file(output_file, qmem);
   }
   
-  destroy_iowrap( input_port );
+ cleanup:
+  if( stats_file )
+    stats_write( stats_file, 
+		 generate ? generate : optind < argc ? argv[optind] : NULL );
+  if( profile_file )
+    profile_write( profile_file );
+  trace_finish();
+  // interactive sessions record across all their programs
+  outcomes_finish();
+  memstats_print();
+  perfctr_print();
+  truncation_print();
+  mps_print();
+  cold_print();
+  placement_print();
+#ifdef QVM_MPI
+  distributed_print();
+  // every rank maps its own part, rank 0 speaks for them
+  if( _rank_ == 0 )
+#endif
+  ooc_print();
+  if( input_port )
+    destroy_iowrap( input_port );
   sdestroy( str );
   destroy_sexp( mc_program );
+  free( pattern );
   sexp_cleanup();
   free_qmem( qmem );
+  free_prototypes();
+#ifdef QVM_MPI
+  distributed_finish();
+#endif
   return 0;
 
 }
 
+#endif
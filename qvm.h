@@ -1,19 +1,157 @@
 #ifndef QVM_H
 #define QVM_H
 
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+
 #include "libquantum/complex.h"
 #include "libquantum/error.h"
 #include <quantum.h>
+#include <sexp.h>
+
+#include "bitmask.h"
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
-#endif 
+#endif
+
+#define MAX_TANGLES (size_t)SHRT_MAX
+#define MAX_QUBITS  (size_t)SHRT_MAX
 
 extern void quantum_copy_qureg(quantum_reg *src, quantum_reg *dst);
 extern void quantum_delete_qureg_hashpreserve(quantum_reg *reg);
+extern unsigned long quantum_memman(long change);
 
 typedef int qid_t;
 typedef int tangle_size_t;
 typedef int pos_t;
 
+typedef struct qid_list {
+  qid_t qid;
+  pos_t bit;  // physical bit of the qubit in the tangle's qureg
+  struct qid_list* rest;
+} qid_list_t;
+
+typedef struct tangle {
+  tangle_size_t size;
+  qid_list_t* qids;
+  quantum_reg qureg;          // only the width is used when dense
+  COMPLEX_FLOAT* amplitudes;  // dense: 2^width amplitudes, else NULL
+  size_t occupied;            // dense: non-negligible amplitudes
+  size_t touched;             // qmem->pc of the last lookup
+  struct cold* cold;          // compressed amplitudes, see cold.h
+ } tangle_t;
+
+typedef struct qubit {
+  tangle_t* tangle;
+  qid_t qid;
+  pos_t pos;  // logical position in the qid list
+  pos_t bit;  // physical bit, see get_target()
+} qubit_t;
+
+typedef struct signal_map {
+  // two bitfields
+  //  entries : if qid has an entry, not needed for correct programs
+  //  signals : value of the signal
+  unsigned char entries[BITNSLOTS(MAX_QUBITS)];
+  unsigned char signals[BITNSLOTS(MAX_QUBITS)];
+} signal_map_t;
+
+typedef struct pauli_frame {
+  // the pending X and Z corrections of every qid, see frame.h
+  unsigned char x[BITNSLOTS(MAX_QUBITS)];
+  unsigned char z[BITNSLOTS(MAX_QUBITS)];
+  double phase;  // global phase picked up by reordering the Paulis
+} pauli_frame_t;
+
+typedef struct qmem {
+  size_t size;
+  size_t pc;               // number of commands evaluated so far
+  unsigned long long rng;  // measurement RNG state, see qmem_rand()
+  signal_map_t signal_map;
+  pauli_frame_t frame;
+  tangle_t* tangles[MAX_TANGLES];
+} qmem_t;
+
+extern int _verbose_;
+
+tangle_t* init_tangle();
+void free_tangle( tangle_t* tangle );
+qid_list_t* add_qid( const qid_t qid, qid_list_t* restrict qids );
+void append_qids( qid_list_t* new_qids, qid_list_t* target_qids );
+void set_canonical_bits( tangle_t* restrict tangle );
+void canonicalize_tangle( tangle_t* restrict tangle );
+void canonicalize_qmem( qmem_t* restrict qmem );
+
+void init_prototypes();
+void free_prototypes();
+qmem_t* init_qmem();
+qmem_t* clone_qmem( const qmem_t* restrict qmem );
+void free_qmem( qmem_t* qmem );
+void print_tangle( const tangle_t* restrict tangle );
+void print_qmem( const qmem_t* restrict qmem );
+unsigned long long qmem_rand( qmem_t* restrict qmem );
+double qmem_uniform( qmem_t* restrict qmem );
+char* signal_outcome_string( const signal_map_t* restrict signal_map );
+qubit_t find_qubit( const qid_t qid, const qmem_t* restrict qmem );
+void set_signal( const qid_t qid, 
+		 const bool signal, 
+		 signal_map_t* restrict signal_map );
+
+double quantum_prob_zero( int target, const quantum_reg* restrict reg );
+void quantum_collapse( int target, int value, double prob, 
+		       quantum_reg* restrict reg );
+
+void qop_x( const qubit_t qubit );
+void qop_z( const qubit_t qubit );
+
+char get_opname( sexp_t* exp );
+qid_t eval_M_rotate( sexp_t* exp, qmem_t* qmem, double* prob_zero );
+void eval_M_collapse( const qid_t qid, 
+		      const int signal, 
+		      const double prob_zero, 
+		      qmem_t* qmem );
+bool eval_command( sexp_t* restrict exp, qmem_t* restrict qmem );
+void eval( sexp_t* restrict exp, qmem_t* restrict qmem );
+
+extern int _alt_measure_;
+
+bool invalid( const qubit_t qubit );
+tangle_t* get_free_tangle( qmem_t* qmem );
+int get_qid( sexp_t* exp );
+double parse_angle( const sexp_t* exp );
+// asks for unknown angle constants before evaluation
+void resolve_angle_constants( const sexp_t* program );
+bool satisfy_signals( const sexp_t* restrict exp, 
+		      const qmem_t* restrict qmem );
+// the arguments of M, X and Z commands, for evaluators besides eval
+qid_t parse_measurement_angle( sexp_t* exp, 
+			       const qmem_t* restrict qmem, 
+			       double* angle );
+bool parse_correction( sexp_t* exp, const qmem_t* restrict qmem, qid_t* qid );
+
+void parse_tangle( const sexp_t* exp, qmem_t* restrict qmem );
+tangle_t* add_amplitudes_tangle( const qid_t* qids, 
+				 int width,
+				 const COMPLEX_FLOAT* amplitudes,
+				 qmem_t* restrict qmem );
+// canonical order and normalized amplitudes for output
+void normalize_qmem( qmem_t* restrict qmem );
+const tangle_t* fetch_first_tangle( const qmem_t* restrict qmem );
+void write_output_state( FILE* file, const qmem_t* restrict qmem );
+
+#ifdef QVM_LIBRARY
+// errors return to the libqvm call instead of ending the process
+void qvm_exit( int status ) __attribute__((noreturn));
+#define exit( status ) qvm_exit( status )
+#endif
+
+#ifdef QVM_MPI
+// errors MPI_Abort() every rank, see distributed.c
+void qvm_mpi_exit( int status ) __attribute__((noreturn));
+#define exit( status ) qvm_mpi_exit( status )
+#endif
+
 #endif
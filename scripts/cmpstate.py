@@ -0,0 +1,53 @@
+#!/usr/bin/env python
+##
+##  cmpstate.py - compares two output files of qvm -o
+##
+##  usage: cmpstate.py a.out b.out [min_fidelity]
+##
+##  The files may list their qids in different orders, the basis states
+##  are permuted into sorted qid order before the overlap is taken.  Prints
+##  the fidelity and exits with 1 when the qids differ or the fidelity is
+##  below min_fidelity (default 0.999).
+##
+
+import re
+import sys
+
+NUMBER = r'[-+ ]?\d+(?:\.\d*)?(?:e[-+]?\d+)?'
+
+def load(name):
+  text = open(name).read()
+  head = re.match(r'\s*\(\s*\(([\d\s]*)\)', text)
+  if head is None:
+    sys.exit("ERROR: %s is not a qvm output file" % name)
+  qids = [int(q) for q in head.group(1).split()]
+  order = sorted(range(len(qids)), key=lambda i: qids[i])
+  width = len(qids)
+  state = {}
+  for basis, real, imag in re.findall(r'\((\d+)\s+(' + NUMBER + ')(' +
+                                      NUMBER + r')i\)', text[head.end():]):
+    basis = int(basis)
+    # the first qid is the most significant bit
+    canonical = 0
+    for i in order:
+      canonical = (canonical << 1) | ((basis >> (width - 1 - i)) & 1)
+    state[canonical] = complex(float(real), float(imag))
+  return sorted(qids), state
+
+def main(argv):
+  if len(argv) < 3:
+    sys.exit("usage: cmpstate.py a.out b.out [min_fidelity]")
+  qids_a, a = load(argv[1])
+  qids_b, b = load(argv[2])
+  if qids_a != qids_b:
+    print("qids differ: %s vs %s" % (qids_a, qids_b))
+    return 1
+  overlap = sum(a[k].conjugate() * b[k] for k in a if k in b)
+  norm_a = sum(abs(v) ** 2 for v in a.values())
+  norm_b = sum(abs(v) ** 2 for v in b.values())
+  fidelity = abs(overlap) ** 2 / (norm_a * norm_b) if norm_a and norm_b else 0
+  print("fidelity %.6f" % fidelity)
+  return 0 if fidelity >= float(argv[3] if len(argv) > 3 else 0.999) else 1
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
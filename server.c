@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <sexp.h>
+
+#include "qvm.h"
+#include "server.h"
+#include "frame.h"
+#include "truncation.h"
+#include "wires.h"
+
+static volatile sig_atomic_t _stop_ = 0;
+
+static void stop_server( int signum ) {
+  (void)signum;
+  _stop_ = 1;
+}
+
+/* an input state starts with its list of qids, a program with a command */
+static bool is_state( const sexp_t* exp ) {
+  return exp->ty == SEXP_LIST && exp->list && exp->list->ty == SEXP_LIST &&
+    exp->list->list && exp->list->list->ty == SEXP_VALUE &&
+    isdigit( (unsigned char)exp->list->list->val[0] );
+}
+
+/* runs with stdout on the connection, an ERROR exits the worker */
+static void serve_request( int conn, bool shorten, bool seeded,
+			   unsigned long long seed, unsigned long long request ) {
+  qmem_t* restrict qmem = init_qmem();
+  qmem->rng = seeded ? seed :
+    qmem->rng ^ (unsigned long long)getpid() << 32 ^
+    request * 0x9e3779b97f4a7c15ULL;
+
+  sexp_iowrap_t* input_port = init_iowrap( conn );
+  sexp_t* state = read_one_sexp( input_port );
+  sexp_t* program = state ? read_one_sexp( input_port ) : NULL;
+  if( program == NULL ) {
+    program = state;
+    state = NULL;
+  }
+  if( program == NULL || program->ty != SEXP_LIST || is_state( program ) )
+    printf("ERROR: expected [input state] program\n");
+  else if( state && !is_state( state ) )
+    printf("ERROR: expected an input state before the program\n");
+  else {
+    if( state )
+      parse_tangle( state, qmem );
+    if( shorten )
+      shorten_wires( program, qmem, true );
+    truncation_reset();
+    eval( program->list, qmem );
+    frame_flush( qmem );
+    normalize_qmem( qmem );
+    if( fetch_first_tangle( qmem ) )
+      write_output_state( stdout, qmem );
+    else
+      printf("()\n");  // every qubit was measured
+  }
+  destroy_sexp( state );
+  destroy_sexp( program );
+  destroy_iowrap( input_port );
+  free_qmem( qmem );
+}
+
+static void worker( int listener, bool shorten, bool seeded,
+		    unsigned long long seed ) {
+  const struct timeval timeout = { SERVER_READ_TIMEOUT, 0 };
+  const int saved_stdout = dup( STDOUT_FILENO );
+
+  signal( SIGINT, SIG_DFL );
+  signal( SIGTERM, SIG_DFL );
+  // unknown angle constants must not wait for the server's terminal
+  if( freopen( "/dev/null", "r", stdin ) == NULL )
+    _exit(EXIT_FAILURE);
+  unsigned long long request = 0;
+  while( request < SERVER_REQUESTS_PER_WORKER ) {
+    const int conn = accept( listener, NULL, NULL );
+    if( conn < 0 ) {
+      if( errno == EINTR || errno == ECONNABORTED )
+	continue;
+      perror("ERROR: accepting request");
+      _exit(EXIT_FAILURE);
+    }
+    // a client that never finishes its request does not hold the worker
+    setsockopt( conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    fflush( stdout );
+    dup2( conn, STDOUT_FILENO );
+    serve_request( conn, shorten, seeded, seed, request++ );
+    fflush( stdout );
+    dup2( saved_stdout, STDOUT_FILENO );
+    close( conn );
+  }
+  _exit(EXIT_SUCCESS);
+}
+
+static pid_t start_worker( int listener, bool shorten, bool seeded,
+			   unsigned long long seed ) {
+  fflush( stdout );
+  const pid_t pid = fork();
+  if( pid < 0 ) {
+    perror("ERROR: forking server worker");
+    exit(EXIT_FAILURE);
+  }
+  if( pid == 0 )
+    worker( listener, shorten, seeded, seed );
+  return pid;
+}
+
+void server_run( const char* path,
+		 size_t jobs,
+		 bool shorten,
+		 bool seeded,
+		 unsigned long long seed ) {
+  struct sockaddr_un address;
+  struct sigaction action;
+  struct stat st;
+  int status;
+
+  if( jobs == 0 ) {
+    const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    jobs = cpus > 0 ? cpus : 1;
+  }
+  if( strlen( path ) >= sizeof(address.sun_path) ) {
+    printf("ERROR: socket path '%s' is too long\n", path);
+    exit(EXIT_FAILURE);
+  }
+  memset( &address, 0, sizeof(address) );
+  address.sun_family = AF_UNIX;
+  strcpy( address.sun_path, path );
+  // a socket left behind by a server that was killed
+  if( stat( path, &st ) == 0 && S_ISSOCK(st.st_mode) )
+    unlink( path );
+  const int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if( listener < 0 ||
+      bind( listener, (struct sockaddr*)&address, sizeof(address) ) != 0 ||
+      listen( listener, SOMAXCONN ) != 0 ) {
+    perror("ERROR: creating server socket");
+    exit(EXIT_FAILURE);
+  }
+
+  // no SA_RESTART, a signal interrupts waitpid
+  memset( &action, 0, sizeof(action) );
+  action.sa_handler = stop_server;
+  sigemptyset( &action.sa_mask );
+  sigaction( SIGINT, &action, NULL );
+  sigaction( SIGTERM, &action, NULL );
+  // clients that hang up early make writes fail instead of killing workers
+  signal( SIGPIPE, SIG_IGN );
+
+  pid_t* workers = calloc( jobs, sizeof(pid_t) );
+  for( size_t j=0; j<jobs; ++j )
+    workers[j] = start_worker( listener, shorten, seeded, seed );
+  printf("serving on %s with %lu workers\n", path, (unsigned long)jobs);
+  fflush( stdout );
+
+  while( !_stop_ ) {
+    const pid_t pid = waitpid( -1, &status, 0 );
+    if( pid < 0 ) {
+      if( errno == EINTR )
+	continue;
+      perror("ERROR: waiting for server worker");
+      break;
+    }
+    for( size_t j=0; j<jobs; ++j ) {
+      if( workers[j] != pid )
+	continue;
+      if( !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS )
+	printf("WARNING: server worker %d failed, replacing it\n", (int)pid);
+      workers[j] = _stop_ ? 0 :
+	start_worker( listener, shorten, seeded, seed );
+      break;
+    }
+  }
+
+  for( size_t j=0; j<jobs; ++j )
+    if( workers[j] > 0 )
+      kill( workers[j], SIGTERM );
+  for( size_t j=0; j<jobs; ++j )
+    if( workers[j] > 0 )
+      waitpid( workers[j], &status, 0 );
+  close( listener );
+  unlink( path );
+  printf("server on %s stopped\n", path);
+  free( workers );
+}
@@ -0,0 +1,27 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "qvm.h"
+
+/* Server mode (--serve=path).
+   Listens on a Unix domain socket and keeps a pool of forked workers that
+   accept the connections, the prototypes and libsexp are set up once per
+   worker instead of once per job.  A request is an optional input state,
+   in the format of -f, followed by a program; the client shuts down its
+   side of the connection when it is done sending.  Every request gets a
+   fresh qmem and is answered with its output state in the format of -o,
+   or with an ERROR line.  A worker that exits on an error is replaced, as
+   is every worker after SERVER_REQUESTS_PER_WORKER requests. */
+
+#define SERVER_REQUESTS_PER_WORKER 10000
+#define SERVER_READ_TIMEOUT 30  // seconds
+
+// jobs == 0 starts one worker per online CPU, a seed is used for every
+// request
+void server_run( const char* path,
+		 size_t jobs,
+		 bool shorten,
+		 bool seeded,
+		 unsigned long long seed );
+
+#endif
@@ -0,0 +1,157 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <sexp.h>
+#include <sexp_ops.h>
+
+#include "qvm.h"
+#include "shots.h"
+
+typedef struct shot {
+  pid_t pid;
+  int fd;   // read end of the pipe the child reports its signal map on
+} shot_t;
+
+static void read_signal_map( int fd, signal_map_t* restrict signal_map ) {
+  char* buffer = (char*)signal_map;
+  size_t done = 0;
+  ssize_t bytes;
+  while( done < sizeof(signal_map_t) ) {
+    bytes = read( fd, buffer + done, sizeof(signal_map_t) - done );
+    if( bytes <= 0 )
+      break;
+    done += bytes;
+  }
+  if( done != sizeof(signal_map_t) )
+    memset( signal_map, 0, sizeof(signal_map_t) );
+}
+
+static int compare_outcomes( const void* a, const void* b ) {
+  return strcmp( *(char* const*)a, *(char* const*)b );
+}
+
+static void print_histogram( char** outcomes,
+			     size_t count,
+			     size_t failed,
+			     const signal_map_t* restrict first ) {
+  printf("outcomes over qids [");
+  for( int qid=0, tally=0 ; qid<MAX_QUBITS ; ++qid )
+    if( BITTEST(first->entries, qid) )
+      printf( tally++ ? ", %d" : "%d", qid );
+  printf("]:\n  {\n");
+  qsort( outcomes, count, sizeof(char*), compare_outcomes );
+  for( size_t i=0, run=1 ; i<count ; ++i, ++run )
+    if( i+1 == count || strcmp(outcomes[i], outcomes[i+1]) != 0 ) {
+      printf("   %s : %lu (%.6f)\n", outcomes[i], (unsigned long)run,
+	     (double)run / count);
+      run = 0;
+    }
+  printf("  }\n");
+  if( failed )
+    printf("WARNING: %lu shots failed\n", (unsigned long)failed);
+}
+
+void shots_run( sexp_t* program,
+		qmem_t* restrict qmem,
+		size_t shots,
+		size_t jobs ) {
+  sexp_t* suffix = program;
+  size_t prefix_length = 0;
+  int status;
+
+  assert( qmem );
+  if( jobs == 0 ) {
+    const long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    jobs = cpus > 0 ? cpus : 1;
+  }
+
+  // evaluate the deterministic prefix only once
+  while( suffix && suffix->ty == SEXP_LIST &&
+	 get_opname( hd_sexp(suffix) ) != 'M' ) {
+    if( !eval_command( suffix, qmem ) )
+      return;
+    suffix = next_sexp(suffix);
+    ++prefix_length;
+  }
+  printf("evaluated a prefix of %lu commands once, sampling %lu shots\n",
+	 (unsigned long)prefix_length, (unsigned long)shots);
+
+  shot_t* running = calloc( jobs, sizeof(shot_t) );
+  char** outcomes = calloc( shots, sizeof(char*) );
+  signal_map_t signal_map;
+  signal_map_t first = (signal_map_t){{0},{0}};
+  size_t launched = 0, finished = 0, failed = 0, active = 0;
+  int pipe_fds[2];
+
+  while( finished + failed < shots ) {
+    if( active < jobs && launched < shots ) {
+      // every shot gets its own stream from the parent RNG, reproducible
+      const unsigned long long shot_seed = qmem_rand( qmem );
+      if( pipe( pipe_fds ) != 0 ) {
+	perror("ERROR: creating pipe for shot");
+	exit(EXIT_FAILURE);
+      }
+      fflush( stdout );
+      const pid_t pid = fork();
+      if( pid < 0 ) {
+	perror("ERROR: forking shot");
+	exit(EXIT_FAILURE);
+      }
+      if( pid == 0 ) {
+	// the child owns a copy-on-write view of the prefix state
+	close( pipe_fds[0] );
+	qmem->rng = shot_seed;
+	eval( suffix, qmem );
+	if( write( pipe_fds[1], &qmem->signal_map, sizeof(signal_map_t) ) !=
+	    sizeof(signal_map_t) )
+	  _exit(EXIT_FAILURE);
+	_exit(EXIT_SUCCESS);
+      }
+      close( pipe_fds[1] );
+      for( size_t j=0; j<jobs; ++j )
+	if( running[j].pid == 0 ) {
+	  running[j] = (shot_t){ pid, pipe_fds[0] };
+	  break;
+	}
+      ++launched;
+      ++active;
+      continue;
+    }
+
+    // all job slots are busy, collect one shot
+    const pid_t pid = waitpid( -1, &status, 0 );
+    if( pid < 0 ) {
+      perror("ERROR: waiting for shot");
+      exit(EXIT_FAILURE);
+    }
+    for( size_t j=0; j<jobs; ++j ) {
+      if( running[j].pid != pid )
+	continue;
+      if( WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ) {
+	read_signal_map( running[j].fd, &signal_map );
+	if( finished == 0 )
+	  first = signal_map;
+	outcomes[finished++] = signal_outcome_string( &signal_map );
+      }
+      else
+	++failed;
+      close( running[j].fd );
+      running[j] = (shot_t){ 0, -1 };
+      --active;
+      break;
+    }
+  }
+
+  print_histogram( outcomes, finished, failed, &first );
+  for( size_t i=0; i<finished; ++i )
+    free( outcomes[i] );
+  free( outcomes );
+  free( running );
+}
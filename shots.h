@@ -0,0 +1,19 @@
+#ifndef SHOTS_H
+#define SHOTS_H
+
+#include "qvm.h"
+
+/* Multi-shot sampling.
+   Everything up to the first measurement of a pattern is deterministic, so
+   it is evaluated once.  Every shot is then a fork() of that state: the
+   children share the prefix' amplitude arrays copy-on-write and only pay
+   for the stochastic suffix.  The outcome histogram over the signal map is
+   printed when all shots are done. */
+
+// jobs == 0 runs one shot per online CPU at a time
+void shots_run( sexp_t* program, 
+		qmem_t* restrict qmem, 
+		size_t shots, 
+		size_t jobs );
+
+#endif
@@ -0,0 +1,91 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "qvm.h"
+#include "stats.h"
+
+// bump when fields change, bench.sh relies on the names
+#define STATS_SCHEMA 2
+
+bool _stats_enabled_ = false;
+
+static struct timespec _start_;
+static struct timespec _cpu_start_;
+static unsigned long long _commands_ = 0;
+static unsigned long long _amplitude_updates_ = 0;
+static int _peak_width_ = 0;
+static unsigned long long _to_dense_ = 0;
+static unsigned long long _to_sparse_ = 0;
+
+void stats_init() {
+  _stats_enabled_ = true;
+  clock_gettime( CLOCK_MONOTONIC, &_start_ );
+  // like the wall time, leave the setup before stats_init out
+  clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &_cpu_start_ );
+}
+
+void stats_touch( const quantum_reg* restrict reg ) {
+  // a dense tangle keeps no nodes, its 2^width amplitudes are touched
+  _amplitude_updates_ += reg->node ? reg->size : (1ULL << reg->width);
+  if( reg->width > _peak_width_ )
+    _peak_width_ = reg->width;
+}
+
+void stats_command() {
+  if( _stats_enabled_ )
+    ++_commands_;
+}
+
+void stats_conversion( bool to_dense ) {
+  if( !_stats_enabled_ )
+    return;
+  if( to_dense )
+    ++_to_dense_;
+  else
+    ++_to_sparse_;
+}
+
+static double seconds( struct timespec from, struct timespec to ) {
+  return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) * 1e-9;
+}
+
+void stats_write( const char* file, const char* program ) {
+  struct timespec now, cpu_now;
+  struct rusage usage;
+
+  if( !_stats_enabled_ )
+    return;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+  clock_gettime( CLOCK_PROCESS_CPUTIME_ID, &cpu_now );
+  getrusage( RUSAGE_SELF, &usage );
+  const double wall = seconds( _start_, now );
+  const double cpu = seconds( _cpu_start_, cpu_now );
+
+  FILE* output = fopen( file, "w" );
+  if( !output ) {
+    perror("ERROR: opening stats file");
+    return;
+  }
+  fprintf( output, "{\n" );
+  fprintf( output, "  \"schema\": %d,\n", STATS_SCHEMA );
+  fprintf( output, "  \"program\": \"%s\",\n", program ? program : "-" );
+  fprintf( output, "  \"wall_s\": %.6f,\n", wall );
+  fprintf( output, "  \"cpu_s\": %.6f,\n", cpu );
+  fprintf( output, "  \"peak_rss_kb\": %ld,\n", usage.ru_maxrss );
+  fprintf( output, "  \"peak_tangle_width\": %d,\n", _peak_width_ );
+  fprintf( output, "  \"commands\": %llu,\n", _commands_ );
+  fprintf( output, "  \"commands_per_s\": %.1f,\n",
+	   wall > 0 ? _commands_ / wall : 0.0 );
+  fprintf( output, "  \"amplitude_updates\": %llu,\n", _amplitude_updates_ );
+  fprintf( output, "  \"amplitude_updates_per_s\": %.1f,\n",
+	   wall > 0 ? _amplitude_updates_ / wall : 0.0 );
+  fprintf( output, "  \"to_dense_conversions\": %llu,\n", _to_dense_ );
+  fprintf( output, "  \"to_sparse_conversions\": %llu\n", _to_sparse_ );
+  fprintf( output, "}\n" );
+  fclose( output );
+}
@@ -0,0 +1,25 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "qvm.h"
+
+/* Run statistics for benchmarking (--stats=file).
+   Counts evaluated commands and amplitude updates (every amplitude a
+   kernel reads or writes counts once per kernel call) and tracks the
+   widest tangle and the sparse/dense conversions of tangles.  Wall and
+   CPU time since stats_init and the peak RSS are taken at the end.
+   When disabled, the hooks cost a single branch. */
+
+extern bool _stats_enabled_;
+
+#define STATS_TOUCH( reg ) \
+  do { if( _stats_enabled_ ) stats_touch( reg ); } while(0)
+
+void stats_init();
+void stats_touch( const quantum_reg* restrict reg );
+void stats_command();
+void stats_conversion( bool to_dense );
+// writes the statistics as a JSON object
+void stats_write( const char* file, const char* program );
+
+#endif
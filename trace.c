@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sexp.h>
+#include <sexp_ops.h>
+
+#include "qvm.h"
+#include "profile.h"
+#include "trace.h"
+#include "dense.h"
+
+bool _trace_enabled_ = false;
+
+static FILE* _trace_ = NULL;
+static unsigned long long _trace_start_;
+// qmem slots that had a tangle at the previous counter sample
+static unsigned char _live_slots_[BITNSLOTS(MAX_TANGLES)];
+static int _max_slot_ = -1;
+
+void trace_init( const char* file ) {
+  _trace_ = fopen( file, "w" );
+  if( !_trace_ ) {
+    perror("ERROR: opening trace file");
+    exit(EXIT_FAILURE);
+  }
+  _trace_enabled_ = true;
+  _trace_start_ = profile_now();
+  memset( _live_slots_, 0, sizeof(_live_slots_) );
+  fprintf( _trace_, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+	   "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+	   "\"args\": {\"name\": \"qvm\"}}" );
+}
+
+unsigned long long trace_begin() {
+  return _trace_enabled_ ? profile_now() : 0;
+}
+
+static double micros( unsigned long long ns ) {
+  return (ns - _trace_start_) * 1e-3;
+}
+
+static void trace_counters( const qmem_t* restrict qmem, double ts ) {
+  size_t amplitude_bytes = 0;
+  const tangle_t* tangle;
+
+  for( int i=0, tally=0 ; tally < qmem->size ; ++i ) {
+    tangle = qmem->tangles[i];
+    if( tangle == NULL )
+      continue;
+    amplitude_bytes += tangle_amplitude_bytes( tangle );
+    if( i > _max_slot_ )
+      _max_slot_ = i;
+    fprintf( _trace_, ",\n{\"name\": \"tangle %d\", \"ph\": \"C\", "
+	     "\"ts\": %.3f, \"pid\": 1, \"args\": "
+	     "{\"width\": %d, \"nodes\": %lu}}",
+	     i, ts, tangle->qureg.width,
+	     (unsigned long)tangle_amplitudes( tangle ) );
+    ++tally;
+  }
+  // close the tracks of tangles that went away
+  for( int i=0; i<=_max_slot_; ++i ) {
+    if( BITTEST(_live_slots_, i) && qmem->tangles[i] == NULL ) {
+      fprintf( _trace_, ",\n{\"name\": \"tangle %d\", \"ph\": \"C\", "
+	       "\"ts\": %.3f, \"pid\": 1, \"args\": "
+	       "{\"width\": 0, \"nodes\": 0}}", i, ts );
+      BITCLEAR(_live_slots_, i);
+    }
+    else if( qmem->tangles[i] )
+      BITSET(_live_slots_, i);
+  }
+  fprintf( _trace_, ",\n{\"name\": \"qmem\", \"ph\": \"C\", \"ts\": %.3f, "
+	   "\"pid\": 1, \"args\": {\"tangles\": %lu, "
+	   "\"amplitude_bytes\": %lu}}",
+	   ts, (unsigned long)qmem->size, (unsigned long)amplitude_bytes );
+}
+
+void trace_command( sexp_t* command,
+		    const qmem_t* restrict qmem,
+		    unsigned long long start ) {
+  if( !_trace_enabled_ )
+    return;
+  const unsigned long long end = profile_now();
+  fprintf( _trace_, ",\n{\"name\": \"%c\", \"ph\": \"X\", \"ts\": %.3f, "
+	   "\"dur\": %.3f, \"pid\": 1, \"tid\": 1, \"args\": "
+	   "{\"pc\": %lu, \"qids\": [",
+	   get_opname( command ), micros( start ), (end - start) * 1e-3,
+	   (unsigned long)qmem->pc );
+  // E has two qids, the other commands one, signals are not qids
+  const int qids = get_opname( command ) == 'E' ? 2 : 1;
+  const sexp_t* arg = next_sexp( command );
+  for( int i=0; i<qids && arg && arg->ty == SEXP_VALUE; ++i ) {
+    fprintf( _trace_, i ? ", %d" : "%d", atoi( arg->val ) );
+    arg = next_sexp( arg );
+  }
+  fprintf( _trace_, "]}}" );
+  trace_counters( qmem, micros( end ) );
+}
+
+void trace_finish() {
+  if( !_trace_enabled_ )
+    return;
+  fprintf( _trace_, "\n]}\n" );
+  fclose( _trace_ );
+  _trace_ = NULL;
+  _trace_enabled_ = false;
+}
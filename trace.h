@@ -0,0 +1,22 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "qvm.h"
+
+/* Timeline trace (--trace=file) in the Chrome trace-event format, to be
+   opened in chrome://tracing or ui.perfetto.dev.
+   Every command is a complete event carrying the qids it touched, followed
+   by counter tracks for the number of tangles in qmem, the total amplitude
+   bytes and the width and node count of each tangle (one track per qmem
+   slot, dropping to 0 when the tangle is gone). */
+
+extern bool _trace_enabled_;
+
+void trace_init( const char* file );
+unsigned long long trace_begin();
+void trace_command( sexp_t* command,
+		    const qmem_t* restrict qmem,
+		    unsigned long long start );
+void trace_finish();
+
+#endif
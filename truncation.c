@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "qvm.h"
+#include "truncation.h"
+#include "dense.h"
+
+bool _truncation_enabled_ = false;
+double _truncation_epsilon_ = TRUNCATION_DEFAULT_EPSILON;
+
+static double _budget_ = INFINITY;
+static bool _warn_only_ = false;
+static bool _warned_ = false;
+static double _error_ = 0;     // cumulative discarded probability mass
+static size_t _dropped_ = 0;   // amplitudes dropped
+
+void truncation_configure( const char* spec ) {
+  char buffer[64];
+  char* end;
+
+  if( strlen( spec ) >= sizeof(buffer) ) {
+    printf("ERROR: --truncate expects eps[,budget[,warn]], got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  strcpy( buffer, spec );
+  char* field = strtok( buffer, "," );
+  _truncation_epsilon_ = field ? strtod( field, &end ) : -1;
+  if( field == NULL || *end || !(_truncation_epsilon_ > 0) ) {
+    printf("ERROR: --truncate expects a positive eps, got '%s'\n", spec);
+    exit(EXIT_FAILURE);
+  }
+  if( (field = strtok( NULL, "," )) ) {
+    _budget_ = strtod( field, &end );
+    if( *end || !(_budget_ >= 0) ) {
+      printf("ERROR: --truncate expects a budget >= 0, got '%s'\n", field);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if( (field = strtok( NULL, "," )) ) {
+    if( strcmp( field, "warn" ) ) {
+      printf("ERROR: --truncate expects warn after the budget, got '%s'\n",
+	     field);
+      exit(EXIT_FAILURE);
+    }
+    _warn_only_ = true;
+  }
+  _truncation_enabled_ = true;
+}
+
+void truncation_reset() {
+  _error_ = 0;
+  _dropped_ = 0;
+  _warned_ = false;
+}
+
+double truncation_limit( int width ) {
+  return _truncation_epsilon_ / ldexp( 1.0, width );
+}
+
+void truncation_discarded( double mass ) {
+  _error_ += mass;
+  if( _error_ <= _budget_ )
+    return;
+  if( !_warn_only_ ) {
+    printf("ERROR: truncation discarded %g of probability mass, over the "
+	   "budget of %g\n", _error_, _budget_);
+    exit(EXIT_FAILURE);
+  }
+  if( !_warned_ ) {
+    printf("WARNING: truncation discarded %g of probability mass, over the "
+	   "budget of %g\n", _error_, _budget_);
+    _warned_ = true;
+  }
+}
+
+static double prune_dense( tangle_t* restrict tangle, double limit ) {
+  const size_t states = (size_t)1 << tangle->qureg.width;
+  COMPLEX_FLOAT* restrict amplitudes = tangle->amplitudes;
+  double kept = 0, discarded = 0;
+
+  for( size_t i=0; i<states; ++i ) {
+    const double p = quantum_prob_inline( amplitudes[i] );
+    if( p < limit )
+      discarded += p;
+    else
+      kept += p;
+  }
+  // never drop the whole state
+  if( discarded == 0 || kept == 0 )
+    return 0;
+  const float norm = sqrt( (kept + discarded) / kept );
+  size_t occupied = 0;
+  for( size_t i=0; i<states; ++i ) {
+    if( quantum_prob_inline( amplitudes[i] ) < limit ) {
+      _dropped_ += amplitudes[i] != 0;
+      amplitudes[i] = 0;
+    }
+    else {
+      amplitudes[i] *= norm;
+      ++occupied;
+    }
+  }
+  tangle->occupied = occupied;
+  return discarded / (kept + discarded);
+}
+
+static double prune_sparse( quantum_reg* restrict reg, double limit ) {
+  double kept = 0, discarded = 0;
+  int size = 0;
+
+  for( int i=0; i<reg->size; ++i ) {
+    const double p = quantum_prob_inline( reg->node[i].amplitude );
+    if( p < limit )
+      discarded += p;
+    else
+      kept += p;
+  }
+  if( discarded == 0 || kept == 0 )
+    return 0;
+  const float norm = sqrt( (kept + discarded) / kept );
+  for( int i=0; i<reg->size; ++i )
+    if( quantum_prob_inline( reg->node[i].amplitude ) >= limit ) {
+      reg->node[size] = reg->node[i];
+      reg->node[size].amplitude *= norm;
+      ++size;
+    }
+  _dropped_ += reg->size - size;
+  // libquantum rebuilds the hash table before its next lookup
+  quantum_memman( -(long)(reg->size - size) * (long)sizeof(quantum_reg_node) );
+  reg->node = realloc( reg->node, size * sizeof(quantum_reg_node) );
+  if( reg->node == NULL )
+    quantum_error(QUANTUM_ENOMEM);
+  reg->size = size;
+  return discarded / (kept + discarded);
+}
+
+double truncation_prune( tangle_t* restrict tangle ) {
+  const double limit = truncation_limit( tangle->qureg.width );
+  const double mass = is_dense( tangle ) ?
+    prune_dense( tangle, limit ) : prune_sparse( &tangle->qureg, limit );
+  if( mass > 0 )
+    truncation_discarded( mass );
+  return mass;
+}
+
+void truncation_print() {
+  if( !_truncation_enabled_ )
+    return;
+  printf("truncation below %g/2^width dropped %lu amplitudes, discarded "
+	 "probability mass %g", _truncation_epsilon_,
+	 (unsigned long)_dropped_, _error_);
+  if( isfinite( _budget_ ) )
+    printf(" (budget %g)", _budget_);
+  printf("\n");
+}
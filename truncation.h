@@ -0,0 +1,32 @@
+#ifndef TRUNCATION_H
+#define TRUNCATION_H
+
+#include "qvm.h"
+
+/* Approximate simulation (--truncate=eps[,budget[,warn]]).
+   After every measurement and every merge the amplitudes of the tangle
+   with a probability below eps / 2^width are dropped and the rest is
+   renormalized.  eps is relative to a uniform superposition, the limit
+   quantum_diag_measure (-m) has always used with eps = 1e-6, which now
+   takes eps as well.  The dropped probability mass is summed over the run
+   as the error estimate, to first order the infidelity of the final state;
+   once it exceeds budget the run stops, or only warns with ",warn".  The
+   total is printed at exit. */
+
+#define TRUNCATION_DEFAULT_EPSILON 1e-6
+
+extern bool _truncation_enabled_;
+extern double _truncation_epsilon_;
+
+void truncation_configure( const char* spec );
+// starts a new error estimate, for every request of a server worker
+void truncation_reset();
+// the probability below which the amplitudes of a register are dropped
+double truncation_limit( int width );
+// drops the small amplitudes of tangle, returns the discarded mass
+double truncation_prune( tangle_t* restrict tangle );
+// adds mass, relative to the norm, to the error estimate
+void truncation_discarded( double mass );
+void truncation_print();
+
+#endif
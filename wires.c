@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sexp.h>
+
+#include "qvm.h"
+#include "wires.h"
+
+typedef struct command {
+  sexp_t* exp;
+  char op;
+  qid_t targets[2];
+  int num_targets;
+  bool removed;
+} command_t;
+
+typedef struct program {
+  command_t* commands;
+  int size;
+  // the commands every qid is a target of, in program order
+  int* offsets;   // MAX_QUBITS + 1 entries into uses
+  int* uses;
+  bool* dirty;    // qids touched by a rewrite in the current pass
+} program_t;
+
+static bool parse_qid( const sexp_t* exp, qid_t* qid ) {
+  if( exp == NULL || exp->ty != SEXP_VALUE )
+    return false;
+  char* end;
+  const long value = strtol( exp->val, &end, 10 );
+  if( *end || value < 0 || value >= (long)MAX_QUBITS )
+    return false;
+  *qid = value;
+  return true;
+}
+
+/* syntactically zero, never asks for an angle constant */
+static bool zero_angle( const sexp_t* exp ) {
+  if( exp == NULL )
+    return true;  // default angle
+  if( exp->ty == SEXP_LIST )
+    return exp->list && exp->list->ty == SEXP_VALUE &&
+      strcmp( exp->list->val, "-" ) == 0 && exp->list->next &&
+      zero_angle( exp->list->next );
+  char* end;
+  return strtod( exp->val, &end ) == 0.0 && end != exp->val && *end == 0;
+}
+
+/* the signal is exactly (q qid) */
+static bool single_signal( const sexp_t* exp, qid_t qid ) {
+  qid_t signal;
+  return exp && exp->ty == SEXP_LIST && exp->list &&
+    exp->list->ty == SEXP_VALUE &&
+    (strcmp( exp->list->val, "q" ) == 0 || strcmp( exp->list->val, "Q" ) == 0) &&
+    parse_qid( exp->list->next, &signal ) && signal == qid &&
+    exp->list->next->next == NULL;
+}
+
+static const sexp_t* argument( const command_t* command, int n ) {
+  const sexp_t* exp = command->exp->list;
+  for( int i=0; exp && i<n; ++i )
+    exp = exp->next;
+  return exp;
+}
+
+// a measurement at angle 0 without t-signal: X basis
+static bool x_measurement( const command_t* command ) {
+  return command->op == 'M' && zero_angle( argument( command, 2 ) ) &&
+    argument( command, 4 ) == NULL;
+}
+
+static void read_commands( sexp_t* program, program_t* p ) {
+  int capacity = 0;
+  p->size = 0;
+  p->commands = NULL;
+  for( sexp_t* exp = program->list; exp; exp = exp->next ) {
+    if( p->size == capacity ) {
+      capacity = capacity ? 2 * capacity : 256;
+      p->commands = realloc( p->commands, capacity * sizeof(command_t) );
+      if( p->commands == NULL ) {
+	printf("ERROR: out of memory shortening wires\n");
+	exit(EXIT_FAILURE);
+      }
+    }
+    command_t* command = &p->commands[p->size++];
+    memset( command, 0, sizeof(command_t) );
+    command->exp = exp;
+    if( exp->ty != SEXP_LIST || exp->list == NULL ||
+	exp->list->ty != SEXP_VALUE )
+      continue;  // left to the evaluator to complain about
+    command->op = get_opname( exp->list );
+    const int arity = command->op == 'E' ? 2 :
+      command->op == 'M' || command->op == 'X' || command->op == 'Z' ? 1 : 0;
+    for( int i=0; i<arity; ++i )
+      if( !parse_qid( argument( command, i+1 ), &command->targets[i] ) ) {
+	command->op = 0;
+	break;
+      }
+    command->num_targets = command->op ? arity : 0;
+  }
+}
+
+static void index_uses( program_t* p ) {
+  memset( p->offsets, 0, (MAX_QUBITS + 1) * sizeof(int) );
+  for( int i=0; i<p->size; ++i )
+    if( !p->commands[i].removed )
+      for( int t=0; t<p->commands[i].num_targets; ++t )
+	++p->offsets[p->commands[i].targets[t] + 1];
+  for( size_t q=0; q<MAX_QUBITS; ++q )
+    p->offsets[q + 1] += p->offsets[q];
+  int* fill = calloc( MAX_QUBITS, sizeof(int) );
+  p->uses = realloc( p->uses, (p->offsets[MAX_QUBITS] + 1) * sizeof(int) );
+  if( fill == NULL || p->uses == NULL ) {
+    printf("ERROR: out of memory shortening wires\n");
+    exit(EXIT_FAILURE);
+  }
+  for( int i=0; i<p->size; ++i )
+    if( !p->commands[i].removed )
+      for( int t=0; t<p->commands[i].num_targets; ++t ) {
+	const qid_t qid = p->commands[i].targets[t];
+	p->uses[p->offsets[qid] + fill[qid]++] = i;
+      }
+  free( fill );
+}
+
+static qid_t partner( const command_t* e, qid_t qid ) {
+  return e->targets[0] == qid ? e->targets[1] : e->targets[0];
+}
+
+typedef struct wire {
+  qid_t a, b, c;
+  int e_ab, m_a, e_bc, m_b;
+} wire_t;
+
+/* checks that b is only the middle of the wire a -> b -> c */
+static bool middle_of_wire( const program_t* p, wire_t* w ) {
+  int entangled = 0;
+  w->c = -1;
+  w->m_b = -1;
+  w->e_bc = -1;
+  for( int u=p->offsets[w->b]; u<p->offsets[w->b + 1]; ++u ) {
+    const int i = p->uses[u];
+    const command_t* command = &p->commands[i];
+    switch( command->op ) {
+    case 'E':
+      ++entangled;
+      if( i != w->e_ab ) {
+	w->e_bc = i;
+	w->c = partner( command, w->b );
+      }
+      break;
+    case 'M':
+      if( !x_measurement( command ) || i < w->m_a )
+	return false;
+      w->m_b = i;
+      break;
+    case 'X':
+      if( i < w->m_a || !single_signal( argument( command, 2 ), w->a ) )
+	return false;
+      break;
+    default:
+      return false;
+    }
+  }
+  if( entangled != 2 || w->m_b < 0 || w->e_bc < 0 || w->e_bc > w->m_b ||
+      w->c == w->a || w->c == w->b || p->dirty[w->c] )
+    return false;
+  // X corrections on b must come before it is measured
+  for( int u=p->offsets[w->b]; u<p->offsets[w->b + 1]; ++u )
+    if( p->commands[p->uses[u]].op == 'X' && p->uses[u] > w->m_b )
+      return false;
+  // c is fresh until b is measured
+  for( int u=p->offsets[w->c]; u<p->offsets[w->c + 1]; ++u )
+    if( p->uses[u] < w->m_b && p->uses[u] != w->e_bc )
+      return false;
+  return true;
+}
+
+static bool find_wire( const program_t* p, const qmem_t* qmem, int m_a,
+		       wire_t* w ) {
+  w->a = p->commands[m_a].targets[0];
+  w->m_a = m_a;
+  if( p->dirty[w->a] || !x_measurement( &p->commands[m_a] ) )
+    return false;
+  // a ends at its measurement
+  for( int u=p->offsets[w->a]; u<p->offsets[w->a + 1]; ++u )
+    if( p->uses[u] > m_a )
+      return false;
+  for( int u=p->offsets[w->a]; u<p->offsets[w->a + 1]; ++u ) {
+    const command_t* e = &p->commands[p->uses[u]];
+    if( e->op != 'E' )
+      continue;
+    w->b = partner( e, w->a );
+    w->e_ab = p->uses[u];
+    if( w->b != w->a && !p->dirty[w->b] && middle_of_wire( p, w ) &&
+	find_qubit( w->a, qmem ).tangle == NULL &&
+	find_qubit( w->b, qmem ).tangle == NULL &&
+	find_qubit( w->c, qmem ).tangle == NULL )
+      return true;
+  }
+  return false;
+}
+
+static void rename_target( command_t* command, qid_t from, qid_t to ) {
+  char buffer[16];
+  const int length = snprintf( buffer, sizeof(buffer), "%d", to );
+  for( int t=0; t<command->num_targets; ++t ) {
+    if( command->targets[t] != from )
+      continue;
+    sexp_t* exp = (sexp_t*)argument( command, t+1 );
+    if( exp->val_allocated < (size_t)length + 1 ) {
+      exp->val = realloc( exp->val, length + 1 );
+      if( exp->val == NULL ) {
+	printf("ERROR: out of memory shortening wires\n");
+	exit(EXIT_FAILURE);
+      }
+      exp->val_allocated = length + 1;
+    }
+    memcpy( exp->val, buffer, length + 1 );
+    exp->val_used = length + 1;
+    command->targets[t] = to;
+  }
+}
+
+static int remove_wire( program_t* p, const wire_t* w, qmem_t* qmem ) {
+  int removed = 0;
+  const int remove[] = { w->e_ab, w->m_a, w->e_bc, w->m_b };
+  for( int i=0; i<4; ++i ) {
+    p->commands[remove[i]].removed = true;
+    ++removed;
+  }
+  for( int u=p->offsets[w->b]; u<p->offsets[w->b + 1]; ++u )
+    if( !p->commands[p->uses[u]].removed ) {
+      p->commands[p->uses[u]].removed = true;  // X b (q a)
+      ++removed;
+    }
+  for( int u=p->offsets[w->c]; u<p->offsets[w->c + 1]; ++u ) {
+    command_t* command = &p->commands[p->uses[u]];
+    if( command->op == 'X' && single_signal( argument( command, 2 ), w->b ) ) {
+      command->removed = true;
+      ++removed;
+    }
+  }
+  // the state of a now lives on c
+  for( int u=p->offsets[w->a]; u<p->offsets[w->a + 1]; ++u )
+    if( !p->commands[p->uses[u]].removed )
+      rename_target( &p->commands[p->uses[u]], w->a, w->c );
+  set_signal( w->a, 0, &qmem->signal_map );
+  set_signal( w->b, 0, &qmem->signal_map );
+  p->dirty[w->a] = p->dirty[w->b] = p->dirty[w->c] = true;
+  return removed;
+}
+
+void shorten_wires( sexp_t* program, qmem_t* restrict qmem, bool silent ) {
+  program_t p;
+  wire_t wire;
+  int qubits = 0, entangles = 0, commands = 0;
+  bool changed = true;
+
+  if( program == NULL || program->ty != SEXP_LIST )
+    return;
+  read_commands( program, &p );
+  p.offsets = malloc( (MAX_QUBITS + 1) * sizeof(int) );
+  p.uses = NULL;
+  p.dirty = malloc( MAX_QUBITS * sizeof(bool) );
+  if( p.offsets == NULL || p.dirty == NULL ) {
+    printf("ERROR: out of memory shortening wires\n");
+    exit(EXIT_FAILURE);
+  }
+  // a rewrite invalidates the uses of its qids, chains take several passes
+  while( changed ) {
+    changed = false;
+    index_uses( &p );
+    memset( p.dirty, 0, MAX_QUBITS * sizeof(bool) );
+    for( int i=0; i<p.size; ++i )
+      if( !p.commands[i].removed && p.commands[i].op == 'M' &&
+	  find_wire( &p, qmem, i, &wire ) ) {
+	commands += remove_wire( &p, &wire, qmem );
+	qubits += 2;
+	entangles += 2;
+	changed = true;
+      }
+  }
+
+  // unlink the removed commands
+  sexp_t** link = &program->list;
+  for( int i=0; i<p.size; ++i ) {
+    sexp_t* exp = p.commands[i].exp;
+    if( p.commands[i].removed ) {
+      exp->next = NULL;
+      destroy_sexp( exp );
+    }
+    else {
+      *link = exp;
+      link = &exp->next;
+    }
+  }
+  *link = NULL;
+
+  if( !silent )
+    printf("wire shortening removed %d qubits, %d E commands and %d commands in "
+	   "total\n", qubits, entangles, commands);
+  free( p.commands );
+  free( p.offsets );
+  free( p.uses );
+  free( p.dirty );
+}
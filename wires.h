@@ -0,0 +1,23 @@
+#ifndef WIRES_H
+#define WIRES_H
+
+#include "qvm.h"
+
+/* Wire shortening (--shorten-wires), run on the parsed program before it
+   is evaluated.
+   Removes wires of two X measurements (angle 0) in a row, the J(0) J(0) = I
+   pairs J-decomposition leaves behind:
+     (E a b) (M a 0) (X b (q a)) (E b c) (M b 0) (X c (q b))
+   becomes nothing, with the remaining commands on a renamed to c.  The
+   measured qubits are taken to have outcome 0, their signals are set in
+   qmem, so later signals depending on them stay valid; every outcome gives
+   the same output state in a deterministic pattern.  Wires whose middle
+   qubit takes part in anything else are left alone.  Prints the number of
+   qubits, E and other commands removed unless silent.
+   This is not general Pauli measurement elimination: lone X measurements
+   and Y measurements (angle PI/2), which need local complementation of the
+   graph and signal rewrites, are left to the evaluator. */
+
+void shorten_wires( sexp_t* program, qmem_t* restrict qmem, bool silent );
+
+#endif